@@ -1,6 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include "applog.h"
 
 #include "gcs.h"
@@ -28,19 +33,23 @@ VCOS_LOG_CAT_T app_log_category;
 		goto ERRHANDLER; \
 	}
 
-// Max number of simultaneous EGL images supported = max number of distinct video decoder buffers
-#define MAX_SIMUL_FRAMES 4
+// Upper bound of camera buffers with cached EGL images
+#define CAMGL_MAX_IMAGES 64
 
-// A camera frame with MMAL opaque buffer handle and corresponding EGL image
-typedef struct CamGL_FrameInternal
+// Planes of a camera buffer, indices of the CAMGL_PLANE_* flags
+#define CAMGL_PLANE_COUNT 4
+
+// Longest the prefetch thread waits for a camera frame before checking whether it should pause, quit or the stream stopped
+#define CAMGL_PREFETCH_WAIT_MS 50
+
+// EGL images of a MMAL opaque buffer handle, each plane created on first use
+typedef struct CamGL_Image
 {
-	void *mmalBufferHandle;
-	CamGL_FrameFormat format;
-	EGLImageKHR eglImageRGB;
-	EGLImageKHR eglImageY;
-	EGLImageKHR eglImageU;
-	EGLImageKHR eglImageV;
-} CamGL_FrameInternal;
+	void *mmalBufferHandle; // NULL if unused
+	EGLImageKHR eglImages[CAMGL_PLANE_COUNT]; // RGB, Y, U, V
+	uint32_t lastUsed; // Image clock when last used, for LRU eviction
+	int16_t next; // Next image in the same hash bucket, -1 at the end
+} CamGL_Image;
 
 /* Camera GL
 	Wrapper around GCS that sets up a OpenGL ES 2.0 environment and passes
@@ -65,17 +74,65 @@ typedef struct CamGL
 
 	// Realtime Threading
 	VCOS_MUTEX_T accessMutex; // For synchronising access to all fields
-
-	// Table of EGL images corresponding to MMAL opaque buffer handles
-	CamGL_FrameInternal frames[MAX_SIMUL_FRAMES];
+	void *frameBuffer; // Camera frame buffer of the current frame, leased until the next frame
+
+	// Prefetch thread waiting for camera frames and staging them for the GL thread
+	pthread_t prefetchThread;
+	pthread_mutex_t prefetchMutex; // Protects all prefetch fields
+	pthread_cond_t prefetchCond; // Signaled whenever a prefetch field changes
+	bool prefetchRunning;
+	bool prefetchQuit;
+	bool prefetchPaused; // Prefetch thread may not request frames, e.g. while buffers are reallocated
+	bool prefetchIdle; // Prefetch thread is not inside GCS
+	bool prefetchStopped; // Stream stopped, no more frames will be staged
+	void *stagedFrameBuffer; // Frame leased by the prefetch thread, not yet taken by the GL thread
+
+	// Cache of EGL images corresponding to MMAL opaque buffer handles, hashed by handle
+	CamGL_Image *images;
+	uint8_t imageCount;
+	int16_t *imageBuckets; // First image of each hash bucket, -1 if empty
+	uint8_t imageBucketBits;
+	uint32_t imageClock; // Counts frames for LRU eviction
+	uint32_t imageGeneration; // Camera rebuild generation of the buffers the images were created for
+	CamGL_Image *currentImage; // Image of the current frame
+	uint8_t boundPlanes; // CAMGL_PLANE_* flags of the current frame bound to the frame textures
+
+	// Previous frames, newest first. Texture names move along with the frames, so they never need rebinding
+	CamGL_Frame history[CAMGL_MAX_HISTORY];
+	void *historyFrameBuffers[CAMGL_MAX_HISTORY]; // Leased until the frame drops out of the history
+	CamGL_Image *historyImages[CAMGL_MAX_HISTORY]; // Pinned in the image cache
+	GLuint historyTextures[CAMGL_MAX_HISTORY][CAMGL_PLANE_COUNT]; // All texture names of a slot, also of unbound planes
+	uint8_t historyCount;
 } CamGL;
 
 /* Local function prototypes */
 static int camGL_initGL(CamGL *camGL);
 static void camGL_stopGL(CamGL *camGL);
 static void camGL_checkGL(CamGL *camGL, uint32_t line);
+static void camGL_destroyImages(CamGL *camGL);
+static CamGL_Image *camGL_lookupImage(CamGL *camGL, void *frameBuffer);
+static void camGL_evictImage(CamGL *camGL, CamGL_Image *image);
+static uint32_t camGL_hashHandle(CamGL *camGL, void *frameBuffer);
+static uint8_t camGL_getFormatPlanes(CamGL_FrameFormat format);
+static int camGL_bindPlaneImage(CamGL *camGL, int plane);
+static void camGL_pushHistory(CamGL *camGL);
+static void camGL_clearHistory(CamGL *camGL);
+static bool camGL_isImageInUse(CamGL *camGL, CamGL_Image *image);
+static bool camGL_isReleaseRequested(CamGL *camGL);
+static void camGL_releaseFrames(CamGL *camGL);
 
 static int camGL_processCameraFrame(CamGL *camGL, void *frameBuffer);
+static int camGL_prepareNextFrame(CamGL *camGL);
+static void camGL_retireFrame(CamGL *camGL);
+static int camGL_updateFrame(CamGL *camGL, void *cameraBufferHeader);
+
+static int camGL_startPrefetch(CamGL *camGL);
+static void camGL_stopPrefetch(CamGL *camGL);
+static void camGL_pausePrefetch(CamGL *camGL, bool pause);
+static void *camGL_prefetchThread(void *context);
+static void *camGL_takeStagedFrame(CamGL *camGL, bool wait);
+static void camGL_getDeadline(struct timespec *deadline, uint32_t timeoutMS);
+static uint64_t camGL_getMonotonicUS();
 
 static void camGL_setQuit(CamGL *camGL, bool error);
 static bool camGL_getQuit(CamGL *camGL);
@@ -106,7 +163,7 @@ CamGL *camGL_create(EGL_Setup EGLSetup, const CamGL_Params *params)
 	CHECK_STATUS_V(istatus, "Error initialising EGL", error_gl);
 
 	// Init GCS
-	GCS_CameraParams gcsParams;
+	GCS_CameraParams gcsParams = { 0 };
 	gcsParams.mmalEnc = 0;
 	gcsParams.width = params->width;
 	gcsParams.height = params->height;
@@ -114,11 +171,52 @@ CamGL *camGL_create(EGL_Setup EGLSetup, const CamGL_Params *params)
 	gcsParams.shutterSpeed = params->shutterSpeed;
 	gcsParams.iso = params->iso;
 	gcsParams.camera_num = params->camera_num;
+	gcsParams.bufferCount = params->bufferCount;
+	gcsParams.framePolicy = params->framePolicy;
+	gcsParams.queueDepth = params->queueDepth;
 
 	camGL->gcs = gcs_create(&gcsParams);
 
 	CHECK_STATUS_V(camGL->gcs? 0 : 1, "Error initialising GCS", error_gcs);
 
+	// Prefetching holds the staged frame in addition to the current one
+	if (camGL->params.prefetch && gcs_getMaxLeasedFrames(camGL->gcs) < 2)
+	{
+		vcos_log_error("Prefetching needs at least 4 camera buffers, disabled!");
+		camGL->params.prefetch = 0;
+	}
+
+	// Each history frame holds a camera buffer in addition to the current one and the next one (staged or requested),
+	// which is taken before the current frame is returned so that it stays valid if there is none
+	uint8_t maxHistory = gcs_getMaxLeasedFrames(camGL->gcs) - 2;
+	if (camGL->params.historyLength > maxHistory)
+	{
+		vcos_log_error("Only %d history frames possible with %d camera buffers!", maxHistory, gcs_getCameraParams(camGL->gcs)->bufferCount);
+		camGL->params.historyLength = maxHistory;
+	}
+
+	// Cache EGL images of every camera buffer by default, more only help if buffers are replaced
+	uint32_t imageCount = params->imageCacheSize != 0? params->imageCacheSize : gcs_getCameraParams(camGL->gcs)->bufferCount;
+	if (imageCount < camGL->params.historyLength + 2u) // Pinned images plus one to claim
+		imageCount = camGL->params.historyLength + 2u;
+	camGL->imageCount = imageCount < 2? 2 : (imageCount > CAMGL_MAX_IMAGES? CAMGL_MAX_IMAGES : imageCount);
+	camGL->imageBucketBits = 1;
+	while ((1u << camGL->imageBucketBits) < 2u*camGL->imageCount)
+		camGL->imageBucketBits++;
+	camGL->images = vcos_calloc(camGL->imageCount, sizeof(CamGL_Image), "camGL-images");
+	camGL->imageBuckets = vcos_malloc((1 << camGL->imageBucketBits) * sizeof(int16_t), "camGL-image-buckets");
+	CHECK_STATUS_V((camGL->images && camGL->imageBuckets? VCOS_SUCCESS : VCOS_ENOMEM), "Error allocating image cache", error_images);
+	camGL_destroyImages(camGL);
+
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	vstatus = pthread_cond_init(&camGL->prefetchCond, &condAttr) == 0? VCOS_SUCCESS : VCOS_ENOMEM;
+	pthread_condattr_destroy(&condAttr);
+	CHECK_STATUS_V(vstatus, "Error creating prefetch condition", error_prefetchCond);
+	vstatus = pthread_mutex_init(&camGL->prefetchMutex, NULL) == 0? VCOS_SUCCESS : VCOS_ENOMEM;
+	CHECK_STATUS_V(vstatus, "Error creating prefetch mutex", error_prefetchMutex);
+
 	camGL->quit = false;
 	camGL->error = false;
 
@@ -126,6 +224,14 @@ CamGL *camGL_create(EGL_Setup EGLSetup, const CamGL_Params *params)
 
 	return camGL;
 
+error_prefetchMutex:
+	pthread_cond_destroy(&camGL->prefetchCond);
+error_prefetchCond:
+error_images:
+	vcos_free(camGL->images);
+	vcos_free(camGL->imageBuckets);
+	camGL->images = NULL;
+	gcs_destroy(camGL->gcs);
 error_gcs:
 	camGL_stopGL(camGL);
 error_gl:
@@ -138,8 +244,14 @@ error_ctx:
 
 void camGL_destroy(CamGL *camGL)
 {
+	camGL_stopPrefetch(camGL);
+	camGL_clearHistory(camGL);
 	gcs_destroy(camGL->gcs);
 	camGL_stopGL(camGL);
+	vcos_free(camGL->images);
+	vcos_free(camGL->imageBuckets);
+	pthread_mutex_destroy(&camGL->prefetchMutex);
+	pthread_cond_destroy(&camGL->prefetchCond);
 	vcos_mutex_delete(&camGL->accessMutex);
 	vcos_free(camGL);
 }
@@ -151,6 +263,9 @@ static int camGL_initGL(CamGL *camGL)
 	glGenTextures(1, &camGL->frame.textureY);
 	glGenTextures(1, &camGL->frame.textureU);
 	glGenTextures(1, &camGL->frame.textureV);
+	if (camGL->params.historyLength > CAMGL_MAX_HISTORY)
+		camGL->params.historyLength = CAMGL_MAX_HISTORY;
+	glGenTextures(camGL->params.historyLength * CAMGL_PLANE_COUNT, &camGL->historyTextures[0][0]);
 
 	// Init GL for video processing
 	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
@@ -171,23 +286,96 @@ static int camGL_initGL(CamGL *camGL)
 
 static void camGL_stopGL(CamGL *camGL)
 {
-	// Delete EGL images
-	for (int i = 0; i < MAX_SIMUL_FRAMES; i++)
-	{
-		CamGL_FrameInternal *slot = &camGL->frames[i];
-		slot->mmalBufferHandle = NULL;
-		if (slot->eglImageRGB) eglDestroyImageKHR(camGL->eglSetup.display, slot->eglImageRGB);
-		if (slot->eglImageY) eglDestroyImageKHR(camGL->eglSetup.display, slot->eglImageY);
-		if (slot->eglImageU) eglDestroyImageKHR(camGL->eglSetup.display, slot->eglImageU);
-		if (slot->eglImageV) eglDestroyImageKHR(camGL->eglSetup.display, slot->eglImageV);
-		slot->eglImageRGB = slot->eglImageY = slot->eglImageU = slot->eglImageV = NULL;
-	}
+	camGL_clearHistory(camGL);
+	camGL_destroyImages(camGL);
 
 	// Delete frame textures
 	glDeleteTextures(1, &camGL->frame.textureRGB);
 	glDeleteTextures(1, &camGL->frame.textureY);
 	glDeleteTextures(1, &camGL->frame.textureU);
 	glDeleteTextures(1, &camGL->frame.textureV);
+	glDeleteTextures(CAMGL_MAX_HISTORY * CAMGL_PLANE_COUNT, &camGL->historyTextures[0][0]);
+}
+
+/** Deletes the EGL images of all camera buffers, they are recreated when the buffers are next received */
+static void camGL_destroyImages(CamGL *camGL)
+{
+	if (!camGL->images) return;
+	for (int i = 0; i < camGL->imageCount; i++)
+		camGL_evictImage(camGL, &camGL->images[i]);
+	for (int i = 0; i < (1 << camGL->imageBucketBits); i++)
+		camGL->imageBuckets[i] = -1;
+	camGL->currentImage = NULL;
+	camGL->boundPlanes = 0;
+}
+
+/** Returns the cache entry of the buffer, claiming an unused or the least recently used one if it has none */
+static CamGL_Image *camGL_lookupImage(CamGL *camGL, void *frameBuffer)
+{
+	uint32_t bucket = camGL_hashHandle(camGL, frameBuffer);
+	for (int16_t i = camGL->imageBuckets[bucket]; i >= 0; i = camGL->images[i].next)
+	{
+		if (camGL->images[i].mmalBufferHandle == frameBuffer)
+			return &camGL->images[i];
+	}
+
+	// Buffer not cached yet, take an unused entry or evict the stalest one
+	CamGL_Image *image = NULL;
+	for (int i = 0; i < camGL->imageCount; i++)
+	{
+		CamGL_Image *candidate = &camGL->images[i];
+		if (camGL_isImageInUse(camGL, candidate))
+			continue; // Still bound as the current or a history frame
+		if (candidate->mmalBufferHandle == NULL)
+		{
+			image = candidate;
+			break;
+		}
+		if (!image || candidate->lastUsed < image->lastUsed)
+			image = candidate;
+	}
+	if (!image)
+	{
+		vcos_log_error("No EGL image cache entry available!");
+		return NULL;
+	}
+	if (image->mmalBufferHandle)
+	{
+		vcos_log_trace("Evicting EGL images of buffer %p", image->mmalBufferHandle);
+		camGL_evictImage(camGL, image);
+	}
+
+	image->mmalBufferHandle = frameBuffer;
+	image->next = camGL->imageBuckets[bucket];
+	camGL->imageBuckets[bucket] = image - camGL->images;
+	return image;
+}
+
+/** Destroys the EGL images of the entry and removes it from its hash bucket */
+static void camGL_evictImage(CamGL *camGL, CamGL_Image *image)
+{
+	if (image->mmalBufferHandle)
+	{
+		int16_t index = image - camGL->images;
+		int16_t *link = &camGL->imageBuckets[camGL_hashHandle(camGL, image->mmalBufferHandle)];
+		while (*link >= 0 && *link != index)
+			link = &camGL->images[*link].next;
+		if (*link == index)
+			*link = image->next;
+	}
+	for (int p = 0; p < CAMGL_PLANE_COUNT; p++)
+	{
+		if (image->eglImages[p]) eglDestroyImageKHR(camGL->eglSetup.display, image->eglImages[p]);
+		image->eglImages[p] = NULL;
+	}
+	image->mmalBufferHandle = NULL;
+	image->next = -1;
+}
+
+/** Hashes the buffer handle to a bucket, handles are aligned pointers so the low bits carry little information */
+static uint32_t camGL_hashHandle(CamGL *camGL, void *frameBuffer)
+{
+	return ((uint32_t)((uintptr_t)frameBuffer >> 4) * 2654435761u) >> (32 - camGL->imageBucketBits);
 }
 
 static void camGL_checkGL(CamGL *camGL, uint32_t line)
@@ -220,12 +408,18 @@ uint8_t camGL_startCamera(CamGL *camGL)
 	// Reset stats and flags
 	camGL->quit = false;
 	camGL->error = false;
+	camGL->frame.sequence = 0;
 
 	// Start GPU Camera Stream and process incoming frames
 	if (gcs_start(camGL->gcs) == 0)
 	{
 		vcos_log_info("Started GCS!");
 		camGL->started = true;
+		if (camGL->params.prefetch && camGL_startPrefetch(camGL) != 0)
+		{
+			vcos_log_error("Failed to start prefetch thread!");
+			camGL->params.prefetch = 0;
+		}
 		return CAMGL_SUCCESS;
 	}
 	else
@@ -248,6 +442,11 @@ uint8_t camGL_stopCamera(CamGL *camGL)
 		// Stop
 		camGL->started = false;
 		camGL_setQuit(camGL, false);
+		camGL_stopPrefetch(camGL);
+		camGL_clearHistory(camGL);
+		if (camGL->frameBuffer)
+			gcs_releaseFrameBuffer(camGL->gcs, camGL->frameBuffer);
+		camGL->frameBuffer = NULL;
 		gcs_stop(camGL->gcs);
 
 		// Log potential errors
@@ -260,11 +459,14 @@ uint8_t camGL_stopCamera(CamGL *camGL)
 
 	// Make sure buffers are released
 	glFlush();
-	glClearColor(0, 0, 0, 0);
-	for (uint8_t i = 0; i < 10; i++)
-	{
-		glClear(GL_COLOR_BUFFER_BIT);
-		eglSwapBuffers(camGL->eglSetup.display, camGL->eglSetup.surface);
+	if (camGL->eglSetup.surface != EGL_NO_SURFACE)
+	{ // Not needed for surfaceless setups
+		glClearColor(0, 0, 0, 0);
+		for (uint8_t i = 0; i < 10; i++)
+		{
+			glClear(GL_COLOR_BUFFER_BIT);
+			eglSwapBuffers(camGL->eglSetup.display, camGL->eglSetup.surface);
+		}
 	}
 	glFlush();
 	CHECK_GL(camGL);
@@ -281,13 +483,153 @@ CamGL_Frame* camGL_getFrame(CamGL *camGL)
 /* Returns whether there is a new camera frame available */
 uint8_t camGL_hasNextFrame(CamGL *camGL)
 {
+	if (camGL->prefetchRunning)
+	{
+		pthread_mutex_lock(&camGL->prefetchMutex);
+		bool staged = camGL->stagedFrameBuffer != NULL;
+		pthread_mutex_unlock(&camGL->prefetchMutex);
+		if (staged) return 1;
+	}
 	return gcs_hasFrameBuffer(camGL->gcs);
 }
 
+/* Returns the frame counters of the camera stream since start */
+void camGL_getStats(CamGL *camGL, GCS_Stats *stats)
+{
+	gcs_getStats(camGL->gcs, stats);
+}
+
 /* Updates the frame structure with the most recent camera frame. 
  * If no camera frame is available yet, blocks until there is.
  * If the last frame has not been returned yet or camera stream was interrupted, returns error code. */
 int camGL_nextFrame(CamGL *camGL)
+{
+	int status = camGL_prepareNextFrame(camGL);
+	if (status != CAMGL_SUCCESS)
+		return status;
+
+	void *cameraBufferHeader;
+	while (true)
+	{
+		cameraBufferHeader = camGL->prefetchRunning?
+			camGL_takeStagedFrame(camGL, true) : gcs_requestFrameBuffer(camGL->gcs);
+		if (cameraBufferHeader || !camGL_isReleaseRequested(camGL))
+			break;
+		// Camera is rebuilt with new buffers, wait for its frames without the old ones
+		camGL_releaseFrames(camGL);
+	}
+	if (cameraBufferHeader)
+		return camGL_updateFrame(camGL, cameraBufferHeader);
+	vcos_log_error("No frame received!");
+	return CAMGL_NO_FRAMES;
+}
+
+/* Updates the frame structure with the next camera frame if one is ready, never blocks.
+ * Returns CAMGL_NO_FRAMES if there is none yet, the previous frame stays valid then. */
+int camGL_tryNextFrame(CamGL *camGL)
+{
+	if (!camGL_hasNextFrame(camGL) && !camGL_getQuit(camGL))
+		return CAMGL_NO_FRAMES;
+
+	// The previous frame is only returned once the next one is in hand, a frame in GCS may not be staged yet
+	int status = camGL_prepareNextFrame(camGL);
+	if (status != CAMGL_SUCCESS)
+		return status;
+
+	void *cameraBufferHeader = camGL->prefetchRunning?
+		camGL_takeStagedFrame(camGL, false) : gcs_tryRequestFrameBuffer(camGL->gcs);
+	if (cameraBufferHeader)
+		return camGL_updateFrame(camGL, cameraBufferHeader);
+	if (camGL_isReleaseRequested(camGL))
+		camGL_releaseFrames(camGL);
+	return CAMGL_NO_FRAMES;
+}
+
+/* Sets the region of the sensor image scaled to the frames while running (see gcs_setCrop) */
+int camGL_setCrop(CamGL *camGL, float x, float y, float width, float height)
+{
+	return gcs_setCrop(camGL->gcs, x, y, width, height);
+}
+
+/* Changes frame size and fps without restarting the camera (see gcs_setOutputFormat) */
+int camGL_setOutputFormat(CamGL *camGL, uint16_t width, uint16_t height, uint16_t fps)
+{
+	// Return the current, staged and history frames, the textures of the current frame stay bound until the next frame
+	camGL_pausePrefetch(camGL, true);
+	camGL_clearHistory(camGL);
+	gcs_returnFrameBuffer(camGL->gcs);
+	camGL->frameBuffer = NULL;
+	int status = gcs_setOutputFormat(camGL->gcs, width, height, fps);
+	camGL_pausePrefetch(camGL, false);
+	if (status != 0)
+		return CAMGL_ERROR;
+	camGL->params.width = width;
+	camGL->params.height = height;
+	camGL->params.fps = fps;
+	return CAMGL_SUCCESS;
+}
+
+/* Queues a batch of camera control changes, applied between frames (see gcs_setControls) */
+int camGL_setControls(CamGL *camGL, const GCS_Controls *controls)
+{
+	return gcs_setControls(camGL->gcs, controls) == 0? CAMGL_SUCCESS : CAMGL_ERROR;
+}
+
+/* Returns the requested values of all camera controls */
+void camGL_getControls(CamGL *camGL, GCS_Controls *controls)
+{
+	gcs_getControls(camGL->gcs, controls);
+}
+
+/* Returns the underlying camera stream */
+GCS *camGL_getGCS(CamGL *camGL)
+{
+	return camGL->gcs;
+}
+
+/* Updates the frame structures of both cameras with the next pair of frames matched by the stereo capture */
+int camGL_nextFramePair(CamGL *left, CamGL *right, StereoCapture *stereo, uint32_t timeoutMS)
+{
+	if (left->prefetchRunning || right->prefetchRunning)
+	{ // Would take frames away from the stereo capture
+		vcos_log_error("Frame pairs can not be requested with prefetching!");
+		return CAMGL_ERROR;
+	}
+	int status = camGL_prepareNextFrame(left);
+	if (status != CAMGL_SUCCESS)
+		return status;
+	status = camGL_prepareNextFrame(right);
+	if (status != CAMGL_SUCCESS)
+		return status;
+
+	// Current frames are only returned once a pair is in hand, so they stay valid on a timeout
+	StereoPair pair;
+	if (!stereo_requestPair(stereo, &pair, timeoutMS))
+	{ // Recovery of one camera may need its frames to rebuild it
+		if (camGL_isReleaseRequested(left))
+			camGL_releaseFrames(left);
+		if (camGL_isReleaseRequested(right))
+			camGL_releaseFrames(right);
+		vcos_log_error("No frame pair received!");
+		return CAMGL_NO_FRAMES;
+	}
+	status = camGL_updateFrame(left, pair.frames[0]);
+	if (status != CAMGL_SUCCESS)
+	{
+		gcs_releaseFrameBuffer(right->gcs, pair.frames[1]);
+		return status;
+	}
+	return camGL_updateFrame(right, pair.frames[1]);
+}
+
+/* Returns a file descriptor that is readable when a new camera frame may be available (see gcs_getFrameEventFD) */
+int camGL_getFrameEventFD(CamGL *camGL)
+{
+	return gcs_getFrameEventFD(camGL->gcs);
+}
+
+/** Checks the stream state before requesting the next frame */
+static int camGL_prepareNextFrame(CamGL *camGL)
 {
 	if (!camGL->started)
 	{
@@ -300,119 +642,366 @@ int camGL_nextFrame(CamGL *camGL)
 		uint8_t code = camGL_stopCamera(camGL);
 		return code? CAMGL_QUIT : code;
 	}
+	return CAMGL_SUCCESS;
+}
 
-	gcs_returnFrameBuffer(camGL->gcs);
+/** Moves the current frame into the history or returns it, only the current one since the prefetch thread may hold the next */
+static void camGL_retireFrame(CamGL *camGL)
+{
+	if (camGL->params.historyLength > 0)
+		camGL_pushHistory(camGL);
+	else if (camGL->frameBuffer)
+		gcs_releaseFrameBuffer(camGL->gcs, camGL->frameBuffer);
+	camGL->frameBuffer = NULL;
+}
 
-	void *cameraBufferHeader = gcs_requestFrameBuffer(camGL->gcs);
-	if (cameraBufferHeader)
+/** Updates the frame structure with the requested camera frame, retiring the current frame */
+static int camGL_updateFrame(CamGL *camGL, void *cameraBufferHeader)
+{
+	camGL_retireFrame(camGL);
+	camGL->frameBuffer = cameraBufferHeader;
+	const GCS_FrameInfo *info = gcs_getFrameBufferInfo(cameraBufferHeader);
+	uint32_t lastSequence = camGL->frame.sequence;
+	camGL->frame.captureUS = info->captureUS;
+	camGL->frame.arrivalUS = info->arrivalUS;
+	camGL->frame.sequence = info->sequence;
+	camGL->frame.droppedFrames = info->sequence > lastSequence+1? info->sequence - lastSequence - 1 : 0;
+	camGL->frame.crop = info->crop;
+	if (info->width != camGL->frame.width || info->height != camGL->frame.height || info->generation != camGL->imageGeneration)
+	{ // Output format changed or camera rebuilt, images and history of the previous buffers are invalid
+		camGL_clearHistory(camGL);
+		camGL_destroyImages(camGL);
+		camGL->frame.width = info->width;
+		camGL->frame.height = info->height;
+		camGL->imageGeneration = info->generation;
+	}
+
+	void *cameraBuffer = gcs_getFrameBufferData(cameraBufferHeader);
+	if (camGL_processCameraFrame(camGL, cameraBuffer) == 0)
 	{
-		void *cameraBuffer = gcs_getFrameBufferData(cameraBufferHeader);
-		if (camGL_processCameraFrame(camGL, cameraBuffer) == 0)
-			return CAMGL_SUCCESS;
-		vcos_log_error("Failed to process frame!");
-		return CAMGL_ERROR;
+		camGL->frame.boundUS = camGL_getMonotonicUS();
+		return CAMGL_SUCCESS;
 	}
-	else 
-		vcos_log_error("No frame received!");
-	return CAMGL_NO_FRAMES;
+	vcos_log_error("Failed to process frame!");
+	return CAMGL_ERROR;
 }
 
 /** Process one incoming camera frame buffer */
 static int camGL_processCameraFrame(CamGL *camGL, void *frameBuffer)
 {
-	/* Lookup or create EGL image corresponding to supplied buffer handle
-	 * Frames array is filled in sequentially and frames are bound to one buffer over their lifetime */
-	int i;
-	CamGL_FrameInternal *frameInt = NULL;
-	for (i = 0; i < MAX_SIMUL_FRAMES; i++)
+	// Lookup or claim the EGL images corresponding to the supplied buffer handle
+	CamGL_Image *image = camGL_lookupImage(camGL, frameBuffer);
+	if (!image)
+		return -1;
+	image->lastUsed = ++camGL->imageClock;
+	camGL->currentImage = image;
+	camGL->boundPlanes = 0;
+
+	// Create frame information for client (size is set from the frame info)
+	camGL->frame.format = camGL->params.format;
+
+	// Bind planes sampled every frame to textures, others are only created and bound on request
+	uint8_t planes = camGL_getFormatPlanes(camGL->params.format);
+	if (camGL->params.planes != 0)
+		planes &= camGL->params.planes;
+	for (int p = 0; p < CAMGL_PLANE_COUNT; p++)
 	{
-		frameInt = &camGL->frames[i];
-		if (frameInt->mmalBufferHandle == frameBuffer)
-		{ // Found cached frame and corresponding image
-			break;
-		}
+		if ((planes & (1 << p)) && camGL_bindPlaneImage(camGL, p) != 0)
+			return -1;
+	}
+	return 0;
+}
 
-		if (frameInt->mmalBufferHandle == NULL)
-		{ // Found unused frame - buffer has yet to be cached and associated with an image
-			CHECK_GL(camGL);
-
-			EGLint createAttributes[] = {
-				EGL_IMAGE_PRESERVED_KHR, GL_TRUE,
-				EGL_NONE
-			};
-
-			// Create EGL textures from frame buffers according to format
-			if (camGL->params.format == CAMGL_RGB)
-			{
-				frameInt->eglImageRGB = eglCreateImageKHR(camGL->eglSetup.display, EGL_NO_CONTEXT, EGL_IMAGE_BRCM_MULTIMEDIA, (EGLClientBuffer)frameBuffer, createAttributes);
-				CHECK_EVAL(frameInt->eglImageRGB != EGL_NO_IMAGE_KHR, "Failed to convert frame buffer to RGB EGL image!", errorKHR);
-			}
-			else
-			{
-				frameInt->eglImageY = eglCreateImageKHR(camGL->eglSetup.display, EGL_NO_CONTEXT, EGL_IMAGE_BRCM_MULTIMEDIA_Y, (EGLClientBuffer)frameBuffer, createAttributes);
-				CHECK_EVAL(frameInt->eglImageY != EGL_NO_IMAGE_KHR, "Failed to convert frame buffer to Y EGL image!", errorKHR);
-				if (camGL->params.format == CAMGL_YUV)
-				{
-					frameInt->eglImageU = eglCreateImageKHR(camGL->eglSetup.display, EGL_NO_CONTEXT, EGL_IMAGE_BRCM_MULTIMEDIA_U, (EGLClientBuffer)frameBuffer, createAttributes);
-					CHECK_EVAL(frameInt->eglImageU != EGL_NO_IMAGE_KHR, "Failed to convert frame buffer to U EGL image!", errorKHRU);
-					frameInt->eglImageV = eglCreateImageKHR(camGL->eglSetup.display, EGL_NO_CONTEXT, EGL_IMAGE_BRCM_MULTIMEDIA_V, (EGLClientBuffer)frameBuffer, createAttributes);
-					CHECK_EVAL(frameInt->eglImageV != EGL_NO_IMAGE_KHR, "Failed to convert frame buffer to V EGL image!", errorKHRV);
-				}
-			}
-
-			// Success
-			vcos_log_trace("Created EGL images format %d for buffer index %d", camGL->params.format, i);
-			frameInt->mmalBufferHandle = frameBuffer;
-			frameInt->format = camGL->params.format;
-			CHECK_GL(camGL);
-			break;
+const CamGL_Frame *camGL_getFrameHistory(CamGL *camGL, uint8_t *count)
+{
+	*count = camGL->historyCount;
+	return camGL->history;
+}
 
-			// Handle Error
-			errorKHRV:
-			eglDestroyImageKHR(camGL->eglSetup.display, frameInt->eglImageU);
-			errorKHRU:
-			eglDestroyImageKHR(camGL->eglSetup.display, frameInt->eglImageY);
-			errorKHR:
-			frameInt->eglImageRGB = frameInt->eglImageY = frameInt->eglImageU = frameInt->eglImageV = NULL;
+/* Binds the plane of the current frame to its texture, creating its EGL image on first use. Returns the texture, 0 on failure */
+GLuint camGL_bindPlane(CamGL *camGL, CamGL_Plane plane)
+{
+	for (int p = 0; p < CAMGL_PLANE_COUNT; p++)
+	{
+		if (plane != (1 << p)) continue;
+		if (!camGL->currentImage || !(camGL_getFormatPlanes(camGL->params.format) & plane))
+			return 0;
+		if (camGL_bindPlaneImage(camGL, p) != 0)
+			return 0;
+		GLuint textures[CAMGL_PLANE_COUNT] = { camGL->frame.textureRGB, camGL->frame.textureY, camGL->frame.textureU, camGL->frame.textureV };
+		return textures[p];
+	}
+	return 0;
+}
+
+/** Binds the image of the plane of the current frame to the frame texture, creating the image if needed */
+static int camGL_bindPlaneImage(CamGL *camGL, int plane)
+{
+	if (camGL->boundPlanes & (1 << plane))
+		return 0;
+	CamGL_Image *image = camGL->currentImage;
+	if (!image->eglImages[plane])
+	{
+		static const EGLenum targets[CAMGL_PLANE_COUNT] = { EGL_IMAGE_BRCM_MULTIMEDIA, EGL_IMAGE_BRCM_MULTIMEDIA_Y, EGL_IMAGE_BRCM_MULTIMEDIA_U, EGL_IMAGE_BRCM_MULTIMEDIA_V };
+		EGLint createAttributes[] = {
+			EGL_IMAGE_PRESERVED_KHR, GL_TRUE,
+			EGL_NONE
+		};
+		CHECK_GL(camGL);
+		image->eglImages[plane] = eglCreateImageKHR(camGL->eglSetup.display, EGL_NO_CONTEXT, targets[plane], (EGLClientBuffer)image->mmalBufferHandle, createAttributes);
+		if (image->eglImages[plane] == EGL_NO_IMAGE_KHR)
+		{
+			image->eglImages[plane] = NULL;
+			vcos_log_error("Failed to convert frame buffer to EGL image of plane %d!", plane);
 			return -1;
 		}
+		vcos_log_trace("Created EGL image of plane %d for buffer %p", plane, image->mmalBufferHandle);
 	}
 
-	if (i == MAX_SIMUL_FRAMES)
+	GLuint textures[CAMGL_PLANE_COUNT] = { camGL->frame.textureRGB, camGL->frame.textureY, camGL->frame.textureU, camGL->frame.textureV };
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, textures[plane]);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image->eglImages[plane]);
+	CHECK_GL(camGL);
+	camGL->boundPlanes |= 1 << plane;
+	return 0;
+}
+
+/** Moves the current frame into the history with its textures, releasing the oldest frame if the history is full.
+ * The current frame continues with the texture names of a free or the dropped history slot */
+static void camGL_pushHistory(CamGL *camGL)
+{
+	if (!camGL->frameBuffer || !camGL->currentImage)
+		return;
+	uint8_t length = camGL->params.historyLength;
+	uint8_t slot = camGL->historyCount < length? camGL->historyCount : length-1;
+	if (camGL->historyCount == length)
+		gcs_releaseFrameBuffer(camGL->gcs, camGL->historyFrameBuffers[slot]);
+	GLuint spareTextures[CAMGL_PLANE_COUNT];
+	memcpy(spareTextures, camGL->historyTextures[slot], sizeof(spareTextures));
+	for (int i = slot; i > 0; i--)
 	{
-		vcos_log_error("Exceeded configured max number of EGL images");
-		return -1;
+		camGL->history[i] = camGL->history[i-1];
+		camGL->historyFrameBuffers[i] = camGL->historyFrameBuffers[i-1];
+		camGL->historyImages[i] = camGL->historyImages[i-1];
+		memcpy(camGL->historyTextures[i], camGL->historyTextures[i-1], sizeof(spareTextures));
 	}
 
-	// Create frame information for client
-	camGL->frame.format = frameInt->format;
-	camGL->frame.width = camGL->params.width;
-	camGL->frame.height = camGL->params.height;
+	// Only planes bound while current hold the image of this frame
+	CamGL_Frame *frame = &camGL->frame;
+	GLuint *textures = camGL->historyTextures[0];
+	textures[0] = frame->textureRGB;
+	textures[1] = frame->textureY;
+	textures[2] = frame->textureU;
+	textures[3] = frame->textureV;
+	camGL->history[0] = *frame;
+	camGL->history[0].textureRGB = (camGL->boundPlanes & CAMGL_PLANE_RGB)? textures[0] : 0;
+	camGL->history[0].textureY = (camGL->boundPlanes & CAMGL_PLANE_Y)? textures[1] : 0;
+	camGL->history[0].textureU = (camGL->boundPlanes & CAMGL_PLANE_U)? textures[2] : 0;
+	camGL->history[0].textureV = (camGL->boundPlanes & CAMGL_PLANE_V)? textures[3] : 0;
+	camGL->historyFrameBuffers[0] = camGL->frameBuffer;
+	camGL->historyImages[0] = camGL->currentImage;
+	if (camGL->historyCount < length)
+		camGL->historyCount++;
+
+	frame->textureRGB = spareTextures[0];
+	frame->textureY = spareTextures[1];
+	frame->textureU = spareTextures[2];
+	frame->textureV = spareTextures[3];
+	camGL->frameBuffer = NULL;
+	camGL->currentImage = NULL;
+	camGL->boundPlanes = 0;
+}
 
-	// Bind images to textures
-	if (frameInt->format == CAMGL_RGB)
+/** Releases the camera buffers of all history frames, their textures are reused for later frames */
+static void camGL_clearHistory(CamGL *camGL)
+{
+	for (int i = 0; i < camGL->historyCount; i++)
 	{
-		glBindTexture(GL_TEXTURE_EXTERNAL_OES, camGL->frame.textureRGB);
-		glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frameInt->eglImageRGB);
-		CHECK_GL(camGL);
+		gcs_releaseFrameBuffer(camGL->gcs, camGL->historyFrameBuffers[i]);
+		camGL->historyFrameBuffers[i] = NULL;
+		camGL->historyImages[i] = NULL;
 	}
-	else
+	camGL->historyCount = 0;
+}
+
+/** Returns whether recovery waits for the frames still held by CamGL to rebuild the camera */
+static bool camGL_isReleaseRequested(CamGL *camGL)
+{
+	return (camGL->frameBuffer || camGL->historyCount > 0) && gcs_isReleaseRequested(camGL->gcs);
+}
+
+/** Releases the current and all history frames, their textures sample buffers the camera may reuse afterwards */
+static void camGL_releaseFrames(CamGL *camGL)
+{
+	camGL_clearHistory(camGL);
+	if (camGL->frameBuffer)
+		gcs_releaseFrameBuffer(camGL->gcs, camGL->frameBuffer);
+	camGL->frameBuffer = NULL;
+	camGL->currentImage = NULL;
+	camGL->boundPlanes = 0;
+}
+
+/** Returns whether the image is bound to the current or a history frame and may not be evicted */
+static bool camGL_isImageInUse(CamGL *camGL, CamGL_Image *image)
+{
+	if (image == camGL->currentImage)
+		return true;
+	for (int i = 0; i < camGL->historyCount; i++)
 	{
-		glBindTexture(GL_TEXTURE_EXTERNAL_OES, camGL->frame.textureY);
-		CHECK_GL(camGL);
-		glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frameInt->eglImageY);
-		CHECK_GL(camGL);
-		if (frameInt->format == CAMGL_YUV)
+		if (image == camGL->historyImages[i])
+			return true;
+	}
+	return false;
+}
+
+/** Returns the CAMGL_PLANE_* flags of the planes of the format */
+static uint8_t camGL_getFormatPlanes(CamGL_FrameFormat format)
+{
+	if (format == CAMGL_RGB)
+		return CAMGL_PLANE_RGB;
+	if (format == CAMGL_Y)
+		return CAMGL_PLANE_Y;
+	return CAMGL_PLANE_Y | CAMGL_PLANE_U | CAMGL_PLANE_V;
+}
+
+/* Prefetching */
+
+/** Starts the prefetch thread that waits for camera frames and stages them for the GL thread */
+static int camGL_startPrefetch(CamGL *camGL)
+{
+	camGL->prefetchQuit = false;
+	camGL->prefetchPaused = false;
+	camGL->prefetchIdle = true;
+	camGL->prefetchStopped = false;
+	camGL->stagedFrameBuffer = NULL;
+	if (pthread_create(&camGL->prefetchThread, NULL, camGL_prefetchThread, camGL) != 0)
+		return -1;
+	camGL->prefetchRunning = true;
+	return 0;
+}
+
+/** Stops the prefetch thread and returns the staged frame */
+static void camGL_stopPrefetch(CamGL *camGL)
+{
+	if (!camGL->prefetchRunning) return;
+	pthread_mutex_lock(&camGL->prefetchMutex);
+	camGL->prefetchQuit = true;
+	pthread_cond_broadcast(&camGL->prefetchCond);
+	pthread_mutex_unlock(&camGL->prefetchMutex);
+	pthread_join(camGL->prefetchThread, NULL);
+	camGL->prefetchRunning = false;
+	if (camGL->stagedFrameBuffer)
+		gcs_releaseFrameBuffer(camGL->gcs, camGL->stagedFrameBuffer);
+	camGL->stagedFrameBuffer = NULL;
+}
+
+/** Pauses the prefetch thread until it is outside of GCS and returns the staged frame, or resumes it */
+static void camGL_pausePrefetch(CamGL *camGL, bool pause)
+{
+	if (!camGL->prefetchRunning) return;
+	pthread_mutex_lock(&camGL->prefetchMutex);
+	camGL->prefetchPaused = pause;
+	pthread_cond_broadcast(&camGL->prefetchCond);
+	while (pause && !camGL->prefetchIdle)
+		pthread_cond_wait(&camGL->prefetchCond, &camGL->prefetchMutex);
+	if (pause && camGL->stagedFrameBuffer)
+	{
+		gcs_releaseFrameBuffer(camGL->gcs, camGL->stagedFrameBuffer);
+		camGL->stagedFrameBuffer = NULL;
+	}
+	pthread_mutex_unlock(&camGL->prefetchMutex);
+}
+
+/** Prefetch thread - requests the next camera frame whenever the staged one was taken, so the GL thread never waits in GCS */
+static void *camGL_prefetchThread(void *context)
+{
+	CamGL *camGL = (CamGL*)context;
+	struct pollfd frameEvent = { .fd = gcs_getFrameEventFD(camGL->gcs), .events = POLLIN };
+	pthread_mutex_lock(&camGL->prefetchMutex);
+	while (true)
+	{
+		while (!camGL->prefetchQuit && (camGL->prefetchPaused || camGL->prefetchStopped || camGL->stagedFrameBuffer))
 		{
-			glBindTexture(GL_TEXTURE_EXTERNAL_OES, camGL->frame.textureU);
-			glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frameInt->eglImageU);
-			CHECK_GL(camGL);
-			glBindTexture(GL_TEXTURE_EXTERNAL_OES, camGL->frame.textureV);
-			glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frameInt->eglImageV);
-			CHECK_GL(camGL);
+			camGL->prefetchIdle = true;
+			pthread_cond_broadcast(&camGL->prefetchCond);
+			pthread_cond_wait(&camGL->prefetchCond, &camGL->prefetchMutex);
+		}
+		if (camGL->prefetchQuit)
+			break;
+		camGL->prefetchIdle = false;
+		pthread_mutex_unlock(&camGL->prefetchMutex);
+
+		// Limited wait, so pausing or quitting never waits for a stalled camera. Running into it is normal at low fps
+		void *frameBuffer = NULL;
+		bool stopped = !gcs_isStarted(camGL->gcs) || camGL_getQuit(camGL);
+		bool leasable = gcs_getLeasedFrameCount(camGL->gcs) < gcs_getMaxLeasedFrames(camGL->gcs);
+		if (!stopped && leasable && poll(&frameEvent, 1, CAMGL_PREFETCH_WAIT_MS) > 0)
+			frameBuffer = gcs_tryRequestFrameBuffer(camGL->gcs);
+
+		pthread_mutex_lock(&camGL->prefetchMutex);
+		if (frameBuffer && (camGL->prefetchPaused || camGL->prefetchQuit))
+			gcs_releaseFrameBuffer(camGL->gcs, frameBuffer);
+		else if (frameBuffer)
+			camGL->stagedFrameBuffer = frameBuffer;
+		else if (stopped)
+			camGL->prefetchStopped = true; // Let a waiting GL thread return
+		else if (!leasable && !camGL->prefetchQuit && !camGL->prefetchPaused)
+		{ // Wait for the GL thread to return its previous frame
+			struct timespec deadline;
+			camGL_getDeadline(&deadline, CAMGL_PREFETCH_WAIT_MS);
+			pthread_cond_timedwait(&camGL->prefetchCond, &camGL->prefetchMutex, &deadline);
 		}
+		pthread_cond_broadcast(&camGL->prefetchCond);
 	}
-	return 0;
+	camGL->prefetchIdle = true;
+	pthread_cond_broadcast(&camGL->prefetchCond);
+	pthread_mutex_unlock(&camGL->prefetchMutex);
+	return NULL;
+}
+
+/** Takes the frame staged by the prefetch thread, waiting for it if requested until a frame arrives or the stream stopped.
+ * A staged frame outdated by a newer one in GCS is replaced without waiting if frames are not queued */
+static void *camGL_takeStagedFrame(CamGL *camGL, bool wait)
+{
+	pthread_mutex_lock(&camGL->prefetchMutex);
+	while (wait && !camGL->stagedFrameBuffer && !camGL->prefetchStopped && !camGL->prefetchQuit && !camGL_isReleaseRequested(camGL))
+		pthread_cond_wait(&camGL->prefetchCond, &camGL->prefetchMutex);
+	void *frameBuffer = camGL->stagedFrameBuffer;
+	bool leasable = gcs_getLeasedFrameCount(camGL->gcs) < gcs_getMaxLeasedFrames(camGL->gcs);
+	if (frameBuffer && leasable && camGL->params.framePolicy == GCS_FRAME_LATEST && gcs_hasFrameBuffer(camGL->gcs))
+	{ // Prefetch thread is idle while a frame is staged, so only this thread is in GCS. Full history leaves no lease for it
+		void *newerFrameBuffer = gcs_tryRequestFrameBuffer(camGL->gcs);
+		if (newerFrameBuffer)
+		{
+			gcs_releaseFrameBuffer(camGL->gcs, frameBuffer);
+			frameBuffer = newerFrameBuffer;
+		}
+	}
+	camGL->stagedFrameBuffer = NULL;
+	pthread_cond_broadcast(&camGL->prefetchCond);
+	pthread_mutex_unlock(&camGL->prefetchMutex);
+	return frameBuffer;
+}
+
+/** Sets the deadline timeoutMS from now on the monotonic clock, for waits on the prefetch condition */
+static void camGL_getDeadline(struct timespec *deadline, uint32_t timeoutMS)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeoutMS / 1000;
+	deadline->tv_nsec += (long)(timeoutMS % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/** Current time of the monotonic clock in microseconds, same as the frame timestamps */
+static uint64_t camGL_getMonotonicUS()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
 }
 
 /* Thread-Safe state accessors */
@@ -7,6 +7,8 @@ extern "C" {
 
 #include <GLES2/gl2.h>
 #include "eglUtil.h"
+#include "gcs.h"
+#include "stereo.h"
 
 #define CAMGL_SUCCESS			0
 #define CAMGL_QUIT				1
@@ -17,6 +19,8 @@ extern "C" {
 #define CAMGL_GL_ERROR			6
 #define CAMGL_NO_FRAMES			7
 
+#define CAMGL_MAX_HISTORY		4
+
 typedef enum CamGL_FrameFormat
 {
 	CAMGL_RGB,
@@ -24,6 +28,15 @@ typedef enum CamGL_FrameFormat
 	CAMGL_YUV
 } CamGL_FrameFormat;
 
+/* Planes of a frame, each backed by its own EGL image and texture */
+typedef enum CamGL_Plane
+{
+	CAMGL_PLANE_RGB = 1 << 0,
+	CAMGL_PLANE_Y = 1 << 1,
+	CAMGL_PLANE_U = 1 << 2,
+	CAMGL_PLANE_V = 1 << 3,
+} CamGL_Plane;
+
 typedef struct CamGL_Frame
 {
 	CamGL_FrameFormat format;
@@ -33,6 +46,13 @@ typedef struct CamGL_Frame
 	GLuint textureY;
 	GLuint textureU;
 	GLuint textureV;
+	// Timing in microseconds of CLOCK_MONOTONIC (see GCS_FrameInfo)
+	uint64_t captureUS; // Sensor capture time, 0 if unavailable
+	uint64_t arrivalUS; // Time the frame arrived from the camera
+	uint64_t boundUS; // Time the frame was bound to the textures, minus arrivalUS is the camera-to-GL hand-off latency
+	uint32_t sequence; // Camera frame number since start
+	uint32_t droppedFrames; // Camera frames skipped since the previous frame
+	GCS_Crop crop; // Region of the sensor image the frame shows
 } CamGL_Frame;
 
 typedef struct CamGL_Params
@@ -44,6 +64,13 @@ typedef struct CamGL_Params
 	uint32_t shutterSpeed;
 	int32_t iso;
 	uint32_t camera_num;
+	uint8_t bufferCount; // Camera buffers, 0 for default (see GCS_CameraParams)
+	GCS_FramePolicy framePolicy;
+	uint8_t queueDepth;
+	uint8_t imageCacheSize; // Camera buffers with cached EGL images, least recently used are evicted. 0 for the camera buffer count
+	uint8_t planes; // CAMGL_PLANE_* flags bound with every frame, others only with camGL_bindPlane. 0 for all planes of the format
+	uint8_t prefetch; // Wait for camera frames on a helper thread, the GL thread only binds them. Needs 4+ camera buffers
+	uint8_t historyLength; // Previous frames kept bound to their own textures, up to CAMGL_MAX_HISTORY. Each holds a camera buffer
 } CamGL_Params;
 
 typedef struct CamGL CamGL;
@@ -64,10 +91,55 @@ CamGL_Frame* camGL_getFrame(CamGL *camGL);
 uint8_t camGL_hasNextFrame(CamGL *camGL);
 
 /* Updates the frame structure with the most recent camera frame. 
- * If no camera frame is available yet, blocks until there is.
+ * If no camera frame is available yet, blocks until there is. If recovery rebuilds the camera meanwhile (see gcs_isReleaseRequested),
+ * the current and history frames are released while waiting, as their buffers are replaced.
+ * With prefetch, the frame was already requested by the prefetch thread while the previous one was processed.
  * If the last frame has not been returned yet or camera stream was interrupted, returns error code. */
 int camGL_nextFrame(CamGL *camGL);
 
+/* Returns the previous frames kept with CamGL_Params historyLength, newest (N-1) first, count set to the frames available.
+ * Their textures stay bound to the unchanged camera buffers, so shaders sample them together with the current frame without copies.
+ * Only planes bound while the frame was current have a texture, others are 0. Check sequence for frames skipped in between.
+ * Valid until the next frame, cleared when the output format changes or the camera stops. */
+const CamGL_Frame *camGL_getFrameHistory(CamGL *camGL, uint8_t *count);
+
+/* Binds the plane of the current frame to its texture in the frame structure, creating its EGL image on first use,
+ * for planes not bound with every frame (see CamGL_Params planes). Returns the texture, 0 if the format has no such plane */
+GLuint camGL_bindPlane(CamGL *camGL, CamGL_Plane plane);
+
+/* Updates the frame structure with the next camera frame if one is ready, never blocks.
+ * Returns CAMGL_NO_FRAMES if there is none yet, the previous frame stays valid then,
+ * unless recovery is rebuilding the camera and needs all frames released (see camGL_nextFrame). */
+int camGL_tryNextFrame(CamGL *camGL);
+
+/* Returns a file descriptor that is readable when a new camera frame may be available, for poll/select/epoll.
+ * Spurious wakeups are possible, so use camGL_tryNextFrame after it signaled. Owned by CamGL, do not read from or close it. */
+int camGL_getFrameEventFD(CamGL *camGL);
+
+/* Returns the frame counters of the camera stream since start */
+void camGL_getStats(CamGL *camGL, GCS_Stats *stats);
+
+/* Sets the region of the sensor image (normalized 0-1) scaled to the frames, applies to the running camera */
+int camGL_setCrop(CamGL *camGL, float x, float y, float width, float height);
+
+/* Changes frame size and fps without restarting the camera. Returns the current frame, its textures stay valid until the next.
+ * The frame structure reports the new size with the first frame of it. */
+int camGL_setOutputFormat(CamGL *camGL, uint16_t width, uint16_t height, uint16_t fps);
+
+/* Queues a batch of camera control changes (shutter, ISO, brightness, locks), applied between frames without restarting */
+int camGL_setControls(CamGL *camGL, const GCS_Controls *controls);
+
+/* Returns the requested values of all camera controls */
+void camGL_getControls(CamGL *camGL, GCS_Controls *controls);
+
+/* Returns the underlying camera stream, e.g. to pair two cameras with stereo_create */
+GCS *camGL_getGCS(CamGL *camGL);
+
+/* Updates the frame structures of both cameras with the next pair of frames captured within the tolerance of the stereo capture.
+ * Unmatched frames are skipped. Waits at most timeoutMS for a pair and returns CAMGL_NO_FRAMES if there is none,
+ * the previous frames stay valid then unless a camera is rebuilt. Stream interruptions are reported like camGL_nextFrame. */
+int camGL_nextFramePair(CamGL *left, CamGL *right, StereoCapture *stereo, uint32_t timeoutMS);
+
 void camGL_update_annotation(CamGL *camGL, const char *string);
 
 #ifdef __cplusplus
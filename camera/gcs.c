@@ -1,5 +1,13 @@
 //#include <stddef.h>
 #include "gcs.h"
+#include "replay.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "interface/vcos/vcos_stdbool.h"
 #include "interface/vcos/vcos_inttypes.h"
@@ -24,17 +32,45 @@
 /* Watchdog timeout - elapsed time to allow for no video frames received */
 #define GCS_WATCHDOG_TIMEOUT_MS  4000
 
-/* How many buffers the camera has to work with. 
+/* How many buffers the camera has to work with by default. 
  * 3 minimum, but might introduce some latency as only 2 can be used alternatingly in the background while one processes.
- * More than 4 are not needed and not used. */
+ * More than 4 are only useful with leases or GCS_FRAME_FIFO. */
 #define GCS_SIMUL_BUFFERS 4
 
+/* Upper bound of configurable camera buffers */
+#define GCS_MAX_BUFFERS 16
+
+/* Upper bound of frames leased to the user at the same time.
+ * The actual bound is lower, at least two buffers stay with the camera (one being written, one published) */
+#define GCS_MAX_LEASES GCS_MAX_BUFFERS
+
+/* Delay before the second recovery attempt, doubled for each further one up to the maximum.
+ * The first attempt restarts the camera right away */
+#define GCS_RECOVERY_BACKOFF_MS 100
+#define GCS_RECOVERY_MAX_BACKOFF_MS 5000
+
+/* Time a rebuild waits for the user to release leased frames and for retained frames to be written */
+#define GCS_RELEASE_TIMEOUT_MS 1000
+
 /* GPU Camera Stream
 	Simple MMAL camera stream using the preview port, keeping only the most recent camera frame buffer for realtime, low-latency CV applications
 	Handles MMAL component creation and setup
 
 	Watchdog: Watches and stops stream if frames have stopped coming. Implemented by a timeout since last frame
+	Recovery: With recoverAttempts, a stall or camera error instead makes the control thread restart the camera component in place,
+		then rebuild it with backoff once all buffers are back. The stream stays started meanwhile, waiting users just see no frames
 	Buffer Pool: Collection of buffers used by the camera output to write to, processed and dropped frames are returned to it
+	Frame Slot: Newest frame is published by atomic exchange, a replaced unconsumed frame is released right away.
+		Waiters are woken by a condition variable only used for sleeping, the slot itself is never guarded by a lock
+	Frame Queue: With GCS_FRAME_FIFO frames are instead queued in order, the oldest is dropped once queueDepth is exceeded
+	Frame Event: An eventfd readable whenever a frame was published since the last request, for use in poll/epoll loops
+	Leases: Requested frames stay with the user until released by their handle, so several can be processed in a pipeline
+		A leased frame may also be retained beyond its lease, e.g. while a recorder writes it to disk
+	Frame Info: Each pool buffer carries sensor timestamp, arrival time and sequence number of the frame last written to it
+	Replay: Instead of the camera, a thread may publish frames of a memory-mapped recording through the same pool and slot
+	Controls: Changes of shutter, ISO etc. are merged into one batch that the control thread applies right after the next frame arrived
+	Secondary Stream: Optionally a downscaled copy of each frame from the video port, a child GCS with its own pool and frame hand-off
+		sharing the camera component. Both ports are fed from the same sensor frame, so their frames carry the same pts
 */
 struct GCS
 {
@@ -46,12 +82,45 @@ struct GCS
 	GCS_CameraParams cameraParams;
 
 	MMAL_COMPONENT_T *camera; // Camera component
-	MMAL_PORT_T *cameraOutput; // Camera output port (preview)
+	MMAL_PORT_T *cameraOutput; // Camera output port (preview, or video for the secondary stream)
+	GCS *secondary; // Downscaled stream of the same camera, NULL if disabled
+	GCS *parent; // Camera stream owning the component if this is the secondary stream
 	MMAL_POOL_T *bufferPool; // Pool of buffers for camera output to use
-	MMAL_BUFFER_HEADER_T *curFrameBuffer; // Nost recent camera frame buffer
-	MMAL_BUFFER_HEADER_T *processingFrameBuffer; // Nost recent camera frame buffer
+	MMAL_BUFFER_HEADER_T *curFrameBuffer; // Most recent camera frame buffer, only accessed atomically
+	MMAL_QUEUE_T *readyQueue; // Queued camera frame buffers for GCS_FRAME_FIFO
+	GCS_Stats stats; // Frame counters, only accessed atomically
+	MMAL_BUFFER_HEADER_T *leasedFrameBuffers[GCS_MAX_LEASES]; // Frame buffers currently handed out to the user
+	uint8_t leaseCount, maxLeases;
+	VCOS_MUTEX_T leaseMutex; // Leases may be requested and released from different user threads
+	GCS_FrameInfo *frameInfos; // Frame info of each pool buffer, referenced by the buffers user_data
+	uint32_t frameSequence; // Number of frames received since start
+	int64_t stcOffsetUS; // Offset from sensor timestamps (VideoCore STC) to the monotonic clock
+	GCS_Crop crop; // Requested sensor crop, stamped on frames
+
+	// Controls
+	GCS_Controls controls; // Requested values of all controls
+	uint32_t controlsPending; // GCS_CONTROL_* flags of controls not yet applied, only accessed atomically outside of the mutex
+	VCOS_MUTEX_T controlMutex; // Also held while the camera component is used from user threads or replaced by recovery
+	VCOS_SEMAPHORE_T controlSemaphore; // Posted when a frame arrived with controls pending, or to quit
+	VCOS_THREAD_T controlThread; // Applies pending controls, camera parameters can not be set from the port callback
+	uint8_t controlQuit;
+
+	// Recovery
+	uint8_t recoverPending; // Stall or error reported by a callback, recovered by the control thread, only accessed atomically
+	uint8_t recovering; // Ports are being disabled for recovery, returned buffers are not published
+	uint8_t recoveryAttempt; // Attempts since frames stopped
+	uint64_t recoveryStartUS; // Time frames stopped, 0 while running, only accessed atomically
+	uint8_t releaseRequested; // Rebuild waits for all frames to be released, only accessed atomically
+	uint32_t generation; // Number of rebuilds, stamped on frames as their buffers are new
+
+	// Replay
+	ReplayFile *replay; // Recording replayed instead of the camera
+	VCOS_THREAD_T replayThread; // Publishes replayed frames
+	uint8_t replayRunning;
 	VCOS_TIMER_T watchdogTimer; // Watchdog to detect if camera stops sending frames
-	VCOS_MUTEX_T frameReadyMutex; // For waiting for next ready frame
+	pthread_mutex_t frameWaitMutex; // Only protects sleeping on frameReadyCond
+	pthread_cond_t frameReadyCond; // Signaled whenever a frame is published or the stream stops, and when one is taken during replay
+	int frameEventFD; // Same signal as eventfd for event loops
 };
 
 /* Local functions (callbacks) */
@@ -62,30 +131,220 @@ static void gcs_onCameraControl(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 static void gcs_onCameraOutput(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 // Watchdog callback for when no new camera frames are pushed for a while, indicating an error
 static void gcs_onWatchdogTrigger(void *context);
+// Wakes up all users waiting for a frame
+static void gcs_signalFrameReady(GCS *gcs);
+// Marks the stream and its secondary stopped from callbacks, leaving ports and leases to gcs_stop
+static void gcs_signalStop(GCS *gcs);
+// Current time of the monotonic clock in microseconds
+static uint64_t gcs_getMonotonicUS();
+// Takes the next ready frame according to the frame policy, NULL if there is none
+static MMAL_BUFFER_HEADER_T *gcs_takeReadyFrame(GCS *gcs);
+// Hands out a lease of the buffer to the user
+static void* gcs_leaseFrame(GCS *gcs, MMAL_BUFFER_HEADER_T *buffer);
+// Resets the frame event so it only becomes readable again with the next published frame
+static void gcs_clearFrameEvent(GCS *gcs);
+// Takes the next ready frame, keeping the frame event readable while further frames are queued
+static MMAL_BUFFER_HEADER_T *gcs_takeSignalledFrame(GCS *gcs);
+// Allocates a stream with its frame hand-off, without frame source
+static GCS *gcs_createStream(const GCS_CameraParams *cameraParams);
+static void gcs_destroyStream(GCS *gcs);
+// Sets up the camera or replay as frame source
+static VCOS_STATUS_T gcs_createCamera(GCS *gcs);
+static MMAL_STATUS_T gcs_openCamera(GCS *gcs);
+static void gcs_closeCamera(GCS *gcs);
+static VCOS_STATUS_T gcs_createReplay(GCS *gcs);
+static void gcs_destroySource(GCS *gcs);
+// Configures the output port and creates its buffer pool
+static MMAL_STATUS_T gcs_createOutput(GCS *gcs);
+// Sets up the downscaled stream on the video port of the camera
+static GCS *gcs_createSecondary(GCS *parent);
+static void gcs_destroySecondary(GCS *gcs);
+// Stamps the frame and publishes it to the user according to the frame policy
+static void gcs_publishFrame(GCS *gcs, MMAL_BUFFER_HEADER_T *buffer, int64_t pts, uint64_t captureUS);
+
+static MMAL_STATUS_T gcs_enableOutput(GCS *gcs);
+static MMAL_STATUS_T gcs_enableSecondary(GCS *secondary);
+
+// Recovery of a stalled or failed camera on the control thread
+static void gcs_requestRecovery(GCS *gcs);
+static void gcs_recoverCamera(GCS *gcs);
+static uint8_t gcs_restartCamera(GCS *gcs);
+static uint8_t gcs_rebuildCamera(GCS *gcs);
+static uint8_t gcs_waitForRelease(GCS *gcs);
+static void gcs_disableOutputs(GCS *gcs);
+static uint32_t gcs_getControlsSet(const GCS_Controls *controls);
+
+static void gcs_applyControls(GCS *gcs);
+static void *gcs_controlThread(void *context);
+static VCOS_STATUS_T gcs_createFrameInfos(GCS *gcs);
+static void gcs_attachFrameInfos(GCS *gcs);
+// Replay thread publishing frames of the recording
+static void *gcs_replayThread(void *context);
 //static void gcs_annotate(GCS *gcs, MMAL_COMPONENT_T *camera, const char *string);
 
 
 GCS *gcs_create(GCS_CameraParams *cameraParams)
 {
 	// Temporary status return values
-	MMAL_STATUS_T mstatus;
 	VCOS_STATUS_T vstatus;
 
 	LOG_TRACE("Creating GPU Camera Stream");
 
+	// Allocate structure and frame hand-off
+	GCS *gcs = gcs_createStream(cameraParams);
+	CHECK_STATUS_V((gcs ? VCOS_SUCCESS : VCOS_ENOMEM), "Failed to create stream", error_stream);
+
+	// Setup frame source and its buffer pool
+	if (gcs->cameraParams.replayFile)
+		vstatus = gcs_createReplay(gcs);
+	else
+		vstatus = gcs_createCamera(gcs);
+	CHECK_STATUS_V(vstatus, "Failed to setup frame source", error_source);
+
+	// Attach frame info to each buffer
+	vstatus = gcs_createFrameInfos(gcs);
+	CHECK_STATUS_V(vstatus, "Failed to allocate frame info", error_frameInfo);
+
+	// Downscaled stream of the same camera
+	if (gcs->cameraParams.secondaryWidth != 0 && gcs->cameraParams.secondaryHeight != 0)
+	{
+		if (!gcs->camera)
+			LOG_ERROR("Secondary stream is only supported with a camera, ignoring it!");
+		else
+		{
+			gcs->secondary = gcs_createSecondary(gcs);
+			CHECK_STATUS_V((gcs->secondary ? VCOS_SUCCESS : VCOS_EINVAL), "Failed to setup secondary stream", error_secondary);
+		}
+	}
+
+//	cameraParams->width = gcs->cameraOutput->format->es->video.width;
+//	LOG_ERROR("Format %d", gcs->cameraOutput->format->es->video.width);
+
+	LOG_TRACE("Finished setup of GCS");
+
+	return gcs;
+
+error_secondary:
+	vcos_free(gcs->frameInfos);
+error_frameInfo:
+	gcs_destroySource(gcs);
+error_source:
+	gcs_destroyStream(gcs);
+error_stream:
+	return NULL;
+}
+
+/** Allocates the structure with synchronization, watchdog and frame queue of one stream, without frame source */
+static GCS *gcs_createStream(const GCS_CameraParams *cameraParams)
+{
+	VCOS_STATUS_T vstatus;
+
 	// Allocate memory for structure
 	GCS *gcs = vcos_calloc(1, sizeof(*gcs), "gcs");
 	CHECK_STATUS_V((gcs ? VCOS_SUCCESS : VCOS_ENOMEM), "Failed to allocate context", error_allocate);
 	gcs->cameraParams = *cameraParams;
 
-	// Access mutex
-	vstatus = vcos_mutex_create(&gcs->frameReadyMutex, "gcs-mutex");
+	// Frame ready signal, waiting with timeouts on the monotonic clock
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	vstatus = pthread_cond_init(&gcs->frameReadyCond, &condAttr) == 0? VCOS_SUCCESS : VCOS_ENOMEM;
+	pthread_condattr_destroy(&condAttr);
+	CHECK_STATUS_V(vstatus, "Failed to create frame condition", error_cond);
+	vstatus = pthread_mutex_init(&gcs->frameWaitMutex, NULL) == 0? VCOS_SUCCESS : VCOS_ENOMEM;
 	CHECK_STATUS_V(vstatus, "Failed to create mutex", error_mutex);
+	vstatus = vcos_mutex_create(&gcs->leaseMutex, "gcs-lease-mutex");
+	CHECK_STATUS_V(vstatus, "Failed to create lease mutex", error_leaseMutex);
+	gcs->frameEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK_STATUS_V((gcs->frameEventFD >= 0 ? VCOS_SUCCESS : VCOS_ENOMEM), "Failed to create frame eventfd", error_eventfd);
 
 	// Setup timers and callbacks for watchdog (resets whenever a frame is received)
 	vstatus = vcos_timer_create(&gcs->watchdogTimer, "gcs-watchdog-timer", gcs_onWatchdogTrigger, gcs);
 	CHECK_STATUS_V(vstatus, "Failed to create timer", error_timer);
     
+	// Set buffer num, at least two buffers stay with the camera (one being written, one published)
+	uint8_t bufferCount = gcs->cameraParams.bufferCount == 0? GCS_SIMUL_BUFFERS : gcs->cameraParams.bufferCount;
+	gcs->cameraParams.bufferCount = bufferCount < 3? 3 : (bufferCount > GCS_MAX_BUFFERS? GCS_MAX_BUFFERS : bufferCount);
+	gcs->maxLeases = gcs->cameraParams.bufferCount > 3? gcs->cameraParams.bufferCount - 2 : 1;
+
+	// Queue at most as many frames as the camera can spare without stalling
+	if (gcs->cameraParams.queueDepth == 0 || gcs->cameraParams.queueDepth > gcs->cameraParams.bufferCount - 2)
+		gcs->cameraParams.queueDepth = gcs->cameraParams.bufferCount - 2;
+	gcs->readyQueue = mmal_queue_create();
+	CHECK_STATUS_V((gcs->readyQueue ? VCOS_SUCCESS : VCOS_ENOMEM), "Error allocating frame queue", error_queue);
+
+	return gcs;
+
+error_queue:
+	vcos_timer_delete(&gcs->watchdogTimer);
+error_timer:
+	close(gcs->frameEventFD);
+error_eventfd:
+	vcos_mutex_delete(&gcs->leaseMutex);
+error_leaseMutex:
+	pthread_mutex_destroy(&gcs->frameWaitMutex);
+error_mutex:
+	pthread_cond_destroy(&gcs->frameReadyCond);
+error_cond:
+	vcos_free(gcs);
+error_allocate:
+	return NULL;
+}
+
+/** Frees what gcs_createStream allocated */
+static void gcs_destroyStream(GCS *gcs)
+{
+	mmal_queue_destroy(gcs->readyQueue);
+	pthread_mutex_destroy(&gcs->frameWaitMutex);
+	pthread_cond_destroy(&gcs->frameReadyCond);
+	vcos_mutex_delete(&gcs->leaseMutex);
+	close(gcs->frameEventFD);
+	vcos_timer_delete(&gcs->watchdogTimer);
+	vcos_free(gcs);
+}
+
+/** Creates the camera with its controls and the control thread */
+static VCOS_STATUS_T gcs_createCamera(GCS *gcs)
+{
+	MMAL_STATUS_T mstatus = gcs_openCamera(gcs);
+	CHECK_STATUS_M(mstatus, "Failed to open camera", error_open);
+
+	// Apply camera parameters as initial controls (See mmal_parameters_camera.h)
+	VCOS_STATUS_T vstatus = vcos_mutex_create(&gcs->controlMutex, "gcs-control-mutex");
+	CHECK_STATUS_V(vstatus, "Failed to create control mutex", error_controlMutex);
+	gcs->controls.shutterSpeed = gcs->cameraParams.shutterSpeed;
+	gcs->controls.iso = gcs->cameraParams.iso;
+	gcs->controls.brightness = gcs->cameraParams.brightness == 0? 60 : gcs->cameraParams.brightness;
+	gcs->controls.disableEXP = gcs->cameraParams.disableEXP;
+	gcs->controls.disableAWB = gcs->cameraParams.disableAWB;
+	gcs->controls.disableISPBlocks = gcs->cameraParams.disableISPBlocks;
+	gcs->controlsPending = gcs_getControlsSet(&gcs->controls);
+	gcs_applyControls(gcs);
+
+	// Control thread applies later control changes between frames
+	vstatus = vcos_semaphore_create(&gcs->controlSemaphore, "gcs-control", 0);
+	CHECK_STATUS_V(vstatus, "Failed to create control semaphore", error_controlSemaphore);
+	gcs->controlQuit = 0;
+	vstatus = vcos_thread_create(&gcs->controlThread, "gcs-control", NULL, gcs_controlThread, gcs);
+	CHECK_STATUS_V(vstatus, "Failed to create control thread", error_controlThread);
+
+	return VCOS_SUCCESS;
+
+error_controlThread:
+	vcos_semaphore_delete(&gcs->controlSemaphore);
+error_controlSemaphore:
+	vcos_mutex_delete(&gcs->controlMutex);
+error_controlMutex:
+	gcs_closeCamera(gcs);
+error_open:
+	return VCOS_EINVAL;
+}
+
+/** Creates, configures and enables the MMAL camera component and the buffer pool of its output port */
+static MMAL_STATUS_T gcs_openCamera(GCS *gcs)
+{
+	MMAL_STATUS_T mstatus;
+
 	// Create MMAL camera component
 	mstatus = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &gcs->camera);
 	CHECK_STATUS_M(mstatus, "Failed to create camera", error_cameraCreate);
@@ -115,24 +374,10 @@ GCS *gcs_create(GCS_CameraParams *cameraParams)
 		vcos_log_error("Could not select camera : error %d", mstatus);
 	}
 	
-	// Mess with the ISP blocks
-	// https://www.raspberrypi.org/forums/viewtopic.php?f=43&t=175711
-	//mmal_port_parameter_set_uint32(gcs->camera->control, MMAL_PARAMETER_CAMERA_ISP_BLOCK_OVERRIDE, ~cameraParams->disableISPBlocks);
-
 	// Enable MMAL camera component
 	mstatus = mmal_component_enable(gcs->camera);
 	CHECK_STATUS_M(mstatus, "Failed to enable camera", error_cameraEnable);
 
-	// Set camera parameters (See mmal_parameters_camera.h)
-	if (gcs->cameraParams.shutterSpeed != 0)
-		mmal_port_parameter_set_uint32(gcs->camera->control, MMAL_PARAMETER_SHUTTER_SPEED, gcs->cameraParams.shutterSpeed);
-	if (gcs->cameraParams.iso != 0)
-		mmal_port_parameter_set_uint32(gcs->camera->control, MMAL_PARAMETER_ISO, (uint32_t)gcs->cameraParams.iso);
-	
-	//Control the brightness	
-	MMAL_RATIONAL_T value = {60, 100};
-	mmal_port_parameter_set_rational(gcs->camera->control, MMAL_PARAMETER_BRIGHTNESS, value);	
-	
 	/*//Annotate text (work in progess)
 	MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T annotate =
 	{{MMAL_PARAMETER_ANNOTATE, sizeof(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T)}};
@@ -170,6 +415,44 @@ GCS *gcs_create(GCS_CameraParams *cameraParams)
 	CHECK_STATUS_M(mstatus, "Failed to enable camera control port", error_portEnable);
 	gcs->cameraOutput = gcs->camera->output[0]; // Preview Port 0
 
+	mstatus = gcs_createOutput(gcs);
+	CHECK_STATUS_M(mstatus, "Failed to setup output port", error_output);
+
+	return MMAL_SUCCESS;
+
+error_output:
+	mmal_port_disable(gcs->camera->control);
+error_portEnable:
+	mmal_component_disable(gcs->camera);
+error_cameraEnable:
+	mmal_component_destroy(gcs->camera);
+	gcs->camera = NULL;
+error_cameraCreate:
+	return mstatus;
+}
+
+/** Destroys the camera component and the buffer pool of its output port, after the port returned all buffers */
+static void gcs_closeCamera(GCS *gcs)
+{
+	if (gcs->camera)
+	{
+		if (gcs->cameraOutput && gcs->cameraOutput->is_enabled)
+			mmal_port_disable(gcs->cameraOutput);
+		mmal_component_disable(gcs->camera);
+		mmal_component_destroy(gcs->camera);
+	}
+	gcs->camera = NULL;
+	gcs->cameraOutput = NULL;
+	if (gcs->bufferPool)
+		mmal_pool_destroy(gcs->bufferPool);
+	gcs->bufferPool = NULL;
+}
+
+/** Sets format, zero-copy and buffer num/size of the output port and creates its buffer pool */
+static MMAL_STATUS_T gcs_createOutput(GCS *gcs)
+{
+	MMAL_STATUS_T mstatus;
+
 	// Set format of video output
 	MMAL_ES_FORMAT_T *format = gcs->cameraOutput->format;
 	format->encoding = gcs->cameraParams.mmalEnc == 0? MMAL_ENCODING_OPAQUE : gcs->cameraParams.mmalEnc;
@@ -184,76 +467,226 @@ GCS *gcs_create(GCS_CameraParams *cameraParams)
 	videoFormat->frame_rate.num = gcs->cameraParams.fps;
 	videoFormat->frame_rate.den = 1;
 	mstatus = mmal_port_format_commit(gcs->cameraOutput);
-	CHECK_STATUS_M(mstatus, "Failed to set output port format", error_portEnable);
+	CHECK_STATUS_M(mstatus, "Failed to set output port format", error);
 
 	// Enable zero-copy to store buffers in shared memory
 	mstatus = mmal_port_parameter_set_boolean(gcs->cameraOutput, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-	CHECK_STATUS_M((mstatus == MMAL_ENOSYS ? MMAL_SUCCESS : mstatus), "Failed to enable zero copy", error_portEnable);
+	CHECK_STATUS_M((mstatus == MMAL_ENOSYS ? MMAL_SUCCESS : mstatus), "Failed to enable zero copy", error);
 
 	// Set buffer num/size
-	gcs->cameraOutput->buffer_num = GCS_SIMUL_BUFFERS;//gcs->cameraOutput->buffer_num_recommended;
+	gcs->cameraOutput->buffer_num = gcs->cameraParams.bufferCount;//gcs->cameraOutput->buffer_num_recommended;
 	gcs->cameraOutput->buffer_size = gcs->cameraOutput->buffer_size_recommended;
 
 	// Setup buffer pool for camera output port to use (after enabling zero-copy so those buffers will be allocated through VCSM)
 	gcs->bufferPool = mmal_port_pool_create(gcs->cameraOutput, gcs->cameraOutput->buffer_num, gcs->cameraOutput->buffer_size);
-	CHECK_STATUS_M((gcs->bufferPool ? MMAL_SUCCESS : MMAL_ENOMEM), "Error allocating pool", error_pool);
+	CHECK_STATUS_M((gcs->bufferPool ? MMAL_SUCCESS : MMAL_ENOMEM), "Error allocating pool", error);
+	return MMAL_SUCCESS;
 
-//	cameraParams->width = gcs->cameraOutput->format->es->video.width;
-//	LOG_ERROR("Format %d", gcs->cameraOutput->format->es->video.width);
+error:
+	return mstatus == MMAL_SUCCESS? MMAL_ENOMEM : mstatus;
+}
 
-	LOG_TRACE("Finished setup of GCS");
+/** Creates the downscaled stream on the video port of the parents camera, sharing its component and controls */
+static GCS *gcs_createSecondary(GCS *parent)
+{
+	GCS_CameraParams params = parent->cameraParams;
+	params.width = parent->cameraParams.secondaryWidth;
+	params.height = parent->cameraParams.secondaryHeight;
+	if (parent->cameraParams.secondaryEnc != 0)
+		params.mmalEnc = parent->cameraParams.secondaryEnc;
+	params.secondaryWidth = params.secondaryHeight = 0;
+	params.secondaryEnc = 0;
+
+	GCS *gcs = gcs_createStream(&params);
+	if (!gcs) return NULL;
+	gcs->parent = parent;
+	gcs->cameraOutput = parent->camera->output[1]; // Video Port 1
 
+	MMAL_STATUS_T mstatus = gcs_createOutput(gcs);
+	CHECK_STATUS_M(mstatus, "Failed to setup secondary output port", error_output);
+	VCOS_STATUS_T vstatus = gcs_createFrameInfos(gcs);
+	CHECK_STATUS_V(vstatus, "Failed to allocate secondary frame info", error_frameInfo);
+	gcs->crop = parent->crop;
 	return gcs;
 
-error_pool:
-	mmal_port_disable(gcs->cameraOutput);
-error_portEnable:
-	mmal_component_disable(gcs->camera);
-error_cameraEnable:
-	mmal_component_destroy(gcs->camera);
-error_cameraCreate:
-	vcos_timer_delete(&gcs->watchdogTimer);
-error_timer:
-	vcos_mutex_delete(&gcs->frameReadyMutex);
-error_mutex:
-	vcos_free(gcs);
-error_allocate:
+error_frameInfo:
+	mmal_pool_destroy(gcs->bufferPool);
+error_output:
+	gcs_destroyStream(gcs);
 	return NULL;
 }
 
+/** Destroys the secondary stream, before the camera component of its parent */
+static void gcs_destroySecondary(GCS *gcs)
+{
+	if (gcs->cameraOutput && gcs->cameraOutput->is_enabled)
+		mmal_port_disable(gcs->cameraOutput);
+	if (gcs->bufferPool)
+		mmal_pool_destroy(gcs->bufferPool);
+	vcos_free(gcs->frameInfos);
+	gcs_destroyStream(gcs);
+}
+
+/** Opens the recording to replay and creates a pool of buffer headers only referencing its frames */
+static VCOS_STATUS_T gcs_createReplay(GCS *gcs)
+{
+	gcs->replay = replay_open(gcs->cameraParams.replayFile, gcs_getFrameSize(&gcs->cameraParams));
+	CHECK_STATUS_V((gcs->replay ? VCOS_SUCCESS : VCOS_ENOENT), "Failed to open replay file", error_open);
+	gcs->bufferPool = mmal_pool_create(gcs->cameraParams.bufferCount, 0);
+	CHECK_STATUS_V((gcs->bufferPool ? VCOS_SUCCESS : VCOS_ENOMEM), "Error allocating pool", error_pool);
+	replay_setPacing(gcs->replay, gcs->cameraParams.fps, gcs->cameraParams.replayMode == GCS_REPLAY_REALTIME, gcs->cameraParams.replayLoop);
+	LOG_TRACE("Replaying %d frames from %s", replay_getFrameCount(gcs->replay), gcs->cameraParams.replayFile);
+	return VCOS_SUCCESS;
+
+error_pool:
+	replay_close(gcs->replay);
+	gcs->replay = NULL;
+error_open:
+	return VCOS_ENOENT;
+}
+
+/** Destroys the frame source and its buffer pool */
+static void gcs_destroySource(GCS *gcs)
+{
+	if (gcs->replay)
+	{
+		mmal_pool_destroy(gcs->bufferPool);
+		replay_close(gcs->replay);
+		return;
+	}
+
+	// Control thread may be recovering the camera, finish first
+	gcs->controlQuit = 1;
+	vcos_semaphore_post(&gcs->controlSemaphore);
+	vcos_thread_join(&gcs->controlThread, NULL);
+	vcos_semaphore_delete(&gcs->controlSemaphore);
+	vcos_mutex_delete(&gcs->controlMutex);
+
+	// Secondary stream uses a port of the camera component
+	if (gcs->secondary)
+		gcs_destroySecondary(gcs->secondary);
+	gcs_closeCamera(gcs);
+}
+
 void gcs_destroy(GCS *gcs)
 {
 	if (!gcs) return;
+	if (gcs->parent)
+	{
+		LOG_ERROR("Secondary stream is destroyed with its camera!");
+		return;
+	}
 
 	// Stop worker thread, disable camera component
 	gcs_stop(gcs);
 
-	// Destroy camera component
-	mmal_component_disable(gcs->camera);
-	mmal_component_destroy(gcs->camera);
+	// Destroy camera component (and secondary stream) or replay file
+	gcs_destroySource(gcs);
 
 	// Free remaining resources
-	mmal_pool_destroy(gcs->bufferPool);
-	vcos_mutex_delete(&gcs->frameReadyMutex);
-	vcos_timer_delete(&gcs->watchdogTimer);
-	vcos_free(gcs);
+	vcos_free(gcs->frameInfos);
+	gcs_destroyStream(gcs);
 }
 
 /* Start GCS (camera stream). Enables MMAL camera and starts watchdog */
 uint8_t gcs_start(GCS *gcs)
 {
+	if (gcs->parent)
+	{
+		LOG_ERROR("Secondary stream is started with its camera!");
+		return -1;
+	}
+	if (!gcs->replay && !gcs->camera)
+	{ // Recovery gave up after the component could not be rebuilt
+		LOG_ERROR("Camera is not available!");
+		return -1;
+	}
+
 	// Ensure GCS is stopped first
 	gcs_stop(gcs);
 	gcs->error = 0;
 	gcs->started = 1;
+	gcs->frameSequence = 0;
+	memset(&gcs->stats, 0, sizeof(gcs->stats));
+	gcs->recoveryAttempt = 0;
+	__atomic_store_n(&gcs->recoveryStartUS, 0, __ATOMIC_RELAXED);
+
+	if (gcs->replay)
+	{ // Replay thread takes the place of camera and watchdog
+		replay_rewind(gcs->replay);
+		gcs->replayRunning = 1;
+		VCOS_STATUS_T vstatus = vcos_thread_create(&gcs->replayThread, "gcs-replay", NULL, gcs_replayThread, gcs);
+		CHECK_STATUS_V(vstatus, "Failed to create replay thread", error_replay);
+		return 0;
+	error_replay:
+		gcs->replayRunning = 0;
+		gcs->started = 0;
+		return -1;
+	}
 
-	// Lock mutex to signal frame is not ready
-	vcos_mutex_lock(&gcs->frameReadyMutex);
+	if (gcs_enableOutput(gcs) != MMAL_SUCCESS)
+	{
+		gcs->started = 0;
+		return -1;
+	}
+
+	if (gcs->secondary)
+	{ // A failure leaves the primary stream running
+		GCS *secondary = gcs->secondary;
+		secondary->error = 0;
+		secondary->frameSequence = 0;
+		memset(&secondary->stats, 0, sizeof(secondary->stats));
+		gcs_enableSecondary(secondary);
+	}
+	return 0;
+}
 
+/** Enables the video port of the secondary stream and starts capturing on it */
+static MMAL_STATUS_T gcs_enableSecondary(GCS *secondary)
+{
+	secondary->started = 1;
+	if (secondary->cameraOutput->is_enabled)
+		mmal_port_disable(secondary->cameraOutput);
+	MMAL_STATUS_T mstatus = gcs_enableOutput(secondary);
+	if (mstatus == MMAL_SUCCESS)
+	{ // Video port only delivers frames while capturing
+		mstatus = mmal_port_parameter_set_boolean(secondary->cameraOutput, MMAL_PARAMETER_CAPTURE, MMAL_TRUE);
+		if (mstatus != MMAL_SUCCESS)
+			LOG_ERROR("Failed to start capture of secondary stream: %s", mmal_status_to_string(mstatus));
+	}
+	if (mstatus != MMAL_SUCCESS)
+	{
+		secondary->started = 0;
+		vcos_timer_cancel(&secondary->watchdogTimer);
+		gcs_signalFrameReady(secondary);
+	}
+	return mstatus;
+}
+
+/** Enables the camera output port, sends it all free buffers and starts the watchdog */
+static MMAL_STATUS_T gcs_enableOutput(GCS *gcs)
+{
 	// Enable camera output port and set callback to receive camera frame buffers
 	gcs->cameraOutput->userdata = (struct MMAL_PORT_USERDATA_T *)gcs;
 	MMAL_STATUS_T mstatus = mmal_port_enable(gcs->cameraOutput, gcs_onCameraOutput);
-	CHECK_STATUS_M(mstatus, "Failed to enable output port", error_port);
+	if (mstatus != MMAL_SUCCESS)
+	{
+		LOG_ERROR("Failed to enable output port: %s", mmal_status_to_string(mstatus));
+		return mstatus;
+	}
+
+	// Relate sensor timestamps (VideoCore STC) to the monotonic clock, bracketing the query to halve the error
+	uint64_t stcUS;
+	uint64_t beforeUS = gcs_getMonotonicUS();
+	mstatus = mmal_port_parameter_get_uint64(gcs->cameraOutput, MMAL_PARAMETER_SYSTEM_TIME, &stcUS);
+	uint64_t afterUS = gcs_getMonotonicUS();
+	if (mstatus == MMAL_SUCCESS)
+		gcs->stcOffsetUS = (int64_t)((beforeUS + afterUS) / 2) - (int64_t)stcUS;
+	else
+	{
+		LOG_ERROR("Failed to query system time, capture timestamps unavailable: %s", mmal_status_to_string(mstatus));
+		gcs->stcOffsetUS = 0;
+	}
 
 	// Send unused buffers to video port to use
 	MMAL_BUFFER_HEADER_T *buffer;
@@ -267,67 +700,229 @@ uint8_t gcs_start(GCS *gcs)
 	// Start watchdog timer that may stop stream due to lack of frames received (resets whenever frame is received)
 	vcos_timer_set(&gcs->watchdogTimer, GCS_WATCHDOG_TIMEOUT_MS);
 
-	return 0;
-
-error_port:
-	return -1;
+	return MMAL_SUCCESS;
 }
 
 /* Stop GCS (camera output). Stops watchdog and disabled MMAL camera */
 void gcs_stop(GCS *gcs)
 {
 	gcs->started = 0;
+	if (gcs->secondary)
+		gcs_stop(gcs->secondary);
 
 	// Stop running timers
 	vcos_timer_cancel(&gcs->watchdogTimer);
 
-	if (gcs->started)
+	// Stop potentially waiting user (and replay thread)
+	gcs_signalFrameReady(gcs);
+
+	if (gcs->replayRunning)
 	{
-		// Disable camera output
+		gcs->replayRunning = 0;
+		gcs_signalFrameReady(gcs);
+		vcos_thread_join(&gcs->replayThread, NULL);
+	}
+
+	// Disable camera output, also after a stop signalled from a callback or the watchdog left it enabled
+	if (gcs->cameraOutput && gcs->cameraOutput->is_enabled)
 		mmal_port_disable(gcs->cameraOutput);
 
-		// Stop potentially waiting user
-		if (vcos_mutex_is_locked(&gcs->frameReadyMutex))
-			vcos_mutex_unlock(&gcs->frameReadyMutex);
+	// Reset unused frames
+	gcs_returnFrameBuffer(gcs);
+	MMAL_BUFFER_HEADER_T *unused;
+	while ((unused = gcs_takeReadyFrame(gcs)) != NULL)
+		mmal_buffer_header_release(unused);
+}
+
+/*Returns whether there is a new camera frame available */
+uint8_t gcs_hasFrameBuffer(GCS *gcs)
+{
+	if (gcs->cameraParams.framePolicy == GCS_FRAME_FIFO)
+		return mmal_queue_length(gcs->readyQueue) > 0;
+	return __atomic_load_n(&gcs->curFrameBuffer, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Returns a lease of the most recent camera frame. If no camera frame is available yet, blocks until there is.
+ * If the maximum number of leases is outstanding or the stream stopped, returns NULL. */
+void* gcs_requestFrameBuffer(GCS *gcs)
+{
+	return gcs_requestFrameBufferTimeout(gcs, GCS_WAIT_FOREVER);
+}
+
+/* Same as gcs_requestFrameBuffer, but waits at most timeoutMS for a frame before returning NULL */
+void* gcs_requestFrameBufferTimeout(GCS *gcs, uint32_t timeoutMS)
+{
+	if (gcs_getLeasedFrameCount(gcs) >= gcs->maxLeases)
+	{ // Not cleaned up older frames
+		LOG_ERROR("Not returned %d leased frames!", gcs->maxLeases);
+		return NULL;
+	}
 
-		// Reset unused frames
-		if (gcs->processingFrameBuffer)
+	// Fast path, frame already published
+	MMAL_BUFFER_HEADER_T *buffer = gcs_takeSignalledFrame(gcs);
+	if (!buffer)
+	{ // Sleep until a frame is published, the stream stops or the timeout elapses
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeoutMS / 1000;
+		deadline.tv_nsec += (long)(timeoutMS % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
 		{
-			mmal_buffer_header_release(gcs->processingFrameBuffer);
-			gcs->processingFrameBuffer = NULL;
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
 		}
-		if (gcs->curFrameBuffer)
+
+		pthread_mutex_lock(&gcs->frameWaitMutex);
+		while (__atomic_load_n(&gcs->started, __ATOMIC_ACQUIRE) && (buffer = gcs_takeReadyFrame(gcs)) == NULL)
 		{
-			mmal_buffer_header_release(gcs->curFrameBuffer);
-			gcs->curFrameBuffer = NULL;
+			if (gcs_isReleaseRequested(gcs) && __atomic_load_n(&gcs->leaseCount, __ATOMIC_RELAXED) > 0)
+				break; // Let the user release its frames for a rebuild
+			int status = timeoutMS == GCS_WAIT_FOREVER?
+				pthread_cond_wait(&gcs->frameReadyCond, &gcs->frameWaitMutex) :
+				pthread_cond_timedwait(&gcs->frameReadyCond, &gcs->frameWaitMutex, &deadline);
+			if (status == ETIMEDOUT)
+			{ // Frame might have been published right at the timeout
+				buffer = gcs_takeReadyFrame(gcs);
+				break;
+			}
 		}
+		pthread_mutex_unlock(&gcs->frameWaitMutex);
 	}
-}
 
-/*Returns whether there is a new camera frame available */
-uint8_t gcs_hasFrameBuffer(GCS *gcs)
-{
-	return gcs->curFrameBuffer != NULL;
+	if (!buffer)
+	{
+		if (!gcs_isReleaseRequested(gcs))
+			LOG_ERROR("No current frame buffer!");
+		return NULL;
+	}
+	return gcs_leaseFrame(gcs, buffer);
 }
 
-/* Returns the most recent camera frame. If no camera frame is available yet, blocks until there is.
- * If the last frame has not been returned yet, returns NULL. */
-void* gcs_requestFrameBuffer(GCS *gcs)
+/* Returns a lease of the next ready camera frame without blocking, or NULL if there is none (or too many are leased) */
+void* gcs_tryRequestFrameBuffer(GCS *gcs)
 {
-	vcos_mutex_lock(&gcs->frameReadyMutex);
-	if (gcs->processingFrameBuffer)
-	{ // Not cleaned up last frame
-		LOG_ERROR("Not cleaned up last frame!");
+	if (gcs_getLeasedFrameCount(gcs) >= gcs->maxLeases)
+	{ // Not cleaned up older frames
+		LOG_ERROR("Not returned %d leased frames!", gcs->maxLeases);
 		return NULL;
 	}
-	gcs->processingFrameBuffer = gcs->curFrameBuffer;
-	gcs->curFrameBuffer = NULL;
-	if (!gcs->processingFrameBuffer)
-	{ // Not cleaned up last frame
-		LOG_ERROR("No current frame buffer!");
+	MMAL_BUFFER_HEADER_T *buffer = gcs_takeSignalledFrame(gcs);
+	if (!buffer)
 		return NULL;
+	return gcs_leaseFrame(gcs, buffer);
+}
+
+/* Returns a file descriptor that is readable while a new frame may be available, to be used with poll/select/epoll.
+ * Spurious wakeups are possible, so gcs_tryRequestFrameBuffer should be used after it signaled. Do not read from or close it. */
+int gcs_getFrameEventFD(GCS *gcs)
+{
+	return gcs->frameEventFD;
+}
+
+/** Hands out a lease of the buffer to the user */
+static void* gcs_leaseFrame(GCS *gcs, MMAL_BUFFER_HEADER_T *buffer)
+{
+	vcos_mutex_lock(&gcs->leaseMutex);
+	gcs->leasedFrameBuffers[gcs->leaseCount++] = buffer;
+	vcos_mutex_unlock(&gcs->leaseMutex);
+	__atomic_fetch_add(&gcs->stats.delivered, 1, __ATOMIC_RELAXED);
+	return buffer;
+}
+
+/** Resets the frame event so it only becomes readable again with the next published frame */
+static void gcs_clearFrameEvent(GCS *gcs)
+{
+	uint64_t count;
+	if (read(gcs->frameEventFD, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		LOG_ERROR("Failed to clear frame event: %s", strerror(errno));
+}
+
+/** Takes the next ready frame and resets the frame event, which stays readable while more frames are queued */
+static MMAL_BUFFER_HEADER_T *gcs_takeSignalledFrame(GCS *gcs)
+{
+	// Clear before taking, so a frame published afterwards leaves the event readable
+	gcs_clearFrameEvent(gcs);
+	MMAL_BUFFER_HEADER_T *buffer = gcs_takeReadyFrame(gcs);
+	if (buffer && gcs_hasFrameBuffer(gcs))
+	{ // Backlog of the FIFO policy, consumers of the event have to keep draining it
+		uint64_t one = 1;
+		if (write(gcs->frameEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			LOG_ERROR("Failed to signal frame event: %s", strerror(errno));
+	}
+	return buffer;
+}
+
+/** Takes the next ready frame according to the frame policy, NULL if there is none */
+static MMAL_BUFFER_HEADER_T *gcs_takeReadyFrame(GCS *gcs)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+	if (gcs->cameraParams.framePolicy == GCS_FRAME_FIFO)
+		buffer = mmal_queue_get(gcs->readyQueue);
+	else
+		buffer = __atomic_exchange_n(&gcs->curFrameBuffer, NULL, __ATOMIC_ACQ_REL);
+	if (buffer && gcs->replayRunning && gcs->cameraParams.replayMode == GCS_REPLAY_FREERUN)
+	{ // Free-running replay waits for frames to be taken. Callers may hold frameWaitMutex, so signal without it (replay also wakes up regularly)
+		pthread_cond_broadcast(&gcs->frameReadyCond);
+	}
+	return buffer;
+}
+
+/* Returns the number of frames currently leased to the user */
+uint8_t gcs_getLeasedFrameCount(GCS *gcs)
+{
+	vcos_mutex_lock(&gcs->leaseMutex);
+	uint8_t count = gcs->leaseCount;
+	vcos_mutex_unlock(&gcs->leaseMutex);
+	return count;
+}
+
+/* Returns the maximum number of frames that can be leased at the same time */
+uint8_t gcs_getMaxLeasedFrames(GCS *gcs)
+{
+	return gcs->maxLeases;
+}
+
+uint8_t gcs_isStarted(GCS *gcs)
+{
+	return __atomic_load_n(&gcs->started, __ATOMIC_ACQUIRE);
+}
+
+/* Returns whether recovery waits for all frames to be released to rebuild the camera */
+uint8_t gcs_isReleaseRequested(GCS *gcs)
+{
+	return __atomic_load_n(&gcs->releaseRequested, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the frame counters since the stream started */
+void gcs_getStats(GCS *gcs, GCS_Stats *stats)
+{
+	stats->received = __atomic_load_n(&gcs->stats.received, __ATOMIC_RELAXED);
+	stats->delivered = __atomic_load_n(&gcs->stats.delivered, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&gcs->stats.dropped, __ATOMIC_RELAXED);
+	stats->recoveries = __atomic_load_n(&gcs->stats.recoveries, __ATOMIC_RELAXED);
+	stats->recoveryAttempts = __atomic_load_n(&gcs->stats.recoveryAttempts, __ATOMIC_RELAXED);
+	stats->downtimeMS = __atomic_load_n(&gcs->stats.downtimeMS, __ATOMIC_RELAXED);
+}
+
+/* Returns the size in bytes of one frame with the encoding and resolution of the parameters */
+uint32_t gcs_getFrameSize(const GCS_CameraParams *cameraParams)
+{
+	uint32_t pixels = (uint32_t)cameraParams->width * cameraParams->height;
+	switch (cameraParams->mmalEnc)
+	{
+		case 0:
+		case MMAL_ENCODING_OPAQUE:
+		case MMAL_ENCODING_I420:
+			return pixels * 3 / 2;
+		case MMAL_ENCODING_RGB24:
+		case MMAL_ENCODING_BGR24:
+			return pixels * 3;
+		case MMAL_ENCODING_RGBA:
+		case MMAL_ENCODING_RGB32:
+			return pixels * 4;
+		default:
+			return pixels;
 	}
-	return gcs->processingFrameBuffer;
 }
 
 /* Returns the data of the given MMAL framebuffer. Use after gcs_requestFrameBuffer to get the underlying buffer. */
@@ -336,14 +931,90 @@ void* gcs_getFrameBufferData(void *framebuffer)
 	return ((MMAL_BUFFER_HEADER_T*)framebuffer)->data;
 }
 
-/* Return requested Frane Buffer after processing is done.
- * Has to be called before a new frame buffer can be requested. */
+/* Returns the timestamps and sequence number of the given MMAL framebuffer. Valid while the frame is leased. */
+const GCS_FrameInfo* gcs_getFrameBufferInfo(void *framebuffer)
+{
+	return (const GCS_FrameInfo*)((MMAL_BUFFER_HEADER_T*)framebuffer)->user_data;
+}
+
+/* Returns the leased frame buffer after processing is done so the camera can reuse it */
+void gcs_releaseFrameBuffer(GCS *gcs, void *framebuffer)
+{
+	vcos_mutex_lock(&gcs->leaseMutex);
+	int i;
+	for (i = 0; i < gcs->leaseCount; i++)
+	{
+		if (gcs->leasedFrameBuffers[i] == framebuffer)
+			break;
+	}
+	if (i < gcs->leaseCount)
+	{ // Keep remaining leases in request order
+		for (; i < gcs->leaseCount-1; i++)
+			gcs->leasedFrameBuffers[i] = gcs->leasedFrameBuffers[i+1];
+		gcs->leaseCount--;
+		mmal_buffer_header_release((MMAL_BUFFER_HEADER_T*)framebuffer);
+	}
+	else
+		LOG_ERROR("Released frame buffer %p that was not leased!", framebuffer);
+	vcos_mutex_unlock(&gcs->leaseMutex);
+}
+
+/* Return all leased Frame Buffers after processing is done. */
 void gcs_returnFrameBuffer(GCS *gcs)
 {
-	if (gcs->processingFrameBuffer)
+	vcos_mutex_lock(&gcs->leaseMutex);
+	for (int i = 0; i < gcs->leaseCount; i++)
+		mmal_buffer_header_release(gcs->leasedFrameBuffers[i]);
+	gcs->leaseCount = 0;
+	vcos_mutex_unlock(&gcs->leaseMutex);
+}
+
+/* Keeps an additional reference to a leased frame buffer beyond its lease, e.g. for a recorder writing it to disk.
+ * The buffer only returns to the camera once the lease and all references are released. */
+void gcs_retainFrameBuffer(GCS *gcs, void *framebuffer)
+{ // MMAL reference counts are not atomic, so all reference changes on leased buffers go through the lease mutex
+	vcos_mutex_lock(&gcs->leaseMutex);
+	mmal_buffer_header_acquire((MMAL_BUFFER_HEADER_T*)framebuffer);
+	vcos_mutex_unlock(&gcs->leaseMutex);
+}
+
+/* Releases a reference taken with gcs_retainFrameBuffer, from any thread */
+void gcs_releaseRetainedFrameBuffer(GCS *gcs, void *framebuffer)
+{
+	vcos_mutex_lock(&gcs->leaseMutex);
+	mmal_buffer_header_release((MMAL_BUFFER_HEADER_T*)framebuffer);
+	vcos_mutex_unlock(&gcs->leaseMutex);
+}
+
+/* Returns the camera parameters in effect, with buffer count and queue depth resolved */
+const GCS_CameraParams* gcs_getCameraParams(GCS *gcs)
+{
+	return &gcs->cameraParams;
+}
+
+/* Returns the downscaled stream of the camera, NULL if disabled */
+GCS *gcs_getSecondaryStream(GCS *gcs)
+{
+	return gcs->secondary;
+}
+
+/* Returns a lease of the first frame with a pts at or after the given one, releasing older frames */
+void* gcs_requestFrameBufferAt(GCS *gcs, int64_t pts, uint32_t timeoutMS)
+{
+	uint64_t deadlineUS = gcs_getMonotonicUS() + (uint64_t)timeoutMS * 1000;
+	while (1)
 	{
-		mmal_buffer_header_release(gcs->processingFrameBuffer);
-		gcs->processingFrameBuffer = NULL;
+		uint32_t waitMS = GCS_WAIT_FOREVER;
+		if (timeoutMS != GCS_WAIT_FOREVER)
+		{
+			uint64_t nowUS = gcs_getMonotonicUS();
+			waitMS = nowUS < deadlineUS? (deadlineUS - nowUS + 999) / 1000 : 0;
+		}
+		void *framebuffer = gcs_requestFrameBufferTimeout(gcs, waitMS);
+		if (!framebuffer || gcs_getFrameBufferInfo(framebuffer)->pts >= pts)
+			return framebuffer;
+		// Taken before the requested frame
+		gcs_releaseFrameBuffer(gcs, framebuffer);
 	}
 }
 
@@ -354,7 +1025,10 @@ static void gcs_onCameraControl(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf)
 	if (buf->cmd == MMAL_EVENT_ERROR)
 	{
 		LOG_ERROR("%s: MMAL error: %s", port->name, mmal_status_to_string(*(MMAL_STATUS_T *)buf->data));
-		gcs_stop(gcs);
+		if (gcs->cameraParams.recoverAttempts > 0)
+			gcs_requestRecovery(gcs);
+		else
+			gcs_signalStop(gcs);
 	}
 	else
 	{
@@ -377,7 +1051,7 @@ static void gcs_onCameraOutput(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 		LOG_ERROR("%s: zero buffer handle", port->name);
 		mmal_buffer_header_release(buffer);
 	}
-	else if (!gcs->started)
+	else if (!gcs->started || gcs->recovering)
 	{
 		mmal_buffer_header_release(buffer);
 	}
@@ -386,19 +1060,24 @@ static void gcs_onCameraOutput(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 		// Reset watchdog timer for detecting when frames stop coming
 		vcos_timer_set(&gcs->watchdogTimer, GCS_WATCHDOG_TIMEOUT_MS);
 
-		// Retract frame ready signal during switch
-		vcos_mutex_trylock(&gcs->frameReadyMutex);
-
-		// Release now outdated camera frame
-		if (gcs->curFrameBuffer != NULL)
-		{ // If it does not exist, it has been consumed
-			mmal_buffer_header_release(gcs->curFrameBuffer);
-			gcs->curFrameBuffer = NULL;
-			// On drop frame
+		// First frame after recovery ends the downtime
+		uint64_t recoveryStartUS = __atomic_load_n(&gcs->recoveryStartUS, __ATOMIC_ACQUIRE);
+		if (recoveryStartUS != 0 && __atomic_compare_exchange_n(&gcs->recoveryStartUS, &recoveryStartUS, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			uint32_t downtimeMS = (gcs_getMonotonicUS() - recoveryStartUS) / 1000;
+			__atomic_fetch_add(&gcs->stats.recoveries, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&gcs->stats.downtimeMS, downtimeMS, __ATOMIC_RELAXED);
+			LOG_ERROR("%s: camera recovered after %d ms", port->name, downtimeMS);
+			gcs->recoveryAttempt = 0;
 		}
 
-		// Set the newest camera frame
-		gcs->curFrameBuffer = buffer;
+		// Publish camera frame with sensor timestamp
+		uint64_t captureUS = (buffer->pts == MMAL_TIME_UNKNOWN || gcs->stcOffsetUS == 0)? 0 : (uint64_t)(buffer->pts + gcs->stcOffsetUS);
+		gcs_publishFrame(gcs, buffer, buffer->pts, captureUS);
+
+		// Apply pending controls between this and the next frame
+		if (__atomic_load_n(&gcs->controlsPending, __ATOMIC_ACQUIRE))
+			vcos_semaphore_post(&gcs->controlSemaphore);
 
 		// Send buffer back to port for use (needed? it's a port buffer, should automatically do it, right?)
 		while ((buffer = mmal_queue_get(gcs->bufferPool->queue)) != NULL)
@@ -408,22 +1087,609 @@ static void gcs_onCameraOutput(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 				LOG_ERROR("Failed to send buffer to %s", gcs->cameraOutput->name);
 		}
 	}
+}
+
+/** Stamps the frame and publishes it to the user according to the frame policy */
+static void gcs_publishFrame(GCS *gcs, MMAL_BUFFER_HEADER_T *buffer, int64_t pts, uint64_t captureUS)
+{
+	// Stamp frame before publishing it
+	GCS_FrameInfo *info = (GCS_FrameInfo*)buffer->user_data;
+	if (info)
+	{
+		info->arrivalUS = gcs_getMonotonicUS();
+		info->pts = pts;
+		info->captureUS = captureUS;
+		info->sequence = ++gcs->frameSequence;
+		info->width = gcs->cameraParams.width;
+		info->height = gcs->cameraParams.height;
+		info->crop = gcs->crop;
+		info->generation = gcs->generation;
+	}
+
+	__atomic_fetch_add(&gcs->stats.received, 1, __ATOMIC_RELAXED);
+
+	if (gcs->cameraParams.framePolicy == GCS_FRAME_FIFO)
+	{ // Queue the camera frame and drop the oldest ones exceeding the queue depth
+		mmal_queue_put(gcs->readyQueue, buffer);
+		MMAL_BUFFER_HEADER_T *outdated;
+		while (mmal_queue_length(gcs->readyQueue) > gcs->cameraParams.queueDepth && (outdated = mmal_queue_get(gcs->readyQueue)) != NULL)
+		{
+			mmal_buffer_header_release(outdated);
+			__atomic_fetch_add(&gcs->stats.dropped, 1, __ATOMIC_RELAXED);
+		}
+	}
+	else
+	{ // Publish the newest camera frame and release the now outdated one
+		MMAL_BUFFER_HEADER_T *outdated = __atomic_exchange_n(&gcs->curFrameBuffer, buffer, __ATOMIC_ACQ_REL);
+		if (outdated != NULL)
+		{ // If it does not exist, it has been consumed
+			mmal_buffer_header_release(outdated);
+			__atomic_fetch_add(&gcs->stats.dropped, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	// Signal that a frame is ready
+	gcs_signalFrameReady(gcs);
+}
+
+/** Replay thread - publishes frames of the recording paced at the camera fps or as fast as they are taken */
+static void *gcs_replayThread(void *context)
+{
+	GCS *gcs = context;
+	uint32_t frameSize = gcs_getFrameSize(&gcs->cameraParams);
+	while (gcs->replayRunning)
+	{
+		MMAL_BUFFER_HEADER_T *buffer = NULL;
+		const uint8_t *frame = NULL;
+		uint64_t ptsUS = 0;
+		if (gcs->cameraParams.replayMode == GCS_REPLAY_REALTIME)
+		{ // Wait for the frame time, frames without a free buffer are dropped like the camera would
+			frame = replay_nextFrame(gcs->replay, NULL, &ptsUS);
+			buffer = frame? mmal_queue_get(gcs->bufferPool->queue) : NULL;
+			if (frame && !buffer)
+				__atomic_fetch_add(&gcs->stats.dropped, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{ // Wait until the previous frame was taken and a buffer is free
+			pthread_mutex_lock(&gcs->frameWaitMutex);
+			while (gcs->replayRunning && (gcs_hasFrameBuffer(gcs) || (buffer = mmal_queue_get(gcs->bufferPool->queue)) == NULL))
+			{
+				struct timespec deadline;
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				deadline.tv_nsec += 1000000; // Leases are released without a signal, so check regularly
+				if (deadline.tv_nsec >= 1000000000)
+				{
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&gcs->frameReadyCond, &gcs->frameWaitMutex, &deadline);
+			}
+			pthread_mutex_unlock(&gcs->frameWaitMutex);
+			if (buffer)
+				frame = replay_nextFrame(gcs->replay, NULL, &ptsUS);
+		}
+
+		if (!gcs->replayRunning)
+		{
+			if (buffer) mmal_buffer_header_release(buffer);
+			break;
+		}
+
+		if (!frame)
+		{ // End of recording, stop stream so waiting users return
+			LOG_TRACE("Replay finished after %d frames", replay_getFrameCount(gcs->replay));
+			if (buffer) mmal_buffer_header_release(buffer);
+			gcs->started = 0;
+			gcs_signalFrameReady(gcs);
+			break;
+		}
+
+		if (!buffer) continue;
+		buffer->data = (uint8_t*)frame;
+		buffer->alloc_size = buffer->length = frameSize;
+		buffer->offset = 0;
+		gcs_publishFrame(gcs, buffer, (int64_t)ptsUS, gcs_getMonotonicUS());
+	}
+	return NULL;
+}
 
-	// If not done already signal that a frame is ready
-	if (vcos_mutex_is_locked(&gcs->frameReadyMutex))
-		vcos_mutex_unlock(&gcs->frameReadyMutex);
+/** Wakes up all users waiting for a frame. Taking the mutex ensures a waiter can not miss the signal between checking the slot and sleeping */
+static void gcs_signalFrameReady(GCS *gcs)
+{
+	pthread_mutex_lock(&gcs->frameWaitMutex);
+	pthread_cond_broadcast(&gcs->frameReadyCond);
+	pthread_mutex_unlock(&gcs->frameWaitMutex);
+
+	// Wake up event loops, only fails if the counter would overflow, then it is readable anyway
+	uint64_t one = 1;
+	if (write(gcs->frameEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		LOG_ERROR("Failed to signal frame event: %s", strerror(errno));
+}
+
+/** Current time of the monotonic clock in microseconds, same as used for frame timestamps */
+static uint64_t gcs_getMonotonicUS()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
 }
 
 /** Watchdog timer callback - stops playback because no frames have arrived from the camera for a while */
 static void gcs_onWatchdogTrigger(void *context)
 {
 	GCS *gcs = context;
+	GCS *camera = gcs->parent? gcs->parent : gcs;
+	if (camera->cameraParams.recoverAttempts > 0 && camera->camera)
+	{ // Secondary stream stalls with its camera
+		LOG_ERROR("%s: no frames received for %d ms, recovering", gcs->cameraOutput->name, GCS_WATCHDOG_TIMEOUT_MS);
+		gcs_requestRecovery(camera);
+		return;
+	}
 	LOG_ERROR("%s: no frames received for %d ms, aborting", gcs->cameraOutput->name, GCS_WATCHDOG_TIMEOUT_MS);
-	gcs_stop(gcs);
+	gcs_signalStop(gcs);
+}
+
+/** Marks the stream and its secondary stopped and wakes up waiting users.
+ * Disabling a port from its own callback thread can deadlock and the user may still read its leases,
+ * so the port and leases are left to gcs_stop from the user thread */
+static void gcs_signalStop(GCS *gcs)
+{
+	for (GCS *stream = gcs; stream; stream = stream == gcs? gcs->secondary : NULL)
+	{
+		__atomic_store_n(&stream->started, 0, __ATOMIC_RELEASE);
+		gcs_signalFrameReady(stream);
+	}
+}
+
+/** Hands recovery to the control thread, camera components can not be changed from callbacks */
+static void gcs_requestRecovery(GCS *gcs)
+{
+	uint64_t running = 0;
+	__atomic_compare_exchange_n(&gcs->recoveryStartUS, &running, gcs_getMonotonicUS(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&gcs->recoverPending, 1, __ATOMIC_ACQ_REL))
+		return; // Already pending
+	vcos_semaphore_post(&gcs->controlSemaphore);
+}
+
+/** Restarts the camera until it is running again, escalating from a restart in place to a rebuild with backoff.
+ * Stops the stream after recoverAttempts failed attempts. Only called from the control thread */
+static void gcs_recoverCamera(GCS *gcs)
+{
+	while (!gcs->controlQuit && gcs->started)
+	{
+		uint8_t attempt = ++gcs->recoveryAttempt;
+		if (attempt > gcs->cameraParams.recoverAttempts)
+		{
+			LOG_ERROR("Camera did not recover after %d attempts, stopping", attempt-1);
+			__atomic_store_n(&gcs->recoverPending, 0, __ATOMIC_RELEASE);
+			// Ports can be disabled here, but leases stay with the user until gcs_stop
+			gcs_signalStop(gcs);
+			vcos_mutex_lock(&gcs->controlMutex);
+			gcs_disableOutputs(gcs);
+			vcos_mutex_unlock(&gcs->controlMutex);
+			return;
+		}
+		__atomic_fetch_add(&gcs->stats.recoveryAttempts, 1, __ATOMIC_RELAXED);
+
+		if (attempt > 1)
+		{ // Give the camera time to settle, still reacting to destruction or stop
+			uint32_t backoffMS = GCS_RECOVERY_BACKOFF_MS << (attempt > 8? 6 : attempt-2);
+			if (backoffMS > GCS_RECOVERY_MAX_BACKOFF_MS) backoffMS = GCS_RECOVERY_MAX_BACKOFF_MS;
+			for (uint32_t waitedMS = 0; waitedMS < backoffMS && !gcs->controlQuit && gcs->started; waitedMS += 10)
+				usleep(10000);
+			if (gcs->controlQuit || !gcs->started)
+				break;
+		}
+
+		// Pending reports are covered by this attempt, the watchdog reports again if frames still do not arrive
+		__atomic_store_n(&gcs->recoverPending, 0, __ATOMIC_RELEASE);
+		LOG_ERROR("Recovering camera, attempt %d", attempt);
+		vcos_mutex_lock(&gcs->controlMutex);
+		uint8_t recovered = attempt == 1? gcs_restartCamera(gcs) : gcs_rebuildCamera(gcs);
+		vcos_mutex_unlock(&gcs->controlMutex);
+		if (recovered)
+			return;
+	}
+	__atomic_store_n(&gcs->recoverPending, 0, __ATOMIC_RELEASE);
+}
+
+/** Disables the output ports of both streams, unconsumed frames are dropped */
+static void gcs_disableOutputs(GCS *gcs)
+{
+	for (GCS *stream = gcs; stream; stream = stream == gcs? gcs->secondary : NULL)
+	{
+		vcos_timer_cancel(&stream->watchdogTimer);
+		stream->recovering = 1;
+		if (stream->cameraOutput && stream->cameraOutput->is_enabled)
+			mmal_port_disable(stream->cameraOutput);
+		stream->recovering = 0;
+		MMAL_BUFFER_HEADER_T *unused;
+		while ((unused = gcs_takeReadyFrame(stream)) != NULL)
+			mmal_buffer_header_release(unused);
+	}
+}
+
+/** Restarts the camera component in place, keeping ports and buffer pools. Called with the control mutex held */
+static uint8_t gcs_restartCamera(GCS *gcs)
+{
+	gcs_disableOutputs(gcs);
+	mmal_component_disable(gcs->camera);
+	MMAL_STATUS_T mstatus = mmal_component_enable(gcs->camera);
+	if (mstatus != MMAL_SUCCESS)
+	{
+		LOG_ERROR("Failed to enable camera: %s", mmal_status_to_string(mstatus));
+		return 0;
+	}
+	if (gcs_enableOutput(gcs) != MMAL_SUCCESS)
+		return 0;
+	if (gcs->secondary && gcs->secondary->started)
+		gcs_enableSecondary(gcs->secondary);
+	return 1;
+}
+
+/** Asks the user to release all frames of both streams and waits until they returned to their pools.
+ * Retained frames return on their own once written. Returns whether all frames returned */
+static uint8_t gcs_waitForRelease(GCS *gcs)
+{
+	uint8_t released = 0;
+	for (GCS *stream = gcs; stream; stream = stream == gcs? gcs->secondary : NULL)
+	{ // Wakes up users waiting for frames, requests return NULL while they hold leases
+		__atomic_store_n(&stream->releaseRequested, 1, __ATOMIC_RELEASE);
+		gcs_signalFrameReady(stream);
+	}
+	for (uint32_t waitedMS = 0; !gcs->controlQuit && gcs->started; waitedMS += 10)
+	{
+		released = 1;
+		for (GCS *stream = gcs; stream; stream = stream == gcs? gcs->secondary : NULL)
+		{
+			if (stream->bufferPool && mmal_queue_length(stream->bufferPool->queue) != stream->bufferPool->headers_num)
+				released = 0;
+		}
+		if (released || waitedMS >= GCS_RELEASE_TIMEOUT_MS)
+			break;
+		usleep(10000);
+	}
+	for (GCS *stream = gcs; stream; stream = stream == gcs? gcs->secondary : NULL)
+		__atomic_store_n(&stream->releaseRequested, 0, __ATOMIC_RELEASE);
+	return released;
+}
+
+/** Destroys and recreates the camera component with the same parameters, controls and crop. Called with the control mutex held.
+ * Buffers belong to the ports of the old component and can not be reused, so this is only possible once all frames are released.
+ * Frames of the new buffers carry the next generation, so users can drop state tied to old buffer handles */
+static uint8_t gcs_rebuildCamera(GCS *gcs)
+{
+	GCS *secondary = gcs->secondary;
+	gcs_disableOutputs(gcs);
+	if (!gcs_waitForRelease(gcs))
+	{
+		LOG_ERROR("Frames still leased or retained, camera can not be rebuilt yet!");
+		return 0;
+	}
+
+	uint8_t secondaryStarted = secondary && secondary->started;
+	if (secondary)
+	{
+		if (secondary->bufferPool)
+			mmal_pool_destroy(secondary->bufferPool);
+		secondary->bufferPool = NULL;
+		secondary->cameraOutput = NULL;
+	}
+	gcs_closeCamera(gcs);
+
+	MMAL_STATUS_T mstatus = gcs_openCamera(gcs);
+	CHECK_STATUS_M(mstatus, "Failed to rebuild camera", error);
+	gcs_attachFrameInfos(gcs);
+	if (secondary)
+	{
+		secondary->cameraOutput = gcs->camera->output[1]; // Video Port 1
+		mstatus = gcs_createOutput(secondary);
+		CHECK_STATUS_M(mstatus, "Failed to rebuild secondary output port", error);
+		gcs_attachFrameInfos(secondary);
+	}
+	for (GCS *stream = gcs; stream; stream = stream == gcs? secondary : NULL)
+		stream->generation++;
+
+	// Parameters of the old component are lost, controls are applied by the control thread right after
+	__atomic_or_fetch(&gcs->controlsPending, gcs_getControlsSet(&gcs->controls), __ATOMIC_RELEASE);
+	if (gcs->crop.width < 1 || gcs->crop.height < 1)
+	{
+		MMAL_PARAMETER_INPUT_CROP_T inputCrop = {{MMAL_PARAMETER_INPUT_CROP, sizeof(inputCrop)}};
+		inputCrop.rect.x = (int32_t)(gcs->crop.x * 65536);
+		inputCrop.rect.y = (int32_t)(gcs->crop.y * 65536);
+		inputCrop.rect.width = (int32_t)(gcs->crop.width * 65536);
+		inputCrop.rect.height = (int32_t)(gcs->crop.height * 65536);
+		mstatus = mmal_port_parameter_set(gcs->camera->control, &inputCrop.hdr);
+		if (mstatus != MMAL_SUCCESS)
+			LOG_ERROR("Failed to restore crop: %s", mmal_status_to_string(mstatus));
+	}
+
+	if (gcs_enableOutput(gcs) != MMAL_SUCCESS)
+		return 0;
+	if (secondaryStarted)
+		gcs_enableSecondary(secondary);
+	return 1;
+
+error:
+	return 0;
+}
+
+/* Queues a batch of control changes, applied together right after the next frame (right away if the stream is stopped) */
+int gcs_setControls(GCS *gcs, const GCS_Controls *controls)
+{
+	if (!gcs->camera)
+	{
+		LOG_ERROR("Controls are only supported with a camera!");
+		return -1;
+	}
+
+	// Merge into pending batch, later changes of the same control replace earlier ones
+	vcos_mutex_lock(&gcs->controlMutex);
+	if (controls->set & GCS_CONTROL_SHUTTER)
+		gcs->controls.shutterSpeed = controls->shutterSpeed;
+	if (controls->set & GCS_CONTROL_ISO)
+		gcs->controls.iso = controls->iso;
+	if (controls->set & GCS_CONTROL_BRIGHTNESS)
+		gcs->controls.brightness = controls->brightness > 100? 100 : controls->brightness;
+	if (controls->set & GCS_CONTROL_EXPOSURE_LOCK)
+		gcs->controls.disableEXP = controls->disableEXP;
+	if (controls->set & GCS_CONTROL_AWB_LOCK)
+		gcs->controls.disableAWB = controls->disableAWB;
+	if (controls->set & GCS_CONTROL_ISP_BLOCKS)
+		gcs->controls.disableISPBlocks = controls->disableISPBlocks;
+	__atomic_or_fetch(&gcs->controlsPending, controls->set, __ATOMIC_RELEASE);
+	vcos_mutex_unlock(&gcs->controlMutex);
+
+	if (!gcs->started)
+	{ // No frames to wait for
+		vcos_semaphore_post(&gcs->controlSemaphore);
+	}
+	return 0;
+}
+
+/* Returns the requested values of all controls, including those not yet applied */
+void gcs_getControls(GCS *gcs, GCS_Controls *controls)
+{
+	if (!gcs->camera)
+	{
+		memset(controls, 0, sizeof(GCS_Controls));
+		return;
+	}
+	vcos_mutex_lock(&gcs->controlMutex);
+	*controls = gcs->controls;
+	controls->set = gcs->controlsPending;
+	vcos_mutex_unlock(&gcs->controlMutex);
+}
+
+/** Applies all pending controls to the camera */
+static void gcs_applyControls(GCS *gcs)
+{
+	vcos_mutex_lock(&gcs->controlMutex);
+	GCS_Controls controls = gcs->controls;
+	uint32_t pending = __atomic_exchange_n(&gcs->controlsPending, 0, __ATOMIC_ACQ_REL);
+	vcos_mutex_unlock(&gcs->controlMutex);
+
+	MMAL_PORT_T *control = gcs->camera->control;
+	MMAL_STATUS_T mstatus;
+	if (pending & GCS_CONTROL_SHUTTER)
+	{
+		mstatus = mmal_port_parameter_set_uint32(control, MMAL_PARAMETER_SHUTTER_SPEED, controls.shutterSpeed);
+		if (mstatus != MMAL_SUCCESS) LOG_ERROR("Failed to set shutter speed: %s", mmal_status_to_string(mstatus));
+	}
+	if (pending & GCS_CONTROL_ISO)
+	{
+		mstatus = mmal_port_parameter_set_uint32(control, MMAL_PARAMETER_ISO, controls.iso);
+		if (mstatus != MMAL_SUCCESS) LOG_ERROR("Failed to set ISO: %s", mmal_status_to_string(mstatus));
+	}
+	if (pending & GCS_CONTROL_BRIGHTNESS)
+	{
+		MMAL_RATIONAL_T value = { controls.brightness, 100 };
+		mstatus = mmal_port_parameter_set_rational(control, MMAL_PARAMETER_BRIGHTNESS, value);
+		if (mstatus != MMAL_SUCCESS) LOG_ERROR("Failed to set brightness: %s", mmal_status_to_string(mstatus));
+	}
+	if (pending & GCS_CONTROL_EXPOSURE_LOCK)
+	{ // Freezes the current analog and digital gains
+		MMAL_PARAMETER_EXPOSUREMODE_T exposureMode = {{MMAL_PARAMETER_EXPOSURE_MODE, sizeof(exposureMode)},
+			controls.disableEXP? MMAL_PARAM_EXPOSUREMODE_OFF : MMAL_PARAM_EXPOSUREMODE_AUTO};
+		mstatus = mmal_port_parameter_set(control, &exposureMode.hdr);
+		if (mstatus != MMAL_SUCCESS) LOG_ERROR("Failed to set exposure mode: %s", mmal_status_to_string(mstatus));
+	}
+	if (pending & GCS_CONTROL_AWB_LOCK)
+	{
+		MMAL_PARAMETER_AWBMODE_T awbMode = {{MMAL_PARAMETER_AWB_MODE, sizeof(awbMode)},
+			controls.disableAWB? MMAL_PARAM_AWBMODE_OFF : MMAL_PARAM_AWBMODE_AUTO};
+		mstatus = mmal_port_parameter_set(control, &awbMode.hdr);
+		if (mstatus != MMAL_SUCCESS) LOG_ERROR("Failed to set AWB mode: %s", mmal_status_to_string(mstatus));
+	}
+	if (pending & GCS_CONTROL_ISP_BLOCKS)
+	{ // https://www.raspberrypi.org/forums/viewtopic.php?f=43&t=175711
+		mstatus = mmal_port_parameter_set_uint32(control, MMAL_PARAMETER_CAMERA_ISP_BLOCK_OVERRIDE, ~controls.disableISPBlocks);
+		if (mstatus != MMAL_SUCCESS) LOG_ERROR("Failed to override ISP blocks: %s", mmal_status_to_string(mstatus));
+	}
+}
+
+/** Applies pending controls whenever signaled, so changes made at any rate reach the camera at most once per frame */
+static void *gcs_controlThread(void *context)
+{
+	GCS *gcs = (GCS*)context;
+	while (1)
+	{
+		vcos_semaphore_wait(&gcs->controlSemaphore);
+		if (gcs->controlQuit)
+			break;
+		if (__atomic_load_n(&gcs->recoverPending, __ATOMIC_ACQUIRE))
+			gcs_recoverCamera(gcs);
+		if (!gcs->camera)
+			continue;
+		if (__atomic_load_n(&gcs->controlsPending, __ATOMIC_ACQUIRE))
+			gcs_applyControls(gcs);
+	}
+	return NULL;
+}
+
+/** Returns the flags of all controls that differ from the camera defaults, to be applied to a new camera component */
+static uint32_t gcs_getControlsSet(const GCS_Controls *controls)
+{
+	return GCS_CONTROL_BRIGHTNESS
+		| (controls->shutterSpeed != 0? GCS_CONTROL_SHUTTER : 0)
+		| (controls->iso != 0? GCS_CONTROL_ISO : 0)
+		| (controls->disableEXP? GCS_CONTROL_EXPOSURE_LOCK : 0)
+		| (controls->disableAWB? GCS_CONTROL_AWB_LOCK : 0)
+		| (controls->disableISPBlocks != 0? GCS_CONTROL_ISP_BLOCKS : 0);
+}
+
+/** Allocates the frame info of each pool buffer and attaches it */
+static VCOS_STATUS_T gcs_createFrameInfos(GCS *gcs)
+{
+	gcs->frameInfos = vcos_calloc(gcs->bufferPool->headers_num, sizeof(GCS_FrameInfo), "gcs-frameinfo");
+	if (!gcs->frameInfos)
+		return VCOS_ENOMEM;
+	gcs_attachFrameInfos(gcs);
+	gcs->crop.width = gcs->crop.height = 1;
+	return VCOS_SUCCESS;
+}
+
+/** References the frame info of each pool buffer in its user data */
+static void gcs_attachFrameInfos(GCS *gcs)
+{
+	for (uint32_t i = 0; i < gcs->bufferPool->headers_num; i++)
+		gcs->bufferPool->header[i]->user_data = &gcs->frameInfos[i];
+}
+
+/* Sets the region of the sensor image that is scaled to the output, in normalized coordinates (0-1) */
+int gcs_setCrop(GCS *gcs, float x, float y, float width, float height)
+{
+	if (gcs->replay || gcs->parent)
+	{
+		LOG_ERROR("Crop is only supported with a camera!");
+		return -1;
+	}
+	GCS_Crop crop;
+	crop.x = x < 0? 0 : (x > 1? 1 : x);
+	crop.y = y < 0? 0 : (y > 1? 1 : y);
+	crop.width = width > 1 - crop.x? 1 - crop.x : width;
+	crop.height = height > 1 - crop.y? 1 - crop.y : height;
+	if (crop.width <= 0 || crop.height <= 0)
+	{
+		LOG_ERROR("Empty crop %fx%f!", width, height);
+		return -1;
+	}
+
+	// Input crop is in fractions of the sensor image scaled to 65536, the ISP applies it to the running stream
+	MMAL_PARAMETER_INPUT_CROP_T inputCrop = {{MMAL_PARAMETER_INPUT_CROP, sizeof(inputCrop)}};
+	inputCrop.rect.x = (int32_t)(crop.x * 65536);
+	inputCrop.rect.y = (int32_t)(crop.y * 65536);
+	inputCrop.rect.width = (int32_t)(crop.width * 65536);
+	inputCrop.rect.height = (int32_t)(crop.height * 65536);
+	vcos_mutex_lock(&gcs->controlMutex);
+	MMAL_STATUS_T mstatus = gcs->camera? mmal_port_parameter_set(gcs->camera->control, &inputCrop.hdr) : MMAL_ENXIO;
+	if (mstatus == MMAL_SUCCESS)
+	{ // Also restored by recovery
+		gcs->crop = crop;
+		if (gcs->secondary)
+			gcs->secondary->crop = crop;
+	}
+	vcos_mutex_unlock(&gcs->controlMutex);
+	if (mstatus != MMAL_SUCCESS)
+	{
+		LOG_ERROR("Failed to set crop: %s", mmal_status_to_string(mstatus));
+		return -1;
+	}
+	return 0;
+}
+
+/* Changes output size and fps of the camera, briefly disabling the output port if the stream is running */
+int gcs_setOutputFormat(GCS *gcs, uint16_t width, uint16_t height, uint16_t fps)
+{
+	if (gcs->replay || gcs->parent)
+	{
+		LOG_ERROR("Output format can only be changed with a camera!");
+		return -1;
+	}
+	if (gcs_getLeasedFrameCount(gcs) > 0)
+	{ // Buffers may be reallocated
+		LOG_ERROR("Return all leased frames before changing the output format!");
+		return -1;
+	}
+	vcos_mutex_lock(&gcs->controlMutex);
+	if (!gcs->camera)
+	{ // Lost in recovery
+		vcos_mutex_unlock(&gcs->controlMutex);
+		LOG_ERROR("Camera is not available!");
+		return -1;
+	}
+
+	// Disable output, buffers returned by the port are released to the pool while not started
+	uint8_t started = gcs->started;
+	gcs->started = 0;
+	vcos_timer_cancel(&gcs->watchdogTimer);
+	if (gcs->cameraOutput->is_enabled)
+		mmal_port_disable(gcs->cameraOutput);
+	MMAL_BUFFER_HEADER_T *unused;
+	while ((unused = gcs_takeReadyFrame(gcs)) != NULL)
+		mmal_buffer_header_release(unused);
+
+	MMAL_VIDEO_FORMAT_T *videoFormat = &gcs->cameraOutput->format->es->video;
+	videoFormat->width = width;
+	videoFormat->height = height;
+	videoFormat->crop.x = 0;
+	videoFormat->crop.y = 0;
+	videoFormat->crop.width = width;
+	videoFormat->crop.height = height;
+	videoFormat->frame_rate.num = fps;
+	videoFormat->frame_rate.den = 1;
+	MMAL_STATUS_T mstatus = mmal_port_format_commit(gcs->cameraOutput);
+	if (mstatus != MMAL_SUCCESS)
+	{ // Restore previous format
+		LOG_ERROR("Failed to set output format %dx%d@%d: %s", width, height, fps, mmal_status_to_string(mstatus));
+		videoFormat->width = videoFormat->crop.width = gcs->cameraParams.width;
+		videoFormat->height = videoFormat->crop.height = gcs->cameraParams.height;
+		videoFormat->frame_rate.num = gcs->cameraParams.fps;
+		mmal_port_format_commit(gcs->cameraOutput);
+	}
+	else
+	{
+		gcs->cameraParams.width = width;
+		gcs->cameraParams.height = height;
+		gcs->cameraParams.fps = fps;
+
+		// Larger frames need larger buffers (opaque buffers only hold a handle and keep their size)
+		if (gcs->cameraOutput->buffer_size_recommended > gcs->cameraOutput->buffer_size)
+		{ // Only possible with all buffers back in the pool, retained frames included
+			if (mmal_queue_length(gcs->bufferPool->queue) != gcs->bufferPool->headers_num)
+			{
+				LOG_ERROR("Frames still retained, buffers can not be resized!");
+				mstatus = MMAL_EINVAL;
+			}
+			else
+			{
+				gcs->cameraOutput->buffer_size = gcs->cameraOutput->buffer_size_recommended;
+				mstatus = mmal_pool_resize(gcs->bufferPool, gcs->cameraOutput->buffer_num, gcs->cameraOutput->buffer_size);
+				if (mstatus != MMAL_SUCCESS)
+					LOG_ERROR("Failed to resize buffers: %s", mmal_status_to_string(mstatus));
+				gcs_attachFrameInfos(gcs);
+			}
+		}
+	}
+
+	if (started)
+	{
+		gcs->started = 1;
+		if (gcs_enableOutput(gcs) != MMAL_SUCCESS)
+		{
+			gcs->started = 0;
+			gcs_signalFrameReady(gcs);
+			mstatus = MMAL_EINVAL;
+		}
+	}
+	vcos_mutex_unlock(&gcs->controlMutex);
+	return mstatus == MMAL_SUCCESS? 0 : -1;
 }
 
 int gcs_annotate(GCS *gcs, const char *string) 
 {
+	if (gcs->replay || gcs->parent) return -1;
+
 	//Annotate text (work in progess)
     MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T annotate =
     {{MMAL_PARAMETER_ANNOTATE, sizeof(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T)}};
@@ -461,6 +1727,9 @@ int gcs_annotate(GCS *gcs, const char *string)
     annotate.custom_background_U = 255; //128 for black
     annotate.custom_background_V = 107; //128 for black
          
-    return mmal_port_parameter_set(gcs->camera->control, &annotate.hdr);
+    vcos_mutex_lock(&gcs->controlMutex);
+    int status = gcs->camera? mmal_port_parameter_set(gcs->camera->control, &annotate.hdr) : -1;
+    vcos_mutex_unlock(&gcs->controlMutex);
+    return status;
 	
 }
@@ -11,6 +11,20 @@ extern "C" {
 	Simple MMAL camera stream using the preview port, keeping only the most recent camera frame buffer for realtime, low-latency CV applications
 */
 
+/* Policy for frames the user did not request in time */
+typedef enum GCS_FramePolicy
+{
+	GCS_FRAME_LATEST = 0, // Keep only the newest frame, lowest latency
+	GCS_FRAME_FIFO = 1, // Queue up to queueDepth frames in order and drop the oldest, for throughput and recording
+} GCS_FramePolicy;
+
+/* Pacing of frames replayed from a recording */
+typedef enum GCS_ReplayMode
+{
+	GCS_REPLAY_REALTIME = 0, // Publish at the camera fps, frames not requested in time are dropped like with the camera
+	GCS_REPLAY_FREERUN = 1, // Publish the next frame as soon as the previous one was requested, for throughput benchmarks
+} GCS_ReplayMode;
+
 /* Camera parameters passed for MMAL camera set up */
 typedef struct GCS_CameraParams
 {
@@ -24,8 +38,53 @@ typedef struct GCS_CameraParams
 	uint8_t disableAWB;
 	uint32_t disableISPBlocks;
 	uint32_t camera_num;
+	uint8_t bufferCount; // Camera buffers in the pool (3-16), 0 for default
+	GCS_FramePolicy framePolicy;
+	uint8_t queueDepth; // Frames queued with GCS_FRAME_FIFO, at most bufferCount-2, 0 for maximum
+	const char *replayFile; // Raw recording (mmalEnc, width x height) to replay instead of the camera, NULL for camera
+	GCS_ReplayMode replayMode;
+	uint8_t replayLoop; // Restart the recording at the end instead of stopping the stream
+	uint8_t brightness; // 0-100, 0 for default (60)
+	uint16_t secondaryWidth; // Size of an additional downscaled stream from the video port, 0 for none (camera only)
+	uint16_t secondaryHeight;
+	uint32_t secondaryEnc; // Encoding of the secondary stream, 0 for the same as mmalEnc
+	uint8_t recoverAttempts; // Attempts to restart the camera after a stall or error before stopping the stream, 0 to stop right away
 } GCS_CameraParams;
 
+/* Camera controls that can be changed while the stream is running */
+typedef enum GCS_ControlFlags
+{
+	GCS_CONTROL_SHUTTER = 1 << 0,
+	GCS_CONTROL_ISO = 1 << 1,
+	GCS_CONTROL_BRIGHTNESS = 1 << 2,
+	GCS_CONTROL_EXPOSURE_LOCK = 1 << 3,
+	GCS_CONTROL_AWB_LOCK = 1 << 4,
+	GCS_CONTROL_ISP_BLOCKS = 1 << 5,
+} GCS_ControlFlags;
+
+/* Batch of control changes, only the fields flagged in set are changed */
+typedef struct GCS_Controls
+{
+	uint32_t set; // GCS_CONTROL_* flags
+	uint32_t shutterSpeed; // Exposure time in microseconds, 0 for auto
+	uint32_t iso; // 0 for auto
+	uint8_t brightness; // 0-100
+	uint8_t disableEXP; // Lock exposure gains
+	uint8_t disableAWB; // Lock white balance
+	uint32_t disableISPBlocks; // Bits of ISP blocks to disable, see below
+} GCS_Controls;
+
+/* Frame counters since start */
+typedef struct GCS_Stats
+{
+	uint32_t received; // Frames received from the camera
+	uint32_t delivered; // Frames handed out to the user
+	uint32_t dropped; // Frames released without being requested by the user
+	uint32_t recoveries; // Times the camera was restarted after a stall or error and frames arrived again
+	uint32_t recoveryAttempts; // Restarts attempted, including failed ones
+	uint32_t downtimeMS; // Time without frames from detecting the stall or error until frames arrived again, summed over all recoveries
+} GCS_Stats;
+
 /* Disable ISP Blocks */
 // https://www.raspberrypi.org/forums/viewtopic.php?f=43&t=175711
 // (1 << 2); // Black Level Compensation
@@ -37,32 +96,136 @@ typedef struct GCS_CameraParams
 // (1 << 22); // Sharpening
 // (1 << 24); // Some Color Conversion
 
+/* Region of the sensor image scaled to the output, in normalized coordinates (0-1) */
+typedef struct GCS_Crop
+{
+	float x, y, width, height;
+} GCS_Crop;
+
+/* Timing and geometry of a camera frame. All times are in microseconds of CLOCK_MONOTONIC */
+typedef struct GCS_FrameInfo
+{
+	int64_t pts; // Raw sensor presentation timestamp (VideoCore STC)
+	uint64_t captureUS; // Sensor timestamp converted to the monotonic clock, 0 if unavailable
+	uint64_t arrivalUS; // Time the frame arrived in the output callback
+	uint32_t sequence; // Number of frames received since start, gaps between consumed frames are dropped frames
+	uint16_t width, height; // Output size of the frame
+	GCS_Crop crop; // Sensor crop requested when the frame arrived, the ISP may apply changes a frame late
+	uint32_t generation; // Camera rebuilds by recovery before the frame, buffers of a new generation are new even if handles repeat
+} GCS_FrameInfo;
+
 /* Opaque GPU Camera Stream structure */
 typedef struct GCS GCS;
 
 GCS *gcs_create(GCS_CameraParams *cameraParams);
 void gcs_destroy(GCS *gcs);
 
+/* Returns the size in bytes of one frame with the encoding and resolution of the parameters.
+ * Opaque frames are assumed to be I420 as that is what they are converted to, unknown encodings as single channel Y. */
+uint32_t gcs_getFrameSize(const GCS_CameraParams *cameraParams);
+
 /* Start GCS (camera stream). Enables MMAL camera and starts watchdog */
 uint8_t gcs_start(GCS *gcs);
 
 /* Stop GCS (camera output). Stops watchdog and disabled MMAL camera */
 void gcs_stop(GCS *gcs);
 
+/* With recoverAttempts set, a stall of GCS_WATCHDOG_TIMEOUT_MS (4s) or a camera error does not stop the stream.
+ * Instead the camera is restarted in place, then rebuilt with the same parameters, controls and crop, with backoff.
+ * A rebuild needs all frames released, so keep leases short. It waits up to a second for leased frames to be released
+ * (see gcs_isReleaseRequested) and retained ones to be written. The stream stays started meanwhile, waiting users only see
+ * no frames, and recoveries and downtime are counted in GCS_Stats. The stream stops after recoverAttempts failed attempts. */
+
 /* Returns whether there is a new camera frame available */
 uint8_t gcs_hasFrameBuffer(GCS *gcs);
 
-/* Returns the most recent camera frame. If no camera frame is available yet, blocks until there is.
- * If the last frame has not been returned yet, returns NULL. */
+/* Returns a lease of the most recent camera frame. If no camera frame is available yet, blocks until there is.
+ * Several frames may be leased at once (see gcs_getMaxLeasedFrames), e.g. to process frame N on the QPU while preparing N+1.
+ * Frames are requested from one thread, leases may be released from any thread.
+ * If the maximum number of leases is outstanding or the stream stopped, returns NULL. */
 void* gcs_requestFrameBuffer(GCS *gcs);
 
+/* Timeout to wait indefinitely in gcs_requestFrameBufferTimeout */
+#define GCS_WAIT_FOREVER 0xFFFFFFFF
+
+/* Same as gcs_requestFrameBuffer, but waits at most timeoutMS for a frame before returning NULL */
+void* gcs_requestFrameBufferTimeout(GCS *gcs, uint32_t timeoutMS);
+
+/* Returns a lease of the next ready camera frame without blocking, or NULL if there is none (or too many are leased) */
+void* gcs_tryRequestFrameBuffer(GCS *gcs);
+
+/* Returns a file descriptor that is readable while a new frame may be available, to be used with poll/select/epoll.
+ * Also signaled when the stream stops. Spurious wakeups are possible, so follow up with gcs_tryRequestFrameBuffer.
+ * Owned by GCS, do not read from or close it. */
+int gcs_getFrameEventFD(GCS *gcs);
+
 /* Returns the data of the given MMAL framebuffer. Use after gcs_requestFrameBuffer to get the underlying buffer. */
 void* gcs_getFrameBufferData(void *framebuffer);
 
-/* Return requested Frane Buffer after processing is done.
- * Has to be called before a new frame buffer can be requested. */
+/* Returns the timestamps and sequence number of the given MMAL framebuffer. Valid while the frame is leased. */
+const GCS_FrameInfo* gcs_getFrameBufferInfo(void *framebuffer);
+
+/* Returns the leased frame buffer after processing is done so the camera can reuse it. */
+void gcs_releaseFrameBuffer(GCS *gcs, void *framebuffer);
+
+/* Returns all leased frame buffers after processing is done. */
 void gcs_returnFrameBuffer(GCS *gcs);
 
+/* Keeps an additional reference to a leased frame buffer that outlives the lease, e.g. for asynchronous recording.
+ * The camera can only reuse the buffer once the lease and all references are released, so keep few and short. */
+void gcs_retainFrameBuffer(GCS *gcs, void *framebuffer);
+
+/* Releases a reference taken with gcs_retainFrameBuffer. May be called from any thread. */
+void gcs_releaseRetainedFrameBuffer(GCS *gcs, void *framebuffer);
+
+/* Returns the number of frames currently leased to the user */
+uint8_t gcs_getLeasedFrameCount(GCS *gcs);
+
+/* Returns the maximum number of frames that can be leased at the same time, bounded by the buffer pool */
+uint8_t gcs_getMaxLeasedFrames(GCS *gcs);
+
+/* Returns whether the stream is started, e.g. for other threads waiting on frames to notice it stopped */
+uint8_t gcs_isStarted(GCS *gcs);
+
+/* Returns whether recovery waits for all frames to be released to rebuild the camera. Meanwhile requests return NULL
+ * instead of waiting as long as frames are leased, so users keeping frames across requests can release them */
+uint8_t gcs_isReleaseRequested(GCS *gcs);
+
+/* Returns the frame counters since the stream started */
+void gcs_getStats(GCS *gcs, GCS_Stats *stats);
+
+/* Returns the camera parameters in effect, with buffer count and queue depth resolved */
+const GCS_CameraParams* gcs_getCameraParams(GCS *gcs);
+
+/* Returns the downscaled stream of the camera if secondaryWidth/Height were set, else NULL.
+ * It is a GCS of its own with the same frame policy and buffer count, frames are requested, leased and released on it as usual.
+ * It is started, stopped and destroyed together with the camera, crop and controls are set on the camera.
+ * Frames of both streams taken from the same sensor frame carry the same pts. */
+GCS *gcs_getSecondaryStream(GCS *gcs);
+
+/* Returns a lease of the first frame with a pts at or after the given one, releasing older frames, waiting at most timeoutMS.
+ * Used to fetch the full resolution frame matching a frame of the secondary stream, which requires GCS_FRAME_FIFO
+ * so the matching frame is still queued when asked for. Returns NULL on timeout or if the stream stopped. */
+void* gcs_requestFrameBufferAt(GCS *gcs, int64_t pts, uint32_t timeoutMS);
+
+/* Sets the region of the sensor image that is scaled to the output, in normalized coordinates (0-1).
+ * Applies to the running stream, e.g. to zoom in on a tracked target. Returns 0 on success. */
+int gcs_setCrop(GCS *gcs, float x, float y, float width, float height);
+
+/* Changes output size and fps of the camera without recreating it, the output port is only briefly disabled if started.
+ * All leased and retained frames have to be released first, as buffers may be reallocated. Returns 0 on success.
+ * Frames carry their size in GCS_FrameInfo, so consumers can detect the change. */
+int gcs_setOutputFormat(GCS *gcs, uint16_t width, uint16_t height, uint16_t fps);
+
+/* Queues a batch of control changes, merged with changes not yet applied.
+ * The control thread applies them together right after the next frame arrives (right away if stopped), so an
+ * auto-exposure loop can call this every frame without stalling it and changes reach the camera at most once per frame.
+ * Returns 0 if queued, -1 without camera (replay). */
+int gcs_setControls(GCS *gcs, const GCS_Controls *controls);
+
+/* Returns the requested values of all controls, set holds the flags of those not yet applied */
+void gcs_getControls(GCS *gcs, GCS_Controls *controls);
+
 int gcs_annotate(GCS *gcs, const char *string);
 
 #ifdef __cplusplus
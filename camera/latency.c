@@ -0,0 +1,113 @@
+#include "latency.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LATENCY_BUCKET_US 250
+#define LATENCY_BUCKETS 400 // Up to 100ms, plus one overflow bucket
+
+typedef struct LatencyStage
+{
+	char name[32];
+	uint32_t histogram[LATENCY_BUCKETS+1];
+	uint32_t count;
+	uint32_t maxUS;
+	uint64_t sumUS;
+} LatencyStage;
+
+struct LatencyTracker
+{
+	LatencyStage stages[LATENCY_MAX_STAGES];
+	int stageCount;
+};
+
+LatencyTracker *latency_create()
+{
+	return calloc(1, sizeof(LatencyTracker));
+}
+
+void latency_destroy(LatencyTracker *tracker)
+{
+	free(tracker);
+}
+
+int latency_addStage(LatencyTracker *tracker, const char *name)
+{
+	if (tracker->stageCount >= LATENCY_MAX_STAGES)
+		return -1;
+	LatencyStage *stage = &tracker->stages[tracker->stageCount];
+	strncpy(stage->name, name, sizeof(stage->name)-1);
+	return tracker->stageCount++;
+}
+
+uint64_t latency_now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+void latency_stamp(LatencyTracker *tracker, int stage, uint64_t captureUS)
+{
+	if (captureUS == 0) return;
+	uint64_t now = latency_now();
+	latency_record(tracker, stage, now > captureUS? (uint32_t)(now - captureUS) : 0);
+}
+
+void latency_record(LatencyTracker *tracker, int stage, uint32_t latencyUS)
+{
+	if (stage < 0 || stage >= tracker->stageCount) return;
+	LatencyStage *s = &tracker->stages[stage];
+	uint32_t bucket = latencyUS / LATENCY_BUCKET_US;
+	s->histogram[bucket < LATENCY_BUCKETS? bucket : LATENCY_BUCKETS]++;
+	s->count++;
+	s->sumUS += latencyUS;
+	if (latencyUS > s->maxUS) s->maxUS = latencyUS;
+}
+
+uint32_t latency_getPercentile(LatencyTracker *tracker, int stage, float fraction)
+{
+	if (stage < 0 || stage >= tracker->stageCount) return 0;
+	LatencyStage *s = &tracker->stages[stage];
+	if (s->count == 0) return 0;
+	uint32_t target = (uint32_t)(fraction * s->count), accum = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++)
+	{
+		accum += s->histogram[b];
+		if (accum > target)
+			return (b+1) * LATENCY_BUCKET_US;
+	}
+	return s->maxUS;
+}
+
+void latency_log(LatencyTracker *tracker, FILE *file)
+{
+	for (int i = 0; i < tracker->stageCount; i++)
+	{
+		LatencyStage *s = &tracker->stages[i];
+		if (s->count == 0)
+		{
+			fprintf(file, "Latency %s: no samples\n", s->name);
+			continue;
+		}
+		fprintf(file, "Latency %s: %u frames, mean %.2fms, p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n",
+			s->name, s->count, (float)s->sumUS / s->count / 1000,
+			latency_getPercentile(tracker, i, 0.5f) / 1000.0f,
+			latency_getPercentile(tracker, i, 0.9f) / 1000.0f,
+			latency_getPercentile(tracker, i, 0.99f) / 1000.0f,
+			s->maxUS / 1000.0f);
+	}
+}
+
+void latency_reset(LatencyTracker *tracker)
+{
+	for (int i = 0; i < tracker->stageCount; i++)
+	{
+		LatencyStage *s = &tracker->stages[i];
+		memset(s->histogram, 0, sizeof(s->histogram));
+		s->count = 0;
+		s->maxUS = 0;
+		s->sumUS = 0;
+	}
+}
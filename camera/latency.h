@@ -0,0 +1,50 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Latency Tracker
+	Histograms of the latency from sensor capture to named pipeline stages (e.g. detection done, presented)
+	Apps stamp each stage with the capture time of the frame (GCS_FrameInfo / CamGL_Frame captureUS)
+	Buckets are 250us wide up to 100ms, slower frames are counted in an overflow bucket
+*/
+
+#define LATENCY_MAX_STAGES 8
+
+/* Opaque latency tracker structure */
+typedef struct LatencyTracker LatencyTracker;
+
+LatencyTracker *latency_create();
+void latency_destroy(LatencyTracker *tracker);
+
+/* Adds a named stage and returns its index, or -1 if LATENCY_MAX_STAGES are exceeded */
+int latency_addStage(LatencyTracker *tracker, const char *name);
+
+/* Current time of the monotonic clock in microseconds, same clock as the frame timestamps */
+uint64_t latency_now();
+
+/* Records the latency from captureUS to now for the stage. Ignored if captureUS is 0 (unavailable) */
+void latency_stamp(LatencyTracker *tracker, int stage, uint64_t captureUS);
+
+/* Records a latency measured externally for the stage */
+void latency_record(LatencyTracker *tracker, int stage, uint32_t latencyUS);
+
+/* Returns the latency in microseconds below which the given fraction (0-1) of samples of the stage lie */
+uint32_t latency_getPercentile(LatencyTracker *tracker, int stage, float fraction);
+
+/* Prints count, mean, median, 90th/99th percentile and max of all stages */
+void latency_log(LatencyTracker *tracker, FILE *file);
+
+/* Clears all recorded samples, keeping the stages */
+void latency_reset(LatencyTracker *tracker);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
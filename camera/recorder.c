@@ -0,0 +1,308 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "recorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "interface/mmal/mmal.h"
+
+/* Upper bound of frames retained by the recorder */
+#define RECORDER_MAX_PENDING 16
+
+/* O_DIRECT requires writes aligned to the logical block size, a page covers all common devices */
+#define RECORDER_ALIGNMENT 4096
+
+typedef struct PendingFrame
+{
+	void *framebuffer;
+	GCS_FrameInfo info;
+} PendingFrame;
+
+struct Recorder
+{
+	GCS *gcs;
+	RecorderParams params;
+	uint32_t frameSize;
+
+	// Files
+	int fd;
+	FILE *meta;
+	uint8_t *chunk; // Aligned staging buffer collecting frame data for large writes
+	uint32_t chunkFill;
+	uint64_t fileSize;
+
+	// Frames retained until the writer thread gets to them, in submission order
+	PendingFrame pending[RECORDER_MAX_PENDING];
+	uint8_t pendingStart, pendingCount;
+	uint8_t writing; // Frame taken by the writer thread, still retained
+	pthread_mutex_t mutex; // Protects pending frames, flags and stats
+	pthread_cond_t pendingCond;
+	pthread_t writerThread;
+	uint8_t running;
+	uint8_t failed; // Writing failed, all further frames are dropped
+
+	RecorderStats stats;
+};
+
+static void *recorder_writerThread(void *context);
+static uint8_t recorder_writeFrame(Recorder *recorder, const PendingFrame *frame);
+static uint8_t recorder_writeAll(Recorder *recorder, const uint8_t *data, uint32_t size);
+static uint8_t recorder_finish(Recorder *recorder);
+
+Recorder *recorder_create(GCS *gcs, const char *filePath, const RecorderParams *params)
+{
+	const GCS_CameraParams *cameraParams = gcs_getCameraParams(gcs);
+	if (cameraParams->mmalEnc == 0 || cameraParams->mmalEnc == MMAL_ENCODING_OPAQUE)
+	{
+		fprintf(stderr, "Can not record opaque camera frames, select an encoding like I420!\n");
+		return NULL;
+	}
+
+	Recorder *recorder = calloc(1, sizeof(Recorder));
+	if (!recorder) return NULL;
+	recorder->gcs = gcs;
+	recorder->frameSize = gcs_getFrameSize(cameraParams);
+	if (params) recorder->params = *params;
+	if (recorder->params.maxPending == 0)
+		recorder->params.maxPending = 2;
+	if (recorder->params.maxPending > RECORDER_MAX_PENDING)
+		recorder->params.maxPending = RECORDER_MAX_PENDING;
+	if (recorder->params.chunkSize == 0)
+		recorder->params.chunkSize = 4*1024*1024;
+	recorder->params.chunkSize = (recorder->params.chunkSize + RECORDER_ALIGNMENT-1) / RECORDER_ALIGNMENT * RECORDER_ALIGNMENT;
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	recorder->fd = -1;
+	if (recorder->params.directIO)
+	{
+		recorder->fd = open(filePath, flags | O_DIRECT, 0644);
+		if (recorder->fd < 0)
+		{
+			fprintf(stderr, "O_DIRECT not supported for %s (%s), using buffered writes!\n", filePath, strerror(errno));
+			recorder->params.directIO = 0;
+		}
+	}
+	if (recorder->fd < 0)
+		recorder->fd = open(filePath, flags, 0644);
+	if (recorder->fd < 0)
+	{
+		perror("Failed to open recording file");
+		goto error_open;
+	}
+
+	char metaPath[1024];
+	snprintf(metaPath, sizeof(metaPath), "%s.meta", filePath);
+	recorder->meta = fopen(metaPath, "w");
+	if (!recorder->meta)
+	{
+		perror("Failed to open recording sidecar");
+		goto error_meta;
+	}
+	uint32_t enc = cameraParams->mmalEnc;
+	fprintf(recorder->meta, "# width height fourcc frameSize\n%u %u %.4s %u\n# sequence pts captureUS arrivalUS\n",
+		cameraParams->width, cameraParams->height, (const char*)&enc, recorder->frameSize);
+
+	if (posix_memalign((void**)&recorder->chunk, RECORDER_ALIGNMENT, recorder->params.chunkSize) != 0)
+	{
+		fprintf(stderr, "Failed to allocate recording buffer of %u bytes!\n", recorder->params.chunkSize);
+		goto error_chunk;
+	}
+
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->pendingCond, NULL);
+	recorder->running = 1;
+	if (pthread_create(&recorder->writerThread, NULL, recorder_writerThread, recorder) != 0)
+	{
+		fprintf(stderr, "Failed to create recording thread!\n");
+		goto error_thread;
+	}
+	return recorder;
+
+error_thread:
+	pthread_cond_destroy(&recorder->pendingCond);
+	pthread_mutex_destroy(&recorder->mutex);
+	free(recorder->chunk);
+error_chunk:
+	fclose(recorder->meta);
+error_meta:
+	close(recorder->fd);
+error_open:
+	free(recorder);
+	return NULL;
+}
+
+void recorder_stop(Recorder *recorder)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	uint8_t running = recorder->running;
+	recorder->running = 0;
+	pthread_cond_signal(&recorder->pendingCond);
+	pthread_mutex_unlock(&recorder->mutex);
+	if (!running) return;
+
+	// Writer thread writes all pending frames before exiting
+	pthread_join(recorder->writerThread, NULL);
+	if (!recorder_finish(recorder))
+		fprintf(stderr, "Recording is incomplete!\n");
+}
+
+void recorder_destroy(Recorder *recorder)
+{
+	if (!recorder) return;
+	recorder_stop(recorder);
+	fclose(recorder->meta);
+	close(recorder->fd);
+
+	pthread_cond_destroy(&recorder->pendingCond);
+	pthread_mutex_destroy(&recorder->mutex);
+	free(recorder->chunk);
+	free(recorder);
+}
+
+uint8_t recorder_submit(Recorder *recorder, void *framebuffer)
+{
+	PendingFrame frame = { framebuffer, *gcs_getFrameBufferInfo(framebuffer) };
+	void *outdated = NULL;
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->stats.submitted++;
+	uint8_t full = recorder->pendingCount + recorder->writing >= recorder->params.maxPending;
+	if (!recorder->running || recorder->failed || (full && (recorder->params.dropPolicy == RECORDER_DROP_NEWEST || recorder->pendingCount == 0)))
+	{ // The frame being written can not be discarded, so drop the new one instead
+		recorder->stats.dropped++;
+		pthread_mutex_unlock(&recorder->mutex);
+		return 0;
+	}
+	if (full)
+	{ // Discard oldest frame not yet being written
+		outdated = recorder->pending[recorder->pendingStart].framebuffer;
+		recorder->pendingStart = (recorder->pendingStart+1) % RECORDER_MAX_PENDING;
+		recorder->pendingCount--;
+		recorder->stats.dropped++;
+	}
+	// Keep frame past the users lease until it is written
+	gcs_retainFrameBuffer(recorder->gcs, framebuffer);
+	recorder->pending[(recorder->pendingStart + recorder->pendingCount) % RECORDER_MAX_PENDING] = frame;
+	recorder->pendingCount++;
+	pthread_cond_signal(&recorder->pendingCond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (outdated)
+		gcs_releaseRetainedFrameBuffer(recorder->gcs, outdated);
+	return 1;
+}
+
+void recorder_getStats(Recorder *recorder, RecorderStats *stats)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	*stats = recorder->stats;
+	pthread_mutex_unlock(&recorder->mutex);
+}
+
+/** Writes pending frames until the recorder is stopped and all are written */
+static void *recorder_writerThread(void *context)
+{
+	Recorder *recorder = (Recorder*)context;
+	pthread_mutex_lock(&recorder->mutex);
+	while (1)
+	{
+		while (recorder->running && recorder->pendingCount == 0)
+			pthread_cond_wait(&recorder->pendingCond, &recorder->mutex);
+		if (recorder->pendingCount == 0)
+			break;
+		PendingFrame frame = recorder->pending[recorder->pendingStart];
+		recorder->pendingStart = (recorder->pendingStart+1) % RECORDER_MAX_PENDING;
+		recorder->pendingCount--;
+		recorder->writing = 1;
+		uint8_t failed = recorder->failed;
+		pthread_mutex_unlock(&recorder->mutex);
+
+		uint8_t written = !failed && recorder_writeFrame(recorder, &frame);
+		gcs_releaseRetainedFrameBuffer(recorder->gcs, frame.framebuffer);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->writing = 0;
+		if (written)
+		{
+			recorder->stats.written++;
+			recorder->stats.bytes += recorder->frameSize;
+		}
+		else
+		{
+			recorder->stats.dropped++;
+			recorder->failed = 1;
+		}
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+	return NULL;
+}
+
+/** Appends the frame data to the staging buffer, writing it out whenever it is full, and logs the frame in the sidecar */
+static uint8_t recorder_writeFrame(Recorder *recorder, const PendingFrame *frame)
+{
+	const uint8_t *data = (const uint8_t*)gcs_getFrameBufferData(frame->framebuffer);
+	uint32_t remaining = recorder->frameSize;
+	while (remaining > 0)
+	{
+		uint32_t size = recorder->params.chunkSize - recorder->chunkFill;
+		if (size > remaining) size = remaining;
+		memcpy(recorder->chunk + recorder->chunkFill, data, size);
+		recorder->chunkFill += size;
+		data += size;
+		remaining -= size;
+		if (recorder->chunkFill == recorder->params.chunkSize)
+		{
+			if (!recorder_writeAll(recorder, recorder->chunk, recorder->chunkFill))
+				return 0;
+			recorder->chunkFill = 0;
+		}
+	}
+	fprintf(recorder->meta, "%u %lld %llu %llu\n", frame->info.sequence, (long long)frame->info.pts,
+		(unsigned long long)frame->info.captureUS, (unsigned long long)frame->info.arrivalUS);
+	return 1;
+}
+
+/** Writes data to the recording file, retrying partial writes */
+static uint8_t recorder_writeAll(Recorder *recorder, const uint8_t *data, uint32_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = write(recorder->fd, data, size);
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("Failed to write recording");
+			return 0;
+		}
+		data += written;
+		size -= written;
+		recorder->fileSize += written;
+	}
+	return 1;
+}
+
+/** Writes the remaining staged data. With O_DIRECT the last block is padded and the padding truncated afterwards */
+static uint8_t recorder_finish(Recorder *recorder)
+{
+	if (recorder->failed || recorder->chunkFill == 0)
+		return !recorder->failed;
+	if (!recorder->params.directIO)
+		return recorder_writeAll(recorder, recorder->chunk, recorder->chunkFill);
+
+	uint64_t fileSize = recorder->fileSize + recorder->chunkFill;
+	uint32_t paddedSize = (recorder->chunkFill + RECORDER_ALIGNMENT-1) / RECORDER_ALIGNMENT * RECORDER_ALIGNMENT;
+	memset(recorder->chunk + recorder->chunkFill, 0, paddedSize - recorder->chunkFill);
+	if (!recorder_writeAll(recorder, recorder->chunk, paddedSize))
+		return 0;
+	if (ftruncate(recorder->fd, fileSize) != 0)
+	{
+		perror("Failed to truncate recording");
+		return 0;
+	}
+	return 1;
+}
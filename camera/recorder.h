@@ -0,0 +1,69 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <inttypes.h>
+
+#include "gcs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Frame Recorder
+	Writes GCS frames to a raw file (frames back to back, readable by the replay source) on a separate writer thread
+	Submitting only retains the leased frame buffer and queues it, the copy and disk I/O happen on the writer thread
+	A text sidecar (filePath.meta) holds the format and the sequence number and timestamps of each recorded frame
+	If the disk falls behind, at most maxPending frames are retained and further ones are dropped by policy, never stalling the camera
+*/
+
+/* Which frame to drop when maxPending frames wait to be written */
+typedef enum RecorderDropPolicy
+{
+	RECORDER_DROP_NEWEST = 0, // Skip the submitted frame, the recording keeps contiguous stretches
+	RECORDER_DROP_OLDEST = 1, // Discard the oldest pending frame, the recording keeps the most recent frames
+} RecorderDropPolicy;
+
+/* Recorder parameters, zero for defaults */
+typedef struct RecorderParams
+{
+	uint8_t maxPending; // Frames retained while waiting to be written (default 2). Each is a camera buffer, see GCS bufferCount
+	RecorderDropPolicy dropPolicy;
+	uint32_t chunkSize; // Size of writes to disk, rounded up to 4KB (default 4MB)
+	uint8_t directIO; // Open with O_DIRECT to bypass the page cache, falls back to buffered I/O if unsupported
+} RecorderParams;
+
+/* Frame counters since creation */
+typedef struct RecorderStats
+{
+	uint32_t submitted; // Frames submitted by the user
+	uint32_t written; // Frames written to disk
+	uint32_t dropped; // Frames dropped because the writer fell behind or failed
+	uint64_t bytes; // Bytes of frame data written
+} RecorderStats;
+
+/* Opaque recorder structure */
+typedef struct Recorder Recorder;
+
+/* Creates the recording at filePath for frames of the GCS and starts the writer thread. Opaque frames can not be recorded.
+ * Params may be NULL for defaults. Returns NULL on failure. */
+Recorder *recorder_create(GCS *gcs, const char *filePath, const RecorderParams *params);
+
+/* Writes all pending frames, stops the writer thread and completes the recording, further frames are dropped.
+ * Must be called before the GCS is destroyed, done by recorder_destroy if needed */
+void recorder_stop(Recorder *recorder);
+
+/* Stops the recorder and closes the files */
+void recorder_destroy(Recorder *recorder);
+
+/* Queues a frame leased from the GCS to be written. The lease may be released right after, the recorder keeps its own reference.
+ * Does not block on disk I/O. Returns 0 if the frame was dropped. */
+uint8_t recorder_submit(Recorder *recorder, void *framebuffer);
+
+/* Returns the frame counters since creation */
+void recorder_getStats(Recorder *recorder, RecorderStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
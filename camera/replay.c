@@ -0,0 +1,129 @@
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct ReplayFile
+{
+	int fd;
+	const uint8_t *data;
+	size_t size;
+	uint32_t frameSize;
+	uint32_t frameCount;
+
+	// Pacing
+	uint64_t intervalUS; // Frame time at the replay fps
+	uint8_t realtime, loop;
+	uint32_t nextIndex; // Next frame returned by replay_nextFrame
+	uint64_t nextUS; // Monotonic time of the next frame with realtime pacing
+};
+
+/** Current time of the monotonic clock in microseconds */
+static uint64_t replay_getMonotonicUS()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+ReplayFile *replay_open(const char *filePath, uint32_t frameSize)
+{
+	ReplayFile *replay = calloc(1, sizeof(ReplayFile));
+	if (!replay) return NULL;
+	replay->frameSize = frameSize;
+	replay_setPacing(replay, 0, 1, 0);
+
+	replay->fd = open(filePath, O_RDONLY | O_CLOEXEC);
+	if (replay->fd < 0)
+	{
+		perror("Failed to open replay file");
+		goto error_open;
+	}
+
+	struct stat fileStat;
+	if (fstat(replay->fd, &fileStat) != 0)
+		goto error_map;
+	replay->frameCount = frameSize > 0? fileStat.st_size / frameSize : 0;
+	if (replay->frameCount == 0)
+	{
+		fprintf(stderr, "Replay file %s holds no complete frame of %u bytes!\n", filePath, frameSize);
+		goto error_map;
+	}
+	replay->size = (size_t)replay->frameCount * frameSize;
+
+	void *map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, replay->fd, 0);
+	if (map == MAP_FAILED)
+	{
+		perror("Failed to map replay file");
+		goto error_map;
+	}
+	// Frames are mostly read in order, so let the kernel read ahead
+	madvise(map, replay->size, MADV_SEQUENTIAL);
+	replay->data = map;
+	return replay;
+
+error_map:
+	close(replay->fd);
+error_open:
+	free(replay);
+	return NULL;
+}
+
+void replay_close(ReplayFile *replay)
+{
+	if (!replay) return;
+	munmap((void*)replay->data, replay->size);
+	close(replay->fd);
+	free(replay);
+}
+
+uint32_t replay_getFrameCount(ReplayFile *replay)
+{
+	return replay->frameCount;
+}
+
+const uint8_t *replay_getFrame(ReplayFile *replay, uint32_t index)
+{
+	if (index >= replay->frameCount) return NULL;
+	return replay->data + (size_t)index * replay->frameSize;
+}
+
+void replay_setPacing(ReplayFile *replay, uint16_t fps, uint8_t realtime, uint8_t loop)
+{
+	replay->intervalUS = 1000000 / (fps > 0? fps : 30);
+	replay->realtime = realtime;
+	replay->loop = loop;
+	replay_rewind(replay);
+}
+
+void replay_rewind(ReplayFile *replay)
+{
+	replay->nextIndex = 0;
+	replay->nextUS = replay_getMonotonicUS();
+}
+
+const uint8_t *replay_nextFrame(ReplayFile *replay, uint32_t *index, uint64_t *ptsUS)
+{
+	if (replay->nextIndex >= replay->frameCount)
+	{
+		if (!replay->loop)
+			return NULL;
+		replay->nextIndex = 0;
+	}
+	if (replay->realtime)
+	{ // Frame times stay on the fps grid, a late request returns right away to catch up
+		uint64_t now = replay_getMonotonicUS();
+		if (replay->nextUS > now)
+			usleep(replay->nextUS - now);
+		replay->nextUS += replay->intervalUS;
+	}
+	uint32_t frameIndex = replay->nextIndex++;
+	if (index) *index = frameIndex;
+	if (ptsUS) *ptsUS = (uint64_t)frameIndex * replay->intervalUS;
+	return replay_getFrame(replay, frameIndex);
+}
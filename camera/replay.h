@@ -0,0 +1,45 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Replay File
+	Read-only memory mapping of a raw recording of equally sized frames (I420, Y or RGB) back to back
+	Frames are served straight from the page cache, no copies are made
+	Pacing: Frames are read in order either at a fixed fps like a camera or as fast as they are requested
+	Only depends on POSIX, so recordings can be processed on machines without camera or MMAL (see DESKTOP_GL)
+*/
+
+/* Opaque replay file structure */
+typedef struct ReplayFile ReplayFile;
+
+/* Maps the recording at filePath, frameSize is the size of one frame in bytes. Returns NULL if it holds no complete frame */
+ReplayFile *replay_open(const char *filePath, uint32_t frameSize);
+void replay_close(ReplayFile *replay);
+
+/* Returns the number of complete frames in the recording */
+uint32_t replay_getFrameCount(ReplayFile *replay);
+
+/* Returns the data of the frame at index, valid until the replay file is closed */
+const uint8_t *replay_getFrame(ReplayFile *replay, uint32_t index);
+
+/* Sets the pacing of replay_nextFrame: realtime at fps (0 for 30), else as fast as frames are requested.
+ * With loop the recording restarts at the end instead of ending. Defaults to realtime at 30 fps without loop */
+void replay_setPacing(ReplayFile *replay, uint16_t fps, uint8_t realtime, uint8_t loop);
+
+/* Restarts the recording at its first frame, realtime pacing starts from now */
+void replay_rewind(ReplayFile *replay);
+
+/* Returns the next frame of the recording, with realtime pacing sleeps until its frame time first.
+ * Sets index and ptsUS (frame time since the first frame) if not NULL. Returns NULL at the end of a recording without loop */
+const uint8_t *replay_nextFrame(ReplayFile *replay, uint32_t *index, uint64_t *ptsUS);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
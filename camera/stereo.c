@@ -0,0 +1,112 @@
+#include "stereo.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+struct StereoCapture
+{
+	GCS *gcs[2];
+	uint32_t toleranceUS;
+	StereoStats stats;
+};
+
+static uint64_t stereo_getMonotonicUS();
+static uint64_t stereo_getCaptureUS(void *framebuffer);
+
+StereoCapture *stereo_create(GCS *left, GCS *right, uint32_t toleranceUS)
+{
+	StereoCapture *stereo = calloc(1, sizeof(StereoCapture));
+	if (!stereo) return NULL;
+	stereo->gcs[0] = left;
+	stereo->gcs[1] = right;
+	stereo->toleranceUS = toleranceUS;
+	return stereo;
+}
+
+void stereo_destroy(StereoCapture *stereo)
+{
+	free(stereo);
+}
+
+uint8_t stereo_requestPair(StereoCapture *stereo, StereoPair *pair, uint32_t timeoutMS)
+{
+	uint64_t deadlineUS = stereo_getMonotonicUS() + (uint64_t)timeoutMS * 1000;
+	void *frames[2] = { NULL, NULL };
+	while (1)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			if (frames[i]) continue;
+			uint32_t waitMS = GCS_WAIT_FOREVER;
+			if (timeoutMS != GCS_WAIT_FOREVER)
+			{
+				uint64_t nowUS = stereo_getMonotonicUS();
+				waitMS = nowUS < deadlineUS? (deadlineUS - nowUS + 999) / 1000 : 0;
+			}
+			frames[i] = gcs_requestFrameBufferTimeout(stereo->gcs[i], waitMS);
+			if (!frames[i])
+				goto error_timeout;
+		}
+
+		int64_t skewUS = (int64_t)(stereo_getCaptureUS(frames[1]) - stereo_getCaptureUS(frames[0]));
+		uint32_t absSkewUS = skewUS < 0? -skewUS : skewUS;
+		if (absSkewUS <= stereo->toleranceUS)
+		{
+			pair->frames[0] = frames[0];
+			pair->frames[1] = frames[1];
+			pair->skewUS = skewUS;
+			stereo->stats.pairs++;
+			stereo->stats.sumSkewUS += absSkewUS;
+			if (absSkewUS > stereo->stats.maxSkewUS)
+				stereo->stats.maxSkewUS = absSkewUS;
+			return 1;
+		}
+
+		// Skip the older frame, later frames of the other camera can only be further apart
+		int older = skewUS > 0? 0 : 1;
+		gcs_releaseFrameBuffer(stereo->gcs[older], frames[older]);
+		frames[older] = NULL;
+		stereo->stats.skipped[older]++;
+	}
+
+error_timeout:
+	for (int i = 0; i < 2; i++)
+	{
+		if (frames[i])
+		{
+			gcs_releaseFrameBuffer(stereo->gcs[i], frames[i]);
+			stereo->stats.skipped[i]++;
+		}
+	}
+	stereo->stats.timeouts++;
+	return 0;
+}
+
+void stereo_releasePair(StereoCapture *stereo, StereoPair *pair)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (pair->frames[i])
+			gcs_releaseFrameBuffer(stereo->gcs[i], pair->frames[i]);
+		pair->frames[i] = NULL;
+	}
+}
+
+void stereo_getStats(StereoCapture *stereo, StereoStats *stats)
+{
+	*stats = stereo->stats;
+}
+
+/** Returns the sensor capture time of the frame, or its arrival time if the sensor timestamp is unavailable */
+static uint64_t stereo_getCaptureUS(void *framebuffer)
+{
+	const GCS_FrameInfo *info = gcs_getFrameBufferInfo(framebuffer);
+	return info->captureUS != 0? info->captureUS : info->arrivalUS;
+}
+
+static uint64_t stereo_getMonotonicUS()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
@@ -0,0 +1,58 @@
+#ifndef STEREO_H
+#define STEREO_H
+
+#include <inttypes.h>
+
+#include "gcs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stereo Capture
+	Pairs the frames of two GCS instances by capture time, for stereo processing on frames taken at the same time
+	Frames of both cameras are requested until their capture times lie within the tolerance,
+	the older frame of a mismatch is skipped since newer frames of the other camera can only be further apart
+	Capture time is the sensor timestamp, or the arrival time if the camera does not provide it
+*/
+
+/* A matched pair of frames, both leased from their GCS */
+typedef struct StereoPair
+{
+	void *frames[2]; // Frame buffers of left (0) and right (1) camera
+	int64_t skewUS; // Capture time of right minus left frame
+} StereoPair;
+
+/* Pairing counters since creation */
+typedef struct StereoStats
+{
+	uint32_t pairs; // Matched pairs handed out
+	uint32_t skipped[2]; // Frames of left and right camera skipped without a match
+	uint32_t timeouts; // Requests that did not find a pair in time
+	uint32_t maxSkewUS; // Largest absolute skew of a pair
+	uint64_t sumSkewUS; // Sum of absolute skew of all pairs, for the mean
+} StereoStats;
+
+/* Opaque stereo capture structure */
+typedef struct StereoCapture StereoCapture;
+
+/* Pairs frames of the two started or to be started GCS instances within toleranceUS */
+StereoCapture *stereo_create(GCS *left, GCS *right, uint32_t toleranceUS);
+void stereo_destroy(StereoCapture *stereo);
+
+/* Leases the next matched pair of frames, waiting at most timeoutMS (or GCS_WAIT_FOREVER) in total.
+ * Unmatched frames are released right away. Returns 0 if no pair was found in time or a stream stopped,
+ * nothing is leased then, so a stalled camera does not hold up the caller indefinitely. */
+uint8_t stereo_requestPair(StereoCapture *stereo, StereoPair *pair, uint32_t timeoutMS);
+
+/* Releases both frames of the pair */
+void stereo_releasePair(StereoCapture *stereo, StereoPair *pair);
+
+/* Returns the pairing counters since creation */
+void stereo_getStats(StereoCapture *stereo, StereoStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
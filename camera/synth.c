@@ -0,0 +1,300 @@
+#include "synth.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Size of the noise table, rows read it at random offsets so the pattern does not visibly repeat */
+#define SYNTH_NOISE_SIZE 65536
+
+/* Blobs are rendered out to this many sigmas */
+#define SYNTH_BLOB_EXTENT 3.0f
+
+/* 16 pixels processed at once, mapped to NEON or SSE registers by the compiler */
+typedef uint8_t SynthVec __attribute__((vector_size(16)));
+
+typedef struct BlobState
+{
+	float x, y;
+	float vx, vy;
+	float sigma;
+	float phase;
+} BlobState;
+
+struct SynthScene
+{
+	SynthParams params;
+	uint32_t frameIndex; // Index of the next frame
+	uint32_t random; // Xorshift state
+
+	uint8_t *background; // Gradient background of the Y plane, already lowered by half the noise amplitude
+	uint8_t *noise; // Uniform noise, SYNTH_NOISE_SIZE plus one row so any offset can be read a full row
+	float *weights; // Horizontal and vertical Gaussian weights of the blob being rendered
+
+	BlobState *states;
+	SynthBlob *blobs; // Ground truth of the last rendered frame
+	uint8_t *matched; // Scratch flags for scoring
+};
+
+static uint32_t synth_random(SynthScene *scene);
+static float synth_uniform(SynthScene *scene, float min, float max);
+static void synth_renderBackground(SynthScene *scene, uint8_t *frame);
+static void synth_renderBlob(SynthScene *scene, uint8_t *frame, const SynthBlob *blob);
+static void synth_moveBlob(SynthScene *scene, BlobState *state);
+
+SynthScene *synth_create(const SynthParams *params)
+{
+	SynthScene *scene = calloc(1, sizeof(SynthScene));
+	if (!scene) return NULL;
+	if (params) scene->params = *params;
+	SynthParams *p = &scene->params;
+	if (p->width == 0 || p->height == 0)
+	{
+		p->width = 640;
+		p->height = 480;
+	}
+	if (p->blobSigmaMin <= 0) p->blobSigmaMin = 1.5f;
+	if (p->blobSigmaMax < p->blobSigmaMin) p->blobSigmaMax = p->blobSigmaMin < 4.0f? 4.0f : p->blobSigmaMin;
+	if (p->blobSpeed <= 0) p->blobSpeed = 2.0f;
+	if (p->blobIntensity == 0) p->blobIntensity = 200;
+	if (p->flickerDepth > 1) p->flickerDepth = 1;
+	if (p->flickerPeriod <= 0) p->flickerPeriod = 8.0f;
+	if (p->background == 0) p->background = 20;
+	scene->random = p->seed == 0? 0x9E3779B9 : p->seed;
+
+	uint32_t pixels = (uint32_t)p->width * p->height;
+	uint32_t extent = (uint32_t)ceilf(SYNTH_BLOB_EXTENT * p->blobSigmaMax) * 2 + 2;
+	scene->background = malloc(pixels);
+	scene->noise = malloc(SYNTH_NOISE_SIZE + p->width);
+	scene->weights = malloc(2 * extent * sizeof(float));
+	scene->states = calloc(p->blobCount + 1, sizeof(BlobState));
+	scene->blobs = calloc(p->blobCount + 1, sizeof(SynthBlob));
+	scene->matched = calloc(p->blobCount + 1, 1);
+	if (!scene->background || !scene->noise || !scene->weights || !scene->states || !scene->blobs || !scene->matched)
+	{
+		fprintf(stderr, "Failed to allocate synthetic scene of %dx%d!\n", p->width, p->height);
+		synth_destroy(scene);
+		return NULL;
+	}
+
+	// Background rises diagonally by the gradient, lowered so the added noise keeps the mean
+	for (uint32_t y = 0; y < p->height; y++)
+	{
+		for (uint32_t x = 0; x < p->width; x++)
+		{
+			int value = p->background - p->noise/2 + (int)(p->gradient * ((float)x / p->width + (float)y / p->height) / 2);
+			scene->background[y*p->width + x] = value < 0? 0 : (value > 255? 255 : value);
+		}
+	}
+	for (uint32_t i = 0; i < SYNTH_NOISE_SIZE + p->width; i++)
+		scene->noise[i] = p->noise == 0? 0 : synth_random(scene) % (p->noise + 1);
+
+	// Place blobs with random size, position, velocity and flicker phase
+	for (uint32_t i = 0; i < p->blobCount; i++)
+	{
+		BlobState *state = &scene->states[i];
+		state->sigma = synth_uniform(scene, p->blobSigmaMin, p->blobSigmaMax);
+		state->x = synth_uniform(scene, state->sigma, p->width - state->sigma);
+		state->y = synth_uniform(scene, state->sigma, p->height - state->sigma);
+		float angle = synth_uniform(scene, 0, 2*M_PI);
+		float speed = synth_uniform(scene, 0, p->blobSpeed);
+		state->vx = cosf(angle) * speed;
+		state->vy = sinf(angle) * speed;
+		state->phase = synth_uniform(scene, 0, 2*M_PI);
+	}
+	return scene;
+}
+
+void synth_destroy(SynthScene *scene)
+{
+	if (!scene) return;
+	free(scene->background);
+	free(scene->noise);
+	free(scene->weights);
+	free(scene->states);
+	free(scene->blobs);
+	free(scene->matched);
+	free(scene);
+}
+
+const SynthParams *synth_getParams(SynthScene *scene)
+{
+	return &scene->params;
+}
+
+uint32_t synth_getFrameSize(SynthScene *scene)
+{
+	uint32_t pixels = (uint32_t)scene->params.width * scene->params.height;
+	return scene->params.lumaOnly? pixels : pixels * 3 / 2;
+}
+
+uint32_t synth_render(SynthScene *scene, uint8_t *frame)
+{
+	const SynthParams *p = &scene->params;
+	synth_renderBackground(scene, frame);
+	if (!p->lumaOnly)
+		memset(frame + (uint32_t)p->width * p->height, 128, (uint32_t)p->width * p->height / 2);
+
+	// Record ground truth of the blobs as rendered, then move them on
+	float flickerPhase = 2*M_PI * scene->frameIndex / p->flickerPeriod;
+	for (uint32_t i = 0; i < p->blobCount; i++)
+	{
+		BlobState *state = &scene->states[i];
+		SynthBlob *blob = &scene->blobs[i];
+		float flicker = p->flickerDepth * 0.5f * (1 + sinf(flickerPhase + state->phase));
+		blob->x = state->x;
+		blob->y = state->y;
+		blob->sigma = state->sigma;
+		blob->intensity = (uint8_t)(p->blobIntensity * (1 - flicker) + 0.5f);
+		synth_renderBlob(scene, frame, blob);
+		synth_moveBlob(scene, state);
+	}
+	return scene->frameIndex++;
+}
+
+const SynthBlob *synth_getBlobs(SynthScene *scene, uint16_t *count)
+{
+	*count = scene->frameIndex > 0? scene->params.blobCount : 0;
+	return scene->blobs;
+}
+
+void synth_score(SynthScene *scene, const float *x, const float *y, uint32_t count, float maxDistance, uint8_t minIntensity, SynthScore *score)
+{
+	uint16_t blobCount;
+	const SynthBlob *blobs = synth_getBlobs(scene, &blobCount);
+	memset(scene->matched, 0, blobCount);
+	float maxDistSq = maxDistance * maxDistance;
+	for (uint32_t d = 0; d < count; d++)
+	{ // Match to the nearest blob not matched yet
+		int nearest = -1;
+		float nearestDistSq = maxDistSq;
+		for (uint32_t b = 0; b < blobCount; b++)
+		{
+			if (scene->matched[b]) continue;
+			float dx = x[d] - blobs[b].x, dy = y[d] - blobs[b].y;
+			float distSq = dx*dx + dy*dy;
+			if (distSq <= nearestDistSq)
+			{
+				nearest = b;
+				nearestDistSq = distSq;
+			}
+		}
+		if (nearest < 0)
+			score->falsePositives++;
+		else
+		{ // Detections of dim blobs are not counted either way
+			scene->matched[nearest] = 1;
+			if (blobs[nearest].intensity >= minIntensity)
+				score->truePositives++;
+		}
+	}
+	for (uint32_t b = 0; b < blobCount; b++)
+	{
+		if (!scene->matched[b] && blobs[b].intensity >= minIntensity)
+			score->falseNegatives++;
+	}
+}
+
+/** Writes background plus noise into the Y plane with saturating adds of 16 pixels at a time */
+static void synth_renderBackground(SynthScene *scene, uint8_t *frame)
+{
+	const SynthParams *p = &scene->params;
+	if (p->noise == 0)
+	{
+		memcpy(frame, scene->background, (uint32_t)p->width * p->height);
+		return;
+	}
+	for (uint32_t y = 0; y < p->height; y++)
+	{
+		uint8_t *row = frame + y*p->width;
+		const uint8_t *background = scene->background + y*p->width;
+		const uint8_t *noise = scene->noise + synth_random(scene) % SYNTH_NOISE_SIZE;
+		uint32_t x = 0;
+		for (; x + 16 <= p->width; x += 16)
+		{ // Unaligned loads and stores through memcpy, overflowed lanes compare lower and are set to 255
+			SynthVec a, b;
+			memcpy(&a, background + x, 16);
+			memcpy(&b, noise + x, 16);
+			SynthVec sum = a + b;
+			sum |= (SynthVec)(sum < a);
+			memcpy(row + x, &sum, 16);
+		}
+		for (; x < p->width; x++)
+		{
+			int value = background[x] + noise[x];
+			row[x] = value > 255? 255 : value;
+		}
+	}
+}
+
+/** Adds a Gaussian blob to the Y plane, only touching its bounding box. Separable, so one weight per row and column */
+static void synth_renderBlob(SynthScene *scene, uint8_t *frame, const SynthBlob *blob)
+{
+	const SynthParams *p = &scene->params;
+	float radius = SYNTH_BLOB_EXTENT * blob->sigma;
+	int x0 = (int)floorf(blob->x - radius), x1 = (int)floorf(blob->x + radius);
+	int y0 = (int)floorf(blob->y - radius), y1 = (int)floorf(blob->y + radius);
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 >= p->width) x1 = p->width-1;
+	if (y1 >= p->height) y1 = p->height-1;
+	if (x0 > x1 || y0 > y1 || blob->intensity == 0) return;
+
+	// Weights at pixel centers, the intensity folded into the vertical ones
+	float *weightsX = scene->weights, *weightsY = scene->weights + (x1-x0+1);
+	float falloff = -1.0f / (2 * blob->sigma * blob->sigma);
+	for (int x = x0; x <= x1; x++)
+	{
+		float d = x + 0.5f - blob->x;
+		weightsX[x-x0] = expf(d*d * falloff);
+	}
+	for (int y = y0; y <= y1; y++)
+	{
+		float d = y + 0.5f - blob->y;
+		weightsY[y-y0] = expf(d*d * falloff) * blob->intensity;
+	}
+
+	for (int y = y0; y <= y1; y++)
+	{
+		uint8_t *row = frame + y*p->width;
+		for (int x = x0; x <= x1; x++)
+		{
+			int value = row[x] + (int)(weightsY[y-y0] * weightsX[x-x0] + 0.5f);
+			row[x] = value > 255? 255 : value;
+		}
+	}
+}
+
+/** Moves the blob by its velocity, reflecting it off the frame edges */
+static void synth_moveBlob(SynthScene *scene, BlobState *state)
+{
+	const SynthParams *p = &scene->params;
+	state->x += state->vx;
+	state->y += state->vy;
+	if (state->x < state->sigma || state->x > p->width - state->sigma)
+	{
+		state->vx = -state->vx;
+		state->x = state->x < state->sigma? 2*state->sigma - state->x : 2*(p->width - state->sigma) - state->x;
+	}
+	if (state->y < state->sigma || state->y > p->height - state->sigma)
+	{
+		state->vy = -state->vy;
+		state->y = state->y < state->sigma? 2*state->sigma - state->y : 2*(p->height - state->sigma) - state->y;
+	}
+}
+
+/** Xorshift32, fast and good enough for noise and placement */
+static uint32_t synth_random(SynthScene *scene)
+{
+	uint32_t x = scene->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return scene->random = x;
+}
+
+static float synth_uniform(SynthScene *scene, float min, float max)
+{
+	return min + (max - min) * (synth_random(scene) >> 8) * (1.0f / 16777216);
+}
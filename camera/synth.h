@@ -0,0 +1,78 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Synthetic Scene
+	Renders camera-like frames of moving Gaussian LED blobs over a gradient background with noise and flicker,
+	together with the true blob positions, to benchmark speed and recall/precision of any detector without a camera
+	Background and noise are added 16 pixels at a time from precomputed tables, blobs only touch their bounding box,
+	so frames render far faster than real time. Rendering is deterministic for a given seed
+*/
+
+/* Scene parameters, zero for defaults */
+typedef struct SynthParams
+{
+	uint16_t width, height;
+	uint8_t lumaOnly; // Render only the Y plane, else I420 with neutral chroma
+	uint16_t blobCount; // Blobs in the scene, 0 for none
+	float blobSigmaMin, blobSigmaMax; // Range of the Gaussian blob radius in pixels (default 1.5-4)
+	float blobSpeed; // Maximum blob speed in pixels per frame (default 2), blobs bounce off the frame edges
+	uint8_t blobIntensity; // Peak brightness added by a blob (default 200)
+	float flickerDepth; // Fraction (0-1) of blob intensity modulated by flicker, e.g. PWM driven LEDs
+	float flickerPeriod; // Frames per flicker cycle (default 8), each blob with a random phase
+	uint8_t background; // Mean background brightness (default 20)
+	uint8_t gradient; // Brightness increase of the background from top left to bottom right
+	uint8_t noise; // Peak-to-peak amplitude of uniform pixel noise
+	uint32_t seed; // Random seed of blob placement, motion and noise, 0 for default
+} SynthParams;
+
+/* True state of a blob in the last rendered frame */
+typedef struct SynthBlob
+{
+	float x, y; // Center in pixel coordinates, pixel (0,0) covers 0-1
+	float sigma; // Gaussian radius in pixels
+	uint8_t intensity; // Peak brightness added in this frame, after flicker
+} SynthBlob;
+
+/* Detection results against the ground truth of a frame */
+typedef struct SynthScore
+{
+	uint32_t truePositives; // Detections matched to a blob
+	uint32_t falsePositives; // Detections without a blob nearby
+	uint32_t falseNegatives; // Blobs without a detection nearby
+} SynthScore;
+
+/* Opaque synthetic scene structure */
+typedef struct SynthScene SynthScene;
+
+/* Creates the scene and places the blobs. Returns NULL on failure */
+SynthScene *synth_create(const SynthParams *params);
+void synth_destroy(SynthScene *scene);
+
+/* Returns the parameters in effect, with defaults resolved */
+const SynthParams *synth_getParams(SynthScene *scene);
+
+/* Returns the size in bytes of one frame, I420 or only the Y plane */
+uint32_t synth_getFrameSize(SynthScene *scene);
+
+/* Renders the next frame into the buffer of synth_getFrameSize bytes and moves the blobs on. Returns the frame index */
+uint32_t synth_render(SynthScene *scene, uint8_t *frame);
+
+/* Returns the blobs of the last rendered frame, valid until the next frame is rendered */
+const SynthBlob *synth_getBlobs(SynthScene *scene, uint16_t *count);
+
+/* Matches detected positions to the blobs of the last rendered frame, each to the nearest one within maxDistance pixels.
+ * Blobs dimmer than minIntensity (e.g. flickered off) are not expected, but detections of them are no false positives.
+ * Counts are added to the score, so it can accumulate over a whole benchmark */
+void synth_score(SynthScene *scene, const float *x, const float *y, uint32_t count, float maxDistance, uint8_t minIntensity, SynthScore *score);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,5 +1,8 @@
 #include "eglUtil.h"
 
+#include <string.h>
+#include <EGL/eglext.h>
+
 int setupEGL(EGL_Setup *setup, EGLNativeWindowType window)
 {
 	EGLBoolean estatus;
@@ -72,14 +75,121 @@ error_display:
 	return -1;
 }
 
+/* Get a display not tied to a screen where the platform supports it (Mesa), else the default display */
+static EGLDisplay getHeadlessDisplay()
+{
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless"))
+	{
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay)
+		{
+			EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY) return display;
+		}
+	}
+#endif
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+int setupEGLHeadless(EGL_Setup *setup, int width, int height)
+{
+	EGLBoolean estatus;
+	const EGLint pbufferConfigAttributes[] =
+	{
+		EGL_CONFORMANT,		EGL_OPENGL_ES2_BIT,
+		EGL_SURFACE_TYPE,	EGL_PBUFFER_BIT,
+		EGL_RED_SIZE,		8,
+		EGL_GREEN_SIZE,		8,
+		EGL_BLUE_SIZE,		8,
+		EGL_ALPHA_SIZE,		0,
+		EGL_DEPTH_SIZE,		0,
+		EGL_NONE
+	};
+	const EGLint surfacelessConfigAttributes[] =
+	{
+		EGL_CONFORMANT,		EGL_OPENGL_ES2_BIT,
+		EGL_SURFACE_TYPE,	0,
+		EGL_RED_SIZE,		8,
+		EGL_GREEN_SIZE,		8,
+		EGL_BLUE_SIZE,		8,
+		EGL_NONE
+	};
+	const EGLint pbufferAttributes[] =
+	{
+		EGL_WIDTH,			width,
+		EGL_HEIGHT,			height,
+		EGL_NONE
+	};
+	const EGLint contextAttributes[] =
+	{
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+
+	// Get display
+	setup->display = getHeadlessDisplay();
+	CHECK_EVAL(setup->display != EGL_NO_DISPLAY, "Failed to get EGL display!", error_display);
+	estatus = eglInitialize(setup->display, &setup->versionMajor, &setup->versionMinor);
+	CHECK_EVAL(estatus, "Failed to initialized EGL!", error_surface);
+
+	estatus = eglBindAPI(EGL_OPENGL_ES_API);
+	CHECK_EVAL(estatus, "Failed to bind OpenGL ES API!", error_surface);
+
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	setup->surface = EGL_NO_SURFACE;
+	if (width > 0 && height > 0)
+	{ // Prefer a pbuffer, so the default framebuffer can still be rendered to
+		estatus = eglChooseConfig(setup->display, pbufferConfigAttributes, &config, 1, &numConfigs);
+		if (estatus && numConfigs > 0)
+			setup->surface = eglCreatePbufferSurface(setup->display, config, pbufferAttributes);
+	}
+	if (setup->surface == EGL_NO_SURFACE)
+	{ // Fall back to a context without any surface
+		const char *extensions = eglQueryString(setup->display, EGL_EXTENSIONS);
+		CHECK_EVAL(extensions && strstr(extensions, "EGL_KHR_surfaceless_context"), "Failed to create pbuffer and surfaceless contexts are not supported!", error_surface);
+		estatus = eglChooseConfig(setup->display, surfacelessConfigAttributes, &config, 1, &numConfigs);
+		CHECK_EVAL(estatus && numConfigs > 0, "Failed to choose config!", error_surface);
+	}
+
+	// Create context
+	setup->context = eglCreateContext(setup->display, config, EGL_NO_CONTEXT, contextAttributes);
+	CHECK_EVAL(setup->context != EGL_NO_CONTEXT, "Failed to create context!", error_context);
+	estatus = eglMakeCurrent(setup->display, setup->surface, setup->surface, setup->context);
+	CHECK_EVAL(estatus, "Failed to make context current!", error_current);
+
+	GLenum glerror = glGetError();
+	if (glerror != GL_NO_ERROR)
+	{
+		vcos_log_error("GL error during init: error 0x%04x", glerror);
+		goto error_current;
+	}
+
+	return 0;
+
+error_current:
+	eglDestroyContext(setup->display, setup->context);
+error_context:
+	if (setup->surface != EGL_NO_SURFACE)
+		eglDestroySurface(setup->display, setup->surface);
+error_surface:
+	eglTerminate(setup->display);
+error_display:
+	return -1;
+}
+
 void terminateEGL(EGL_Setup *setup)
 {
 	eglMakeCurrent(setup->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	eglDestroyContext(setup->display, setup->context);
-	eglDestroySurface(setup->display, setup->surface);
+	if (setup->surface != EGL_NO_SURFACE)
+		eglDestroySurface(setup->display, setup->surface);
 	eglTerminate(setup->display);
 }
 
+#ifndef DESKTOP_GL
 /* Create native window (basically just a rectangle on the screen we can render to */
 int createNativeWindow(EGL_DISPMANX_WINDOW_T *window)
 {
@@ -113,3 +223,4 @@ int createNativeWindow(EGL_DISPMANX_WINDOW_T *window)
 
 	return 0;
 }
+#endif
@@ -7,9 +7,16 @@ extern "C" {
 
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
+
+#ifdef DESKTOP_GL
+// Building against desktop Mesa without the Broadcom host libraries
+#include <stdio.h>
+#define vcos_log_error(...) (fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"))
+#else
 #include "bcm_host.h"
 
 #include "applog.h"
+#endif
 
 #define CHECK_EVAL(EVAL, MSG, ERRHANDLER) \
 	if (!(EVAL)) { \
@@ -28,10 +35,17 @@ typedef struct EGL_Setup
 
 int setupEGL(EGL_Setup *setup, EGLNativeWindowType window);
 
+/* Setup EGL without a display, e.g. for processing only or for running on a workstation without GPU
+ * Renders into a pbuffer of the given size, or surfaceless (EGL_KHR_surfaceless_context) if size is 0 or no pbuffer is supported
+ * Off-screen render targets work as usual, swapping buffers is not needed */
+int setupEGLHeadless(EGL_Setup *setup, int width, int height);
+
 void terminateEGL(EGL_Setup *setup);
 
+#ifndef DESKTOP_GL
 /* Create native window (basically just a rectangle on the screen we can render to */
 int createNativeWindow(EGL_DISPMANX_WINDOW_T *window);
+#endif
 
 #ifdef __cplusplus
 }
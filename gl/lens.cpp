@@ -0,0 +1,439 @@
+#include "lens.hpp"
+
+#include "defines.hpp"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#define LENS_CACHE_VERSION 2
+
+enum LensCacheMode { LENS_CACHE_MESH = 0, LENS_CACHE_REMAP = 1 };
+
+/* Header of cached lens data, everything up to density is the cache key */
+typedef struct LensCacheHeader
+{
+	char magic[4];
+	int version, mode;
+	LensParams lens;
+	int width, height;
+	float tolerance;
+	int maxDensity;
+	int density;
+	float range, error;
+	unsigned int dataSize[2];
+} LensCacheHeader;
+
+/* ---- Lens model ---- */
+
+static void distortPoint (const LensParams &lens, float x, float y, float &outX, float &outY)
+{
+	float dx = x - lens.centerX, dy = y - lens.centerY;
+	float r2 = dx*dx + dy*dy;
+	float scale = 1 + r2*(lens.k1 + r2*(lens.k2 + r2*lens.k3));
+	outX = lens.centerX + dx*scale;
+	outY = lens.centerY + dy*scale;
+}
+
+/* Inverts the radial polynomial with Newton iterations, fails beyond the fold of the model */
+static bool undistortPoint (const LensParams &lens, float x, float y, float &outX, float &outY)
+{
+	float dx = x - lens.centerX, dy = y - lens.centerY;
+	float rd = sqrtf(dx*dx + dy*dy);
+	if (rd < 1e-6f)
+	{
+		outX = x;
+		outY = y;
+		return true;
+	}
+	float r = rd, f = 0;
+	for (int i = 0; i < 20; i++)
+	{
+		float r2 = r*r;
+		f = r*(1 + r2*(lens.k1 + r2*(lens.k2 + r2*lens.k3))) - rd;
+		float df = 1 + r2*(3*lens.k1 + r2*(5*lens.k2 + r2*7*lens.k3));
+		if (df <= 0) return false;
+		float step = f / df;
+		r -= step;
+		if (r < 0) return false;
+		if (fabsf(step) < 1e-7f) break;
+	}
+	if (fabsf(f) > 1e-4f) return false;
+	float scale = r / rd;
+	outX = lens.centerX + dx*scale;
+	outY = lens.centerY + dy*scale;
+	return true;
+}
+
+/* Display points whose frame position lies further outside than this are never shown, so they are excluded from the remap */
+static const float remapMargin = 0.1f;
+
+static bool mapPoint (const LensParams &lens, bool inverse, float x, float y, float &outX, float &outY)
+{
+	if (inverse)
+	{
+		if (!undistortPoint(lens, x, y, outX, outY)) return false;
+		return fabsf(outX) <= 1+remapMargin && fabsf(outY) <= 1+remapMargin;
+	}
+	distortPoint(lens, x, y, outX, outY);
+	return true;
+}
+
+/* Max deviation in pixels of the interpolated grid from the exact mapping, sampled at cell centers and edge midpoints */
+static float gridError (const LensParams &lens, bool inverse, int N, int width, int height)
+{
+	std::vector<float> grid((N+1)*(N+1)*2);
+	std::vector<bool> valid((N+1)*(N+1));
+	for (int i = 0; i <= N; i++)
+		for (int j = 0; j <= N; j++)
+		{
+			int v = i*(N+1) + j;
+			valid[v] = mapPoint(lens, inverse, -1 + 2.0f*i/N, -1 + 2.0f*j/N, grid[v*2+0], grid[v*2+1]);
+		}
+
+	float maxError = 0;
+	auto sampleError = [&](float x, float y, float ix, float iy)
+	{
+		float ex, ey;
+		if (!mapPoint(lens, inverse, x, y, ex, ey)) return;
+		float error = hypotf((ex-ix) * width/2, (ey-iy) * height/2);
+		maxError = std::max(maxError, error);
+	};
+	for (int i = 0; i < N; i++)
+		for (int j = 0; j < N; j++)
+		{
+			int v00 = i*(N+1) + j, v01 = v00 + 1, v10 = v00 + N+1, v11 = v10 + 1;
+			if (!valid[v00] || !valid[v01] || !valid[v10] || !valid[v11]) continue;
+			const float *p00 = &grid[v00*2], *p01 = &grid[v01*2], *p10 = &grid[v10*2], *p11 = &grid[v11*2];
+			float x0 = -1 + 2.0f*i/N, y0 = -1 + 2.0f*j/N, h = 2.0f/N;
+			// Edge midpoints are interpolated linearly by both triangles and bilinear filtering
+			sampleError(x0 + h/2, y0, (p00[0]+p10[0])/2, (p00[1]+p10[1])/2);
+			sampleError(x0, y0 + h/2, (p00[0]+p01[0])/2, (p00[1]+p01[1])/2);
+			sampleError(x0 + h/2, y0 + h, (p01[0]+p11[0])/2, (p01[1]+p11[1])/2);
+			sampleError(x0 + h, y0 + h/2, (p10[0]+p11[0])/2, (p10[1]+p11[1])/2);
+			// Cell center lies on the shared diagonal of the mesh triangles, but is bilinear in the texture
+			if (inverse)
+				sampleError(x0 + h/2, y0 + h/2, (p00[0]+p01[0]+p10[0]+p11[0])/4, (p00[1]+p01[1]+p10[1]+p11[1])/4);
+			else
+				sampleError(x0 + h/2, y0 + h/2, (p00[0]+p11[0])/2, (p00[1]+p11[1])/2);
+		}
+	return maxError;
+}
+
+int chooseLensDensity (const LensParams &lens, bool inverse, int width, int height, float tolerancePx, int maxDensity, float *errorPx)
+{
+	int N = std::min(4, maxDensity);
+	float error = gridError(lens, inverse, N, width, height);
+	while (error > tolerancePx && N < maxDensity)
+	{ // Interpolation error falls roughly with the square of the cell size
+		int next = (int)ceilf(N * sqrtf(error / tolerancePx));
+		N = std::min(maxDensity, std::max(N + 1, next));
+		error = gridError(lens, inverse, N, width, height);
+	}
+	if (errorPx) *errorPx = error;
+	return N;
+}
+
+bool loadLensParams (const char *filePath, std::vector<LensParams> &eyes)
+{
+	std::ifstream fs(filePath);
+	if (!fs.is_open())
+	{
+		std::cerr << "Could not open lens calibration " << filePath << "!" << std::endl;
+		return false;
+	}
+	eyes.clear();
+	std::string line;
+	while (std::getline(fs, line))
+	{
+		if (line.empty() || line[0] == '#') continue;
+		std::istringstream ls(line);
+		LensParams lens = { 0, 0, 0, 0, 0 };
+		if (!(ls >> lens.k1 >> lens.k2)) continue;
+		ls >> lens.k3 >> lens.centerX >> lens.centerY;
+		eyes.push_back(lens);
+	}
+	return !eyes.empty();
+}
+
+/* ---- Disk cache ---- */
+
+static LensCacheHeader cacheKey (int mode, const LensParams &lens, int width, int height, float tolerance, int maxDensity)
+{
+	LensCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "LENS", 4);
+	header.version = LENS_CACHE_VERSION;
+	header.mode = mode;
+	header.lens = lens;
+	header.width = width;
+	header.height = height;
+	header.tolerance = tolerance;
+	header.maxDensity = maxDensity;
+	return header;
+}
+
+static std::string cachePath (const char *cacheDir, const LensCacheHeader &key)
+{ // FNV-1a over the key
+	uint32_t hash = 2166136261u;
+	const uint8_t *bytes = (const uint8_t*)&key;
+	for (size_t i = 0; i < offsetof(LensCacheHeader, density); i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	char name[32];
+	snprintf(name, sizeof(name), "/lens_%08x.bin", hash);
+	return std::string(cacheDir) + name;
+}
+
+/* Checks the data sizes of a cache entry against its density, so a stale or corrupt file is never used */
+static bool validCacheSizes (const LensCacheHeader &cached)
+{
+	if (cached.density < 1 || cached.density > cached.maxDensity) return false;
+	unsigned int points = (cached.density+1) * (cached.density+1);
+	unsigned int cells = cached.density * cached.density;
+	if (cached.mode == LENS_CACHE_MESH)
+		return cached.dataSize[0] == points*5*sizeof(float) && cached.dataSize[1] == cells*6*sizeof(unsigned short);
+	if (cached.mode == LENS_CACHE_REMAP)
+		return cached.dataSize[0] == points*4 && cached.dataSize[1] == 0;
+	return false;
+}
+
+/* Checks that all elements of a cached mesh index its vertices */
+static bool validCacheIndices (const LensCacheHeader &cached, const std::vector<char> &elementData)
+{
+	unsigned int points = (cached.density+1) * (cached.density+1);
+	const unsigned short *e = (const unsigned short*)elementData.data();
+	for (size_t i = 0; i < elementData.size()/sizeof(unsigned short); i++)
+		if (e[i] >= points) return false;
+	return true;
+}
+
+static bool readCache (const char *cacheDir, LensCacheHeader &header, std::vector<char> &data0, std::vector<char> &data1)
+{
+	if (cacheDir == NULL) return false;
+	std::string path = cachePath(cacheDir, header);
+	std::ifstream fs(path, std::ios::in | std::ios::binary);
+	if (!fs.is_open()) return false;
+	LensCacheHeader cached;
+	if (!fs.read((char*)&cached, sizeof(cached))) return false;
+	if (memcmp(&cached, &header, offsetof(LensCacheHeader, density)) != 0) return false;
+	if (!validCacheSizes(cached))
+	{
+		std::cerr << "Lens cache " << path << " does not match its density, rebuilding!" << std::endl;
+		return false;
+	}
+	data0.resize(cached.dataSize[0]);
+	data1.resize(cached.dataSize[1]);
+	if (!fs.read(data0.data(), data0.size()) || !fs.read(data1.data(), data1.size())) return false;
+	if (cached.mode == LENS_CACHE_MESH && !validCacheIndices(cached, data1))
+	{
+		std::cerr << "Lens cache " << path << " indexes beyond its vertices, rebuilding!" << std::endl;
+		return false;
+	}
+	header = cached;
+	return true;
+}
+
+static void writeCache (const char *cacheDir, LensCacheHeader header, const void *data0, unsigned int size0, const void *data1, unsigned int size1)
+{
+	if (cacheDir == NULL) return;
+	std::string path = cachePath(cacheDir, header);
+	std::ofstream fs(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!fs.is_open())
+	{
+		std::cerr << "Could not write lens cache " << path << "!" << std::endl;
+		return;
+	}
+	header.dataSize[0] = size0;
+	header.dataSize[1] = size1;
+	fs.write((const char*)&header, sizeof(header));
+	fs.write((const char*)data0, size0);
+	fs.write((const char*)data1, size1);
+}
+
+/* ---- Lens mesh ---- */
+
+/* Creates or loads the vertices (POS, TEX) and triangle elements of the distorted grid */
+static void buildLensMesh (const LensParams &lens, int width, int height, float tolerancePx, int maxDensity, const char *cacheDir, std::vector<float> &vertices, std::vector<unsigned short> &indices)
+{
+	LensCacheHeader header = cacheKey(LENS_CACHE_MESH, lens, width, height, tolerancePx, maxDensity);
+	std::vector<char> vertexData, elementData;
+	if (readCache(cacheDir, header, vertexData, elementData))
+	{
+		const float *v = (const float*)vertexData.data();
+		const unsigned short *e = (const unsigned short*)elementData.data();
+		vertices.assign(v, v + vertexData.size()/sizeof(float));
+		indices.assign(e, e + elementData.size()/sizeof(unsigned short));
+		return;
+	}
+
+	float error;
+	int N = chooseLensDensity(lens, false, width, height, tolerancePx, maxDensity, &error);
+	std::cout << "Lens mesh: " << N << "x" << N << " cells, max error " << error << "px" << std::endl;
+
+	vertices.clear();
+	indices.clear();
+	vertices.reserve((N+1)*(N+1)*5);
+	indices.reserve(N*N*6);
+	for (int i = 0; i <= N; i++)
+	{
+		for (int j = 0; j <= N; j++)
+		{
+			float x, y;
+			distortPoint(lens, -1 + 2.0f*i/N, -1 + 2.0f*j/N, x, y);
+			vertices.push_back(x);
+			vertices.push_back(y);
+			vertices.push_back(0);
+			vertices.push_back((float)i/N);
+			vertices.push_back((float)j/N);
+		}
+	}
+	for (int i = 0; i < N; i++)
+	{
+		for (int j = 0; j < N; j++)
+		{
+			int offset = i * (N+1) + j;
+			indices.push_back(offset+0);
+			indices.push_back(offset+1);
+			indices.push_back(offset+(N+1)+1);
+			indices.push_back(offset+0);
+			indices.push_back(offset+(N+1));
+			indices.push_back(offset+(N+1)+1);
+		}
+	}
+
+	header.density = N;
+	header.error = error;
+	writeCache(cacheDir, header, vertices.data(), vertices.size()*sizeof(float), indices.data(), indices.size()*sizeof(unsigned short));
+}
+
+Mesh* createLensMesh (const LensParams &lens, int width, int height, float tolerancePx, const char *cacheDir)
+{
+	// Element indices are 16bit, so at most 256x256 vertices
+	std::vector<float> vertices;
+	std::vector<unsigned short> indices;
+	buildLensMesh(lens, width, height, tolerancePx, 255, cacheDir, vertices, indices);
+	return new Mesh({ POS, TEX }, vertices, indices);
+}
+
+Mesh* createStereoLensMesh (const LensParams lenses[2], int eyeWidth, int eyeHeight, float tolerancePx, const char *cacheDir)
+{
+	// Both eyes share the 16bit element indices, so at most 2x 181x181 vertices
+	std::vector<float> vertices;
+	std::vector<unsigned short> indices;
+	for (int e = 0; e < 2; e++)
+	{
+		std::vector<float> eyeVertices;
+		std::vector<unsigned short> eyeIndices;
+		buildLensMesh(lenses[e], eyeWidth, eyeHeight, tolerancePx, 180, cacheDir, eyeVertices, eyeIndices);
+		unsigned short base = vertices.size() / 5;
+		for (int v = 0; v < eyeVertices.size(); v += 5)
+		{ // Squeeze into the eye half of the screen and tag with the eye index
+			vertices.push_back(eyeVertices[v+0] * 0.5f + (e == 0? -0.5f : 0.5f));
+			vertices.push_back(eyeVertices[v+1]);
+			vertices.push_back(e);
+			vertices.push_back(eyeVertices[v+3]);
+			vertices.push_back(eyeVertices[v+4]);
+		}
+		for (int i = 0; i < eyeIndices.size(); i++)
+			indices.push_back(base + eyeIndices[i]);
+	}
+	return new Mesh({ POS, TEX }, vertices, indices);
+}
+
+/* ---- Lens remap texture ---- */
+
+/* Displacement from display to frame UVs at each grid point, returns the largest component */
+static float remapDisplacement (const LensParams &lens, int density, std::vector<float> &displacement, std::vector<bool> &valid)
+{
+	int size = density+1;
+	displacement.resize(size*size*2);
+	valid.resize(size*size);
+	float range = 1.0f / 1024;
+	for (int j = 0; j < size; j++)
+	{
+		for (int i = 0; i < size; i++)
+		{
+			int t = j*size + i;
+			float x = -1 + 2.0f*i/density, y = -1 + 2.0f*j/density, srcX, srcY;
+			valid[t] = mapPoint(lens, true, x, y, srcX, srcY);
+			displacement[t*2+0] = valid[t]? (srcX - x) / 2 : 0;
+			displacement[t*2+1] = valid[t]? (srcY - y) / 2 : 0;
+			range = std::max(range, std::max(fabsf(displacement[t*2+0]), fabsf(displacement[t*2+1])));
+		}
+	}
+	return range;
+}
+
+LensRemapTexture::LensRemapTexture (const LensParams &lens, int Width, int Height, float tolerancePx, const char *cacheDir)
+{
+	width = Width;
+	height = Height;
+
+	int maxDensity = std::min(std::max(width, height), 1023);
+	LensCacheHeader header = cacheKey(LENS_CACHE_REMAP, lens, width, height, tolerancePx, maxDensity);
+	std::vector<char> pixels, unused;
+	if (readCache(cacheDir, header, pixels, unused))
+	{
+		density = header.density;
+		range = header.range;
+		error = header.error;
+	}
+	else
+	{
+		// 8bit quantization of the displacement eats into the tolerance left for interpolation
+		std::vector<float> displacement;
+		std::vector<bool> valid;
+		float quantError = remapDisplacement(lens, 256, displacement, valid) / 255 * std::max(width, height);
+		float interpTolerance = std::max(tolerancePx - quantError, tolerancePx / 4);
+		density = chooseLensDensity(lens, true, width, height, interpTolerance, maxDensity, &error);
+		range = remapDisplacement(lens, density, displacement, valid);
+		int size = density+1;
+
+		// Quantize to 8bit per component
+		pixels.resize(size*size*4);
+		for (int t = 0; t < size*size; t++)
+		{
+			pixels[t*4+0] = (uint8_t)lroundf((displacement[t*2+0] / range * 0.5f + 0.5f) * 255);
+			pixels[t*4+1] = (uint8_t)lroundf((displacement[t*2+1] / range * 0.5f + 0.5f) * 255);
+			pixels[t*4+2] = 0;
+			pixels[t*4+3] = valid[t]? 255 : 0;
+		}
+		error += range / 255 * std::max(width, height);
+		std::cout << "Lens remap: " << size << "x" << size << " texels, max error " << error << "px" << std::endl;
+		if (error > tolerancePx)
+			std::cout << "Lens remap: 8bit displacement cannot reach a tolerance of " << tolerancePx << "px, use the lens mesh instead!" << std::endl;
+
+		header.density = density;
+		header.range = range;
+		header.error = error;
+		writeCache(cacheDir, header, pixels.data(), pixels.size(), NULL, 0);
+	}
+
+	glGenTextures(1, &ID);
+	glBindTexture(GL_TEXTURE_2D, ID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, density+1, density+1, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // Required for NPOT
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+LensRemapTexture::~LensRemapTexture (void)
+{
+	glDeleteTextures(1, &ID);
+}
+void LensRemapTexture::setSource (ShaderProgram *shader, int slot)
+{
+	glUniform1i(glGetUniformLocation(shader->ID, "remap"), slot);
+	glUniform1f(glGetUniformLocation(shader->ID, "remapRange"), range);
+	// Maps display UVs onto texel centers of the grid points
+	glUniform2f(glGetUniformLocation(shader->ID, "remapCoord"), (float)density/(density+1), 0.5f/(density+1));
+	glActiveTexture(GL_TEXTURE0 + slot);
+	glBindTexture(GL_TEXTURE_2D, ID);
+}
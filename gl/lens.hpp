@@ -0,0 +1,68 @@
+#ifndef DEF_LENS
+#define DEF_LENS
+
+#include <GLES2/gl2.h>
+
+#include "shader.hpp"
+#include "mesh.hpp"
+#include "texture.hpp"
+
+#include <vector>
+
+/*
+ * Radial lens model r' = r * (1 + k1*r^2 + k2*r^4 + k3*r^6) around an optical center
+ * Radius and center are in normalized device coordinates of the eye viewport
+ */
+typedef struct LensParams
+{
+	float k1, k2, k3;
+	float centerX, centerY;
+} LensParams;
+
+/* Default barrel distortion previously hard-coded in GLCV */
+static const LensParams defaultLens = { -0.15f, 0.01f, 0.0f, 0.0f, 0.0f };
+
+/*
+ * Reads lens calibration, one eye per line as "k1 k2 k3 centerX centerY" (# for comments)
+ * A single set is used for all eyes. Returns false if no set could be read
+ */
+bool loadLensParams (const char *filePath, std::vector<LensParams> &eyes);
+
+/*
+ * Chooses the grid density (cells per axis) so that linear interpolation between grid points
+ * deviates at most tolerancePx pixels from the exact mapping on a width x height viewport
+ * Forward maps the undistorted grid onto the display (mesh), inverse the display onto the frame (remap texture)
+ */
+int chooseLensDensity (const LensParams &lens, bool inverse, int width, int height, float tolerancePx, int maxDensity, float *errorPx = NULL);
+
+/*
+ * Creates the distorted fullscreen mesh (POS, TEX) for the given viewport and tolerance
+ * If cacheDir is given, the mesh is loaded from or stored to disk keyed by all parameters
+ */
+Mesh* createLensMesh (const LensParams &lens, int width, int height, float tolerancePx, const char *cacheDir = NULL);
+
+/*
+ * Creates one mesh holding both eyes side by side, the eye index (0 left, 1 right) is passed in the z coordinate
+ * Eyes are not clipped against each other, so the distorted grid has to stay within [-1, 1] (true for barrel distortion)
+ */
+Mesh* createStereoLensMesh (const LensParams lenses[2], int eyeWidth, int eyeHeight, float tolerancePx, const char *cacheDir = NULL);
+
+/*
+ * Alternative to the lens mesh: a small RGBA texture holding the displacement from display to frame UVs
+ * RG hold the displacement scaled to [-range, range], A marks pixels that map into the frame
+ * Linear filtering interpolates between grid points, so a plain fullscreen quad and a cheap lookup replace the vertex load
+ */
+class LensRemapTexture : public Texture
+{
+	public:
+	int density;
+	float range, error;
+	LensRemapTexture (const LensParams &lens, int Width, int Height, float tolerancePx, const char *cacheDir = NULL);
+	~LensRemapTexture (void);
+	virtual void setSource (ShaderProgram *shader, int slot) override;
+
+	private:
+	GLuint ID;
+};
+
+#endif
@@ -49,6 +49,8 @@ void Mesh::draw(void)
 
 	// Setup vertex attributes
 	unsigned int offset = 0;
+	GLint enabled[4]; // POS, COL, TEX, NRM
+	int enabledCount = 0;
 	for (int i = 0; i < packing.size(); i++)
 	{
 		unsigned int packFloats = PackedFloats(packing[i]);
@@ -63,6 +65,7 @@ void Mesh::draw(void)
 		}
 		glVertexAttribPointer(adr, packFloats, GL_FLOAT, GL_FALSE, sizeof(float) * FpV, (void *)(sizeof(float) * offset));
 		glEnableVertexAttribArray(adr);
+		if (enabledCount < 4) enabled[enabledCount++] = adr;
 		offset += packFloats;
 	}
 
@@ -71,6 +74,10 @@ void Mesh::draw(void)
 	else
 		glDrawElements(mode, elementCount, GL_UNSIGNED_SHORT, 0);
 
+	// Attributes not used by the next mesh must not stay enabled, pointing into this buffer
+	for (int i = 0; i < enabledCount; i++)
+		glDisableVertexAttribArray(enabled[i]);
+
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
@@ -0,0 +1,187 @@
+#include "overlay.hpp"
+
+#include "defines.hpp"
+#include "font8x16.h"
+
+#include <iostream>
+
+// Atlas of 16x6 glyph cells, the last cell is solid and used for backgrounds
+static const int atlasColumns = 16, atlasRows = 6;
+static const int atlasWidth = atlasColumns * fontGlyphWidth, atlasHeight = atlasRows * fontGlyphHeight;
+static const int solidCell = atlasColumns * atlasRows - 1;
+
+TextOverlay::TextOverlay (int TargetWidth, int TargetHeight)
+{
+	width = TargetWidth;
+	height = TargetHeight;
+	dirty = false;
+	mesh = NULL;
+
+	// Unpack glyph bits into an alpha atlas
+	std::vector<uint8_t> atlas(atlasWidth * atlasHeight, 0);
+	for (int c = 0; c <= solidCell; c++)
+	{
+		int cellX = (c % atlasColumns) * fontGlyphWidth, cellY = (c / atlasColumns) * fontGlyphHeight;
+		for (int y = 0; y < fontGlyphHeight; y++)
+		{
+			uint8_t row = c < fontCharCount? font8x16[c][y] : 0xFF;
+			for (int x = 0; x < fontGlyphWidth; x++)
+				atlas[(cellY + y) * atlasWidth + cellX + x] = (row & (0x80 >> x))? 0xFF : 0x00;
+		}
+	}
+	glGenTextures(1, &atlasID);
+	glBindTexture(GL_TEXTURE_2D, atlasID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, atlasWidth, atlasHeight, 0, GL_ALPHA, GL_UNSIGNED_BYTE, &atlas[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	shader = new ShaderProgram("../gl_shaders/TextES/vert.glsl", "../gl_shaders/TextES/frag.glsl");
+	atlasAdr = glGetUniformLocation(shader->ID, "atlas");
+}
+
+TextOverlay::~TextOverlay (void)
+{
+	if (mesh) delete mesh;
+	delete shader;
+	glDeleteTextures(1, &atlasID);
+}
+
+int TextOverlay::addLine (float x, float y, float scale, TextAlign align)
+{
+	Line line = {};
+	line.x = x;
+	line.y = y;
+	line.scale = scale;
+	line.align = align;
+	line.color[0] = line.color[1] = line.color[2] = 1;
+	line.hasBackground = false;
+	lines.push_back(line);
+	return lines.size()-1;
+}
+
+void TextOverlay::setText (int line, const std::string &text)
+{
+	if (lines[line].text == text) return;
+	lines[line].text = text;
+	dirty = true;
+}
+
+void TextOverlay::setColor (int line, float r, float g, float b)
+{
+	Line &l = lines[line];
+	if (l.color[0] == r && l.color[1] == g && l.color[2] == b) return;
+	l.color[0] = r;
+	l.color[1] = g;
+	l.color[2] = b;
+	dirty = true;
+}
+
+void TextOverlay::setBackground (int line, bool enable, float r, float g, float b)
+{
+	Line &l = lines[line];
+	if (l.hasBackground == enable && l.background[0] == r && l.background[1] == g && l.background[2] == b) return;
+	l.hasBackground = enable;
+	l.background[0] = r;
+	l.background[1] = g;
+	l.background[2] = b;
+	dirty = true;
+}
+
+void TextOverlay::setPosition (int line, float x, float y)
+{
+	Line &l = lines[line];
+	if (l.x == x && l.y == y) return;
+	l.x = x;
+	l.y = y;
+	dirty = true;
+}
+
+void TextOverlay::rebuild (void)
+{
+	dirty = false;
+	if (mesh) delete mesh;
+	mesh = NULL;
+
+	std::vector<float> vertices;
+	std::vector<unsigned short> indices;
+	// Element indices are 16bit, so at most 16384 quads
+	auto addQuad = [&](float x0, float y0, float x1, float y1, int cell, const float *col)
+	{
+		if (vertices.size() / 8 + 4 > 65536) return;
+		float u0 = (float)(cell % atlasColumns) / atlasColumns, v0 = (float)(cell / atlasColumns) / atlasRows;
+		float u1 = u0 + 1.0f / atlasColumns, v1 = v0 + 1.0f / atlasRows;
+		if (cell == solidCell)
+		{ // Sample the center only to avoid bleeding into neighbours
+			u0 = u1 = (u0 + u1) / 2;
+			v0 = v1 = (v0 + v1) / 2;
+		}
+		// Pixels with origin top-left to normalized device coordinates
+		x0 = x0 / width * 2 - 1;
+		x1 = x1 / width * 2 - 1;
+		y0 = 1 - y0 / height * 2;
+		y1 = 1 - y1 / height * 2;
+		unsigned short base = vertices.size() / 8;
+		float quad[] = {
+			x0, y0, 0, col[0], col[1], col[2], u0, v0,
+			x1, y0, 0, col[0], col[1], col[2], u1, v0,
+			x0, y1, 0, col[0], col[1], col[2], u0, v1,
+			x1, y1, 0, col[0], col[1], col[2], u1, v1,
+		};
+		vertices.insert(vertices.end(), quad, quad + 32);
+		unsigned short quadIndices[] = { 0, 1, 2, 2, 1, 3 };
+		for (int i = 0; i < 6; i++)
+			indices.push_back(base + quadIndices[i]);
+	};
+
+	for (int l = 0; l < lines.size(); l++)
+	{
+		const Line &line = lines[l];
+		float glyphW = fontGlyphWidth * line.scale, glyphH = fontGlyphHeight * line.scale;
+		size_t start = 0;
+		int row = 0;
+		while (start <= line.text.size())
+		{
+			size_t end = line.text.find('\n', start);
+			if (end == std::string::npos) end = line.text.size();
+			int count = end - start;
+			float rowW = count * glyphW;
+			float x = line.x - (line.align == TEXT_CENTER? rowW/2 : (line.align == TEXT_RIGHT? rowW : 0));
+			float y = line.y + row * glyphH;
+			if (line.hasBackground && count > 0)
+				addQuad(x - line.scale, y, x + rowW + line.scale, y + glyphH, solidCell, line.background);
+			for (int i = 0; i < count; i++)
+			{
+				int c = (unsigned char)line.text[start+i];
+				if (c == ' ') continue;
+				if (c < fontFirstChar || c >= fontFirstChar + fontCharCount) c = '?';
+				addQuad(x + i*glyphW, y, x + (i+1)*glyphW, y + glyphH, c - fontFirstChar, line.color);
+			}
+			start = end + 1;
+			row++;
+		}
+	}
+
+	if (!vertices.empty())
+		mesh = new Mesh({ POS, COL, TEX }, vertices, indices);
+}
+
+void TextOverlay::draw (void)
+{
+	if (dirty) rebuild();
+	if (!mesh) return;
+
+	glViewport(0, 0, width, height);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	shader->use();
+	glUniform1i(atlasAdr, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, atlasID);
+	mesh->draw();
+	glDisable(GL_BLEND);
+}
@@ -0,0 +1,57 @@
+#ifndef DEF_OVERLAY
+#define DEF_OVERLAY
+
+#include <GLES2/gl2.h>
+
+#include "shader.hpp"
+#include "mesh.hpp"
+
+#include <vector>
+#include <string>
+
+/* Horizontal placement of a text line relative to its position */
+typedef enum TextAlign
+{
+	TEXT_LEFT = 0,
+	TEXT_CENTER = 1,
+	TEXT_RIGHT = 2,
+} TextAlign;
+
+/*
+ * Text overlay rendered from the embedded 8x16 glyph atlas in one batched draw
+ * Lines are placed in pixels of the target (origin top-left), a newline starts a new row
+ * The vertex buffer is only rebuilt when text, colour or placement of a line changed
+ */
+class TextOverlay
+{
+	public:
+	int width, height;
+	TextOverlay (int TargetWidth, int TargetHeight);
+	~TextOverlay (void);
+	int addLine (float x, float y, float scale = 2, TextAlign align = TEXT_LEFT);
+	void setText (int line, const std::string &text);
+	void setColor (int line, float r, float g, float b);
+	void setBackground (int line, bool enable, float r = 0, float g = 0, float b = 0);
+	void setPosition (int line, float x, float y);
+	void draw (void);
+
+	private:
+	struct Line
+	{
+		std::string text;
+		float x, y, scale;
+		TextAlign align;
+		float color[3], background[3];
+		bool hasBackground;
+	};
+	std::vector<Line> lines;
+	bool dirty;
+	Mesh *mesh;
+	ShaderProgram *shader;
+	GLuint atlasID;
+	GLint atlasAdr;
+
+	void rebuild (void);
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "present.hpp"
+
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+PresentPolicy::PresentPolicy (PresentMode Mode, float Value)
+{
+	mode = Mode;
+	everyN = 1;
+	frame = 0;
+	flag = false;
+	period = std::chrono::steady_clock::duration::zero();
+	nextPresent = std::chrono::steady_clock::now();
+	if (mode == PRESENT_EVERY_N)
+		everyN = std::max(1, (int)Value);
+	else if (mode == PRESENT_RATE && Value > 0)
+		period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / Value));
+}
+
+/*
+ * Parses a policy from a command line spec: "all", "N" (every Nth frame), "Rhz" (fixed rate) or "key"
+ */
+bool PresentPolicy::parse (const char *spec)
+{
+	if (strcmp(spec, "all") == 0)
+	{
+		*this = PresentPolicy(PRESENT_ALWAYS);
+		return true;
+	}
+	if (strcmp(spec, "key") == 0)
+	{
+		*this = PresentPolicy(PRESENT_ON_KEY);
+		return true;
+	}
+	char *end;
+	float value = strtof(spec, &end);
+	if (end == spec || value <= 0)
+		return false;
+	if (strcmp(end, "hz") == 0 || strcmp(end, "Hz") == 0)
+		*this = PresentPolicy(PRESENT_RATE, value);
+	else if (*end == '\0')
+		*this = PresentPolicy(PRESENT_EVERY_N, value);
+	else
+		return false;
+	return true;
+}
+
+/*
+ * Call once per processed frame, returns whether this frame should be presented
+ */
+bool PresentPolicy::shouldPresent (void)
+{
+	switch (mode)
+	{
+		case PRESENT_EVERY_N:
+			return (frame++ % everyN) == 0;
+		case PRESENT_RATE:
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (now < nextPresent) return false;
+			// Keep the cadence, but do not try to catch up after a stall
+			nextPresent += period;
+			if (nextPresent < now) nextPresent = now + period;
+			return true;
+		}
+		case PRESENT_ON_KEY:
+			return flag;
+		default:
+			return true;
+	}
+}
+
+void PresentPolicy::setFlag (bool enable)
+{
+	flag = enable;
+}
+
+void PresentPolicy::toggleFlag (void)
+{
+	flag = !flag;
+}
@@ -0,0 +1,37 @@
+#ifndef DEF_PRESENT
+#define DEF_PRESENT
+
+#include <chrono>
+
+/* When processed frames are presented to the display */
+typedef enum PresentMode
+{
+	PRESENT_ALWAYS,		// Every processed frame (lock step with the display)
+	PRESENT_EVERY_N,	// Every Nth processed frame
+	PRESENT_RATE,		// At most at a fixed target rate
+	PRESENT_ON_KEY,		// Only while the preview flag is set (toggled by a key)
+} PresentMode;
+
+/*
+ * Presentation policy decoupling the display rate from the processing rate
+ * Processing continues at full rate, only the frames selected by the policy are presented
+ * Combine with a swap interval of 0 so presenting never blocks processing on the display
+ */
+class PresentPolicy
+{
+	public:
+	PresentMode mode;
+	PresentPolicy (PresentMode Mode = PRESENT_ALWAYS, float Value = 0);
+	bool parse (const char *spec);
+	bool shouldPresent (void);
+	void setFlag (bool enable);
+	void toggleFlag (void);
+
+	private:
+	int everyN, frame;
+	bool flag;
+	std::chrono::steady_clock::duration period;
+	std::chrono::steady_clock::time_point nextPresent;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+Profiler::Profiler (int SampleInterval, int WindowSize)
+{
+	sampleInterval = std::max(1, SampleInterval);
+	windowSize = std::max(1, WindowSize);
+	frame = -1;
+	sampleFrame = false;
+}
+
+int Profiler::addPass (const std::string &name, bool gpu)
+{
+	passes.push_back({});
+	Pass &pass = passes.back();
+	pass.name = name;
+	pass.gpu = gpu;
+	pass.next = 0;
+	pass.samples.reserve(windowSize);
+	return passes.size()-1;
+}
+
+void Profiler::nextFrame (void)
+{
+	frame++;
+	sampleFrame = (frame % sampleInterval) == 0;
+}
+
+bool Profiler::sampling (void)
+{
+	return sampleFrame;
+}
+
+void Profiler::begin (int pass)
+{
+	if (!sampleFrame || pass < 0 || pass >= passes.size()) return;
+	// Drain previous work so only this pass is measured
+	if (passes[pass].gpu) glFinish();
+	passes[pass].start = std::chrono::steady_clock::now();
+}
+
+void Profiler::end (int pass)
+{
+	if (!sampleFrame || pass < 0 || pass >= passes.size()) return;
+	Pass &p = passes[pass];
+	if (p.gpu) glFinish();
+	float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - p.start).count();
+	if (p.samples.size() < windowSize)
+		p.samples.push_back(ms);
+	else
+		p.samples[p.next] = ms;
+	p.next = (p.next+1) % windowSize;
+}
+
+Profiler::Stats Profiler::getStats (const Pass &pass)
+{
+	Stats stats = { (int)pass.samples.size(), 0, 0, 0 };
+	if (stats.count == 0) return stats;
+	std::vector<float> sorted = pass.samples;
+	std::sort(sorted.begin(), sorted.end());
+	stats.min = sorted.front();
+	for (int i = 0; i < sorted.size(); i++)
+		stats.mean += sorted[i];
+	stats.mean /= stats.count;
+	stats.p99 = sorted[std::min(stats.count-1, (int)(stats.count * 0.99f))];
+	return stats;
+}
+
+void Profiler::log (std::ostream &out)
+{
+	// Restore the format of the callers stream afterwards
+	std::ios_base::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << "Pass timings over last " << windowSize << " samples (every " << sampleInterval << ". frame):\n";
+	for (int i = 0; i < passes.size(); i++)
+	{
+		Stats stats = getStats(passes[i]);
+		out << std::setw(12) << passes[i].name << ": " << std::fixed << std::setprecision(2)
+			<< "min " << stats.min << "ms, mean " << stats.mean << "ms, p99 " << stats.p99 << "ms"
+			<< " (" << stats.count << " samples)\n";
+	}
+	out.flags(flags);
+	out.precision(precision);
+}
+
+bool Profiler::writeCSV (const char *filePath)
+{
+	std::ofstream fs(filePath, std::ios::out | std::ios::trunc);
+	if (!fs.is_open()) return false;
+	fs << "pass,gpu,samples,min_ms,mean_ms,p99_ms\n";
+	for (int i = 0; i < passes.size(); i++)
+	{
+		Stats stats = getStats(passes[i]);
+		fs << passes[i].name << "," << (passes[i].gpu? 1 : 0) << "," << stats.count << ","
+			<< stats.min << "," << stats.mean << "," << stats.p99 << "\n";
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+#ifndef DEF_PROFILER
+#define DEF_PROFILER
+
+#include <GLES2/gl2.h>
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <ostream>
+
+/*
+ * Per-pass timing profiler for GL pipelines
+ * Only every sampleInterval-th frame is timed, GPU passes are then isolated with glFinish before and after
+ * Keeps a rolling window of samples per pass to report min/mean/p99
+ */
+class Profiler
+{
+	public:
+	Profiler (int SampleInterval = 10, int WindowSize = 200);
+	int addPass (const std::string &name, bool gpu);
+	void nextFrame (void);
+	bool sampling (void);
+	void begin (int pass);
+	void end (int pass);
+	void log (std::ostream &out);
+	bool writeCSV (const char *filePath);
+
+	private:
+	struct Pass
+	{
+		std::string name;
+		bool gpu;
+		std::vector<float> samples; // Rolling window in ms
+		int next;
+		std::chrono::steady_clock::time_point start;
+	};
+	struct Stats
+	{
+		int count;
+		float min, mean, p99;
+	};
+	std::vector<Pass> passes;
+	int sampleInterval, windowSize, frame;
+	bool sampleFrame;
+
+	Stats getStats (const Pass &pass);
+};
+
+#endif
@@ -30,10 +30,21 @@ std::string readFile(const char *filePath)
 
 /*
  * Load shader text from file and compile
+ * An optional prelude (e.g. defines) is inserted right after the #version line
  */
-GLuint loadShader (const char* fileName, int type)
+GLuint loadShader (const char* fileName, int type, const std::string &prelude)
 {
 	std::string shaderSrcStr = readFile(fileName);
+	if (!prelude.empty())
+	{ // #version has to stay the first line
+		size_t pos = 0;
+		if (shaderSrcStr.compare(0, 8, "#version") == 0)
+		{
+			pos = shaderSrcStr.find('\n');
+			pos = pos == std::string::npos? shaderSrcStr.size() : pos+1;
+		}
+		shaderSrcStr.insert(pos, prelude + "\n");
+	}
 	const char* shaderSrc = shaderSrcStr.c_str();
 	GLuint shader = glCreateShader(type);
 	if (shader == 0)
@@ -56,11 +67,11 @@ GLuint loadShader (const char* fileName, int type)
 	return shader;
 }
 
-ShaderProgram::ShaderProgram(const char* vertShaderFile, const char* fragShaderFile)
+ShaderProgram::ShaderProgram(const char* vertShaderFile, const char* fragShaderFile, const std::string &prelude)
 {
 	ID = 0;
-	GLuint vertShader = loadShader(vertShaderFile, GL_VERTEX_SHADER);
-	GLuint fragShader = loadShader(fragShaderFile, GL_FRAGMENT_SHADER);
+	GLuint vertShader = loadShader(vertShaderFile, GL_VERTEX_SHADER, prelude);
+	GLuint fragShader = loadShader(fragShaderFile, GL_FRAGMENT_SHADER, prelude);
 	if (vertShader != 0 && fragShader != 0)
 	{
 		ID = glCreateProgram();
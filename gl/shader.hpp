@@ -12,8 +12,9 @@ std::string readFile(const char *filePath);
 
 /*
  * Load shader text from file and compile
+ * An optional prelude (e.g. defines) is inserted right after the #version line
  */
-GLuint loadShader (const char* fileName, int type);
+GLuint loadShader (const char* fileName, int type, const std::string &prelude = "");
 
 /*
  * A compiled and linked shader program with vertex and fragment shaders
@@ -24,7 +25,7 @@ class ShaderProgram
 	GLuint ID;
 	GLint uImageAdr = 0, uWidthAdr = 1, uHeightAdr = 2;
 
-	ShaderProgram(const char* vertShaderFile, const char* fragShaderFile);
+	ShaderProgram(const char* vertShaderFile, const char* fragShaderFile, const std::string &prelude = "");
 	~ShaderProgram ();
 	void use (void);
 };
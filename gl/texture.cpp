@@ -14,6 +14,38 @@ static int nextPOT (int NPOT)
 	return std::max(64, NPOT);
 }
 
+void drawRegions (Mesh *mesh, const std::vector<ROI> &regions)
+{
+	if (regions.empty())
+	{
+		mesh->draw();
+		return;
+	}
+	// Clear stale results outside the regions (cheap on the tile-based VC4)
+	GLfloat clearColor[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+	// Shade only the regions
+	glEnable(GL_SCISSOR_TEST);
+	for (int i = 0; i < regions.size(); i++)
+	{
+		glScissor(regions[i].x, regions[i].y, regions[i].width, regions[i].height);
+		mesh->draw();
+	}
+	glDisable(GL_SCISSOR_TEST);
+}
+
+void RenderTarget::setRegions (const std::vector<ROI> &ROIs)
+{
+	regions = ROIs;
+}
+void RenderTarget::draw (Mesh *mesh)
+{
+	drawRegions(mesh, regions);
+}
+
 ExternalTexture::ExternalTexture (GLint texHandle, int Width, int Height)
 {
 	ID = texHandle;
@@ -29,12 +61,74 @@ void ExternalTexture::setSource (ShaderProgram *shader, int slot)
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, ID);
 }
 
-FrameRenderTarget::FrameRenderTarget (int Width, int Height, GLenum format, GLenum type)
+std::string layoutDefines (TargetLayout layout)
+{
+	if (layout == LAYOUT_GRAY_ALPHA) return "#define LAYOUT_GRAY_ALPHA";
+	if (layout == LAYOUT_RED_MASK) return "#define LAYOUT_RED_MASK";
+	return "#define LAYOUT_RGBA";
+}
+
+FrameRenderTarget::FrameRenderTarget (int Width, int Height, GLenum Format, GLenum Type)
 {
 	width = Width;
 	height = Height;
-	// Framebuffer
+	layout = LAYOUT_RGBA;
 	glGenFramebuffers(1, &FBO_ID);
+	if (!allocate(Format, Type))
+	{
+		std::cout << "Error: Framebuffer not complete: " << glCheckFramebufferStatus(GL_FRAMEBUFFER) << "\n";
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+FrameRenderTarget::FrameRenderTarget (int Width, int Height, TargetChannels channels)
+{
+	width = Width;
+	height = Height;
+	glGenFramebuffers(1, &FBO_ID);
+
+	// Candidates ordered by bytes per pixel, the first one that is renderable wins
+	struct Candidate { GLenum format, type; TargetLayout layout; };
+	static const Candidate maskFormats[] = {
+		{ GL_LUMINANCE, GL_UNSIGNED_BYTE, LAYOUT_RED_MASK },
+		{ GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, LAYOUT_GRAY_ALPHA },
+		{ GL_RGB, GL_UNSIGNED_SHORT_5_6_5, LAYOUT_RED_MASK },
+		{ GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, LAYOUT_RGBA },
+	};
+	static const Candidate grayMaskFormats[] = {
+		{ GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, LAYOUT_GRAY_ALPHA },
+		{ GL_RGB, GL_UNSIGNED_SHORT_5_6_5, LAYOUT_RED_MASK },
+		{ GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, LAYOUT_RGBA },
+		{ GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, LAYOUT_RGBA },
+	};
+	static const Candidate colorMaskFormats[] = {
+		{ GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, LAYOUT_RGBA },
+		{ GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, LAYOUT_RGBA },
+	};
+	const Candidate *candidates = NULL;
+	int count = 0;
+	if (channels == CHANNELS_MASK) { candidates = maskFormats; count = 4; }
+	else if (channels == CHANNELS_GRAY_MASK) { candidates = grayMaskFormats; count = 4; }
+	else if (channels == CHANNELS_COLOR_MASK) { candidates = colorMaskFormats; count = 2; }
+
+	bool complete = false;
+	for (int i = 0; i < count && !complete; i++)
+	{
+		layout = candidates[i].layout;
+		complete = allocate(candidates[i].format, candidates[i].type);
+	}
+	if (!complete)
+	{ // RGBA8 is always renderable
+		layout = LAYOUT_RGBA;
+		if (!allocate(GL_RGBA, GL_UNSIGNED_BYTE))
+			std::cout << "Error: Framebuffer not complete: " << glCheckFramebufferStatus(GL_FRAMEBUFFER) << "\n";
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+bool FrameRenderTarget::allocate (GLenum Format, GLenum Type)
+{
+	format = Format;
+	type = Type;
+	// Framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, FBO_ID);
 	// Color Buffer
 	glGenTextures(1, &colorBuffer_ID);
@@ -45,10 +139,14 @@ FrameRenderTarget::FrameRenderTarget (int Width, int Height, GLenum format, GLen
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorBuffer_ID, 0);
 	// Check
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-	{
-		std::cout << "Error: Framebuffer not complete: " << glCheckFramebufferStatus(GL_FRAMEBUFFER) << "\n";
+	{ // Drop errors of unsupported format combinations, the next candidate is tried
+		while (glGetError() != GL_NO_ERROR);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+		glDeleteTextures(1, &colorBuffer_ID);
+		colorBuffer_ID = 0;
+		return false;
 	}
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return true;
 }
 FrameRenderTarget::~FrameRenderTarget (void)
 {
@@ -108,6 +206,7 @@ void BufferRenderTarget::setSource (ShaderProgram *shader, int slot)
 	glBindTexture(GL_TEXTURE_2D, colorBuffer_ID);
 }
 
+#ifndef DESKTOP_GL
 VCSMRenderTarget::VCSMRenderTarget (int Width, int Height, EGLDisplay Display)
 {
 	width = Width;
@@ -183,3 +282,70 @@ void VCSMRenderTarget::unlock (void)
 {
 	vcsm_unlock_ptr(vcsmBuffer);
 }
+
+VCSMReadbackRing::VCSMReadbackRing (int Width, int Height, int Depth, EGLDisplay Display)
+{
+	width = Width;
+	height = Height;
+	depth = std::max(1, Depth);
+	eglDisplay = Display;
+	writeIndex = 0;
+	readIndex = -1;
+	written = 0;
+	for (int i = 0; i < depth; i++)
+	{
+		slots.push_back(new VCSMRenderTarget(width, height, eglDisplay));
+		fences.push_back(EGL_NO_SYNC_KHR);
+	}
+	bufferWidth = slots[0]->bufferWidth;
+	bufferHeight = slots[0]->bufferHeight;
+}
+VCSMReadbackRing::~VCSMReadbackRing (void)
+{
+	for (int i = 0; i < depth; i++)
+	{
+		if (fences[i] != EGL_NO_SYNC_KHR)
+			eglDestroySyncKHR(eglDisplay, fences[i]);
+		delete slots[i];
+	}
+}
+VCSMRenderTarget* VCSMReadbackRing::writeTarget (void)
+{
+	return slots[writeIndex];
+}
+void VCSMReadbackRing::submit (void)
+{
+	// Guard the slot just rendered to with a fence and advance
+	if (fences[writeIndex] != EGL_NO_SYNC_KHR)
+		eglDestroySyncKHR(eglDisplay, fences[writeIndex]);
+	fences[writeIndex] = eglCreateSyncKHR(eglDisplay, EGL_SYNC_FENCE_KHR, NULL);
+	// Kick off rendering now so it progresses while the CPU works on older slots
+	glFlush();
+	writeIndex = (writeIndex+1) % depth;
+	written++;
+}
+uint8_t* VCSMReadbackRing::lock (void)
+{
+	if (written < depth) return NULL; // Oldest slot has not been written yet
+	// Oldest slot is the next one to be written
+	readIndex = writeIndex;
+	if (fences[readIndex] != EGL_NO_SYNC_KHR)
+	{ // Usually signaled already, else only waits for the commands up to this slot
+		EGLint status = eglClientWaitSyncKHR(eglDisplay, fences[readIndex], EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+		if (status == EGL_FALSE) glFinish();
+		eglDestroySyncKHR(eglDisplay, fences[readIndex]);
+		fences[readIndex] = EGL_NO_SYNC_KHR;
+	}
+	else
+	{ // Fence sync not supported, fall back to waiting for all GL operations
+		glFinish();
+	}
+	return slots[readIndex]->lock();
+}
+void VCSMReadbackRing::unlock (void)
+{
+	if (readIndex < 0) return;
+	slots[readIndex]->unlock();
+	readIndex = -1;
+}
+#endif
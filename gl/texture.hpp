@@ -5,9 +5,31 @@
 #include <GLES2/gl2ext.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
+#ifndef DESKTOP_GL
 #include <interface/vcsm/user-vcsm.h>
+#endif
 
 #include "shader.hpp"
+#include "mesh.hpp"
+
+#include <vector>
+#include <string>
+
+/*
+ * Pixel rectangle of a target to restrict shading to
+ */
+typedef struct ROI
+{
+	int x, y;
+	int width, height;
+} ROI;
+
+/*
+ * Draws mesh only into the given regions of the currently bound target using the scissor test
+ * The viewport is untouched, so UVs still map the full source onto the full target
+ * Everything outside the regions is cleared to zero. If no regions are given, draws normally
+ */
+void drawRegions (Mesh *mesh, const std::vector<ROI> &regions);
 
 
 /*
@@ -40,26 +62,62 @@ class ExternalTexture : public Texture
 class RenderTarget : public Texture
 {
 	public:
+	std::vector<ROI> regions;
 	virtual void setTarget (void) = 0;
 	virtual void setSource (ShaderProgram *shader, int slot) = 0;
+	void setRegions (const std::vector<ROI> &ROIs);
+	void draw (Mesh *mesh);
 
 	protected:
 	GLuint FBO_ID;
 };
 
+/*
+ * Channels the consumers of a render target actually read, to negotiate the most compact format
+ */
+typedef enum TargetChannels
+{
+	CHANNELS_MASK,			// Binary mask only
+	CHANNELS_GRAY_MASK,		// Grey value and binary mask
+	CHANNELS_COLOR_MASK,	// Color and binary mask
+	CHANNELS_RGBA,			// Full RGBA8
+} TargetChannels;
+
+/*
+ * Where the channels end up in the negotiated format, shaders select their packing with the matching define
+ * LAYOUT_RGBA: color in rgb, mask in a (RGBA8, RGBA4, RGB5_A1)
+ * LAYOUT_GRAY_ALPHA: grey in rgb, mask in a (LUMINANCE_ALPHA)
+ * LAYOUT_RED_MASK: mask in r, grey in g and b (RGB565, LUMINANCE)
+ */
+typedef enum TargetLayout
+{
+	LAYOUT_RGBA,
+	LAYOUT_GRAY_ALPHA,
+	LAYOUT_RED_MASK,
+} TargetLayout;
+
+/*
+ * Shader prelude defining the layout of a negotiated target
+ */
+std::string layoutDefines (TargetLayout layout);
+
 /*
  * A simple texture target with one color buffer (read-write)
  */
 class FrameRenderTarget : public RenderTarget
 {
 	public:
-	FrameRenderTarget (int Width, int Height, GLenum format, GLenum type);
+	GLenum format, type;
+	TargetLayout layout;
+	FrameRenderTarget (int Width, int Height, GLenum Format, GLenum Type);
+	FrameRenderTarget (int Width, int Height, TargetChannels channels);
 	~FrameRenderTarget (void);
 	void setTarget (void) override;
 	void setSource (ShaderProgram *shader, int slot) override;
 
 	private:
 	GLuint colorBuffer_ID;
+	bool allocate (GLenum Format, GLenum Type);
 };
 
 /*
@@ -77,6 +135,7 @@ class BufferRenderTarget : public RenderTarget
 	GLuint colorBuffer_ID;
 };
 
+#ifndef DESKTOP_GL
 /*
  * A VCOS shared memory render target with one RGBA buffer (read-write)
  * VCOS only support POT textures, so only a part will be used
@@ -100,4 +159,29 @@ class VCSMRenderTarget : public RenderTarget
 	EGLDisplay eglDisplay;
 };
 
+/*
+ * A ring of VCSM render targets written in rotation, each guarded by an EGL fence
+ * The CPU locks the slot written depth-1 frames ago, so it rarely has to wait for the GPU
+ * Depth 1 behaves like a synchronous readback, higher depths trade latency for throughput
+ */
+class VCSMReadbackRing
+{
+	public:
+	int width, height, depth;
+	int bufferWidth, bufferHeight;
+	VCSMReadbackRing (int Width, int Height, int Depth, EGLDisplay Display);
+	~VCSMReadbackRing (void);
+	VCSMRenderTarget* writeTarget (void);
+	void submit (void);
+	uint8_t* lock (void);
+	void unlock (void);
+
+	private:
+	std::vector<VCSMRenderTarget*> slots;
+	std::vector<EGLSyncKHR> fences;
+	int writeIndex, readIndex, written;
+	EGLDisplay eglDisplay;
+};
+#endif
+
 #endif
@@ -1,18 +1,23 @@
 #include "blobdetection.hpp"
 
-// Alternative: Store buffer in VCSM (Video Core Shared Memory)
-// In theory VCSM removes need for the expensive read pixels call
-// In practice that is only relevant for larger buffers, for the extremely small bitmap it makes no difference
-#define USE_READ_PIXELS
+// Alternative: Read back using the synchronous glReadPixels call
+// By default the regions map is rendered into a ring of VCSM (Video Core Shared Memory) buffers guarded by fences
+// Reading the slot of an earlier frame avoids waiting for the GPU to drain, at the cost of readbackDepth-1 frames of latency
+//#define USE_READ_PIXELS
+#ifdef DESKTOP_GL
+#define USE_READ_PIXELS // No VCSM outside of the Raspberry Pi
+#endif
 
 #include "defines.hpp"
 #include "mesh.hpp"
 #include "shader.hpp"
 #include "texture.hpp"
+#include "profiler.hpp"
 
 #include <cmath>
 #include <cstring>
 #include <vector>
+#include <deque>
 #include <map>
 #include <iostream>
 
@@ -52,18 +57,23 @@ static int blobMergeBorder = 4;
 static Mesh *SSQuad;
 // Screen Space Shaders
 static ShaderProgram *shaderESBlobDetectRGB, *shaderESBlobDetectY, *shaderESBlobDetectYUV;
+static ShaderProgram *shaderESBlobDetectYTex; // Y detection on a regular 2D texture, e.g. of synthetic frames
 static ShaderProgram *shaderESBlobEncode, *shaderESBlobViz, *shaderESPoint;
 // Shader texture locations
-static int texRGBAdr, texYAdrY, texYUVAdrY, texYUVAdrU, texYUVAdrV;
+static int texRGBAdr, texYAdrY, texYUVAdrY, texYUVAdrU, texYUVAdrV, texYTexAdrY;
 // Intermediate render targets
 #ifdef USE_READ_PIXELS
 static FrameRenderTarget *blobMask, *blobMap;
 #else
 static FrameRenderTarget *blobMask;
-static VCSMRenderTarget *blobMap;
+static VCSMReadbackRing *blobMap;
 #endif
 // Regions map buffer for readback from GPU
 static BlobMapRegion *blobMapRegions;
+// Capture times of the frames in the blobMap ring, oldest first, and of the frame last read back
+static std::deque<uint64_t> blobMapCaptureUS;
+static int blobMapDepth;
+static uint64_t blobCaptureUS;
 // Dynamic buffer for all 4x4 regions that are part of a blob
 static std::vector<Region> blobRegions;
 // Shared buffer serving as a map from initial component ID to merged component ID
@@ -73,16 +83,25 @@ static int mapRowSize;
 static unsigned char *mapRowZeros;
 // Point cloud buffer for uploading visualization points to GPU
 static GLuint vizPointsVBO;
+// Regions of interest in camera pixels, aligned to the 8x4 pixels encoded per blobMap pixel
+static std::vector<Bounds> blobROIs;
+static std::vector<ROI> maskROIs, mapROIs;
+// Optional profiler timing the individual passes
+static Profiler *profiler = NULL;
+static int passDetect, passEncode, passReadback, passLabeling;
+#define PROFILE_BEGIN(PASS) if (profiler) profiler->begin(PASS)
+#define PROFILE_END(PASS) if (profiler) profiler->end(PASS)
 
 /* Local Functions */
 
 static void bindExternalTexture (GLuint adr, GLuint tex, int slot);
+static void performBlobDetectionPasses(ShaderProgram *shader, uint64_t captureUS);
 static uint8_t resolveComponentMerge(uint8_t compID);
 
 /*
  * Intialize resources required for blob detection
  */
-void initBlobDetection (int width, int height, EGL_Setup eglSetup)
+void initBlobDetection (int width, int height, EGL_Setup eglSetup, int readbackDepth, bool visualize)
 {
 	maskW = width;
 	maskH = height;
@@ -102,33 +121,40 @@ void initBlobDetection (int width, int height, EGL_Setup eglSetup)
 		-1, -1, 0, 0, 0,
 	}, {});
 
+	// Mask only needs the blob bit, plus a grey value if it is visualized
+	blobMask = new FrameRenderTarget(maskW, maskH, visualize? CHANNELS_GRAY_MASK : CHANNELS_MASK);
+	std::string maskLayout = layoutDefines(blobMask->layout) + "\n" + readFile("../gl_shaders/BlobES/layout.glsl");
+
 	// Load and compile Screen Space Shaders
-	shaderESBlobDetectRGB = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectRGB.glsl");
-	shaderESBlobDetectY = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectY.glsl");
-	shaderESBlobDetectYUV = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectYUV.glsl");
-	shaderESBlobEncode = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobEncode.glsl");
-	shaderESBlobViz = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobViz.glsl");
+	shaderESBlobDetectRGB = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectRGB.glsl", maskLayout);
+	shaderESBlobDetectY = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectY.glsl", maskLayout);
+	shaderESBlobDetectYTex = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectY.glsl", maskLayout + "\n#define samplerExternalOES sampler2D");
+	shaderESBlobDetectYUV = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobDetectYUV.glsl", maskLayout);
+	shaderESBlobEncode = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobEncode.glsl", maskLayout);
+	shaderESBlobViz = new ShaderProgram("../gl_shaders/BlobES/vert.glsl", "../gl_shaders/BlobES/frag_blobViz.glsl", maskLayout);
 	shaderESPoint = new ShaderProgram("../gl_shaders/PointES/vert.glsl", "../gl_shaders/PointES/frag.glsl");
 
 	// Find adresses of textures in shaders
 	texRGBAdr = glGetUniformLocation(shaderESBlobDetectRGB->ID, "image");
 	texYAdrY = glGetUniformLocation(shaderESBlobDetectY->ID, "imageY");
+	texYTexAdrY = glGetUniformLocation(shaderESBlobDetectYTex->ID, "imageY");
 	texYUVAdrY = glGetUniformLocation(shaderESBlobDetectYUV->ID, "imageY");
 	texYUVAdrU = glGetUniformLocation(shaderESBlobDetectYUV->ID, "imageU");
 	texYUVAdrV = glGetUniformLocation(shaderESBlobDetectYUV->ID, "imageV");
 
 #ifdef USE_READ_PIXELS
 	// Setup intermediate Render Targets
-	blobMask = new FrameRenderTarget(maskW, maskH, GL_RGBA, GL_UNSIGNED_BYTE);
 	blobMap = new FrameRenderTarget(mapW/2, mapH, GL_RGBA, GL_UNSIGNED_BYTE);
 	// Allocate memory for regions map read back from the GPU
 	blobMapRegions = (BlobMapRegion*)malloc(mapW * mapH * 2);
 #else
 	// Setup Render Targets in Shared Memory
 	vcsm_init();
-	blobMask = new FrameRenderTarget(maskW, maskH, GL_RGBA, GL_UNSIGNED_BYTE);
-	blobMap = new VCSMRenderTarget(mapW/2, mapH, eglSetup.display);
+	blobMap = new VCSMReadbackRing(mapW/2, mapH, readbackDepth, eglSetup.display);
 #endif
+	blobMapDepth = std::max(1, readbackDepth);
+	blobMapCaptureUS.clear();
+	blobCaptureUS = 0;
 
 	// Setup resources used during blob detection
 	blobRegions.reserve(32);
@@ -188,23 +214,65 @@ void performBlobDetectionGPU(CamGL_Frame *frame)
 		bindExternalTexture(texYUVAdrU, frame->textureU, 1);
 		bindExternalTexture(texYUVAdrV, frame->textureV, 2);
 	}
+	performBlobDetectionPasses(shader, frame->captureUS);
+}
+
+/*
+ * Perform blob detection on a regular 2D luminance texture instead of a camera frame, e.g. to benchmark against synthetic frames
+ */
+void performBlobDetectionTexture(GLuint textureY, uint64_t captureUS, std::vector<Cluster> &blobs)
+{
+	shaderESBlobDetectYTex->use();
+	glUniform1i(texYTexAdrY, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, textureY);
+	CHECK_GL();
+	performBlobDetectionPasses(shaderESBlobDetectYTex, captureUS);
+	performBlobDetectionRegionsFetch();
+	performBlobDetectionCPU(blobs);
+}
+
+/*
+ * Render the detection shader with its source bound into blobMask and encode it into blobMap
+ */
+static void performBlobDetectionPasses(ShaderProgram *shader, uint64_t captureUS)
+{
 	glUniform1i(shader->uWidthAdr, maskW);
 	glUniform1i(shader->uHeightAdr, maskH);
 
 	// Render from camera frame source to blobMask
+	PROFILE_BEGIN(passDetect);
+	blobMask->setRegions(maskROIs);
 	blobMask->setTarget();
-	SSQuad->draw();
+	blobMask->draw(SSQuad);
+	PROFILE_END(passDetect);
 
 	// Encode binary blob flag in source alpha into regions of full color
 	// Each region is 4x4 and stores 4bit per channel in 4 channels
+	PROFILE_BEGIN(passEncode);
 	shaderESBlobEncode->use();
 	blobMask->setSource(shaderESBlobEncode, 0);
+#ifdef USE_READ_PIXELS
+	blobMap->setRegions(mapROIs);
 	blobMap->setTarget();
-	SSQuad->draw();
+	blobMap->draw(SSQuad);
+	blobCaptureUS = captureUS;
+#else
+	blobMap->writeTarget()->setRegions(mapROIs);
+	blobMap->writeTarget()->setTarget();
+	blobMap->writeTarget()->draw(SSQuad);
+	// Fence the slot so it can be read back once finished
+	blobMap->submit();
+	blobMapCaptureUS.push_back(captureUS);
+	if (blobMapCaptureUS.size() > blobMapDepth)
+		blobMapCaptureUS.pop_front();
+#endif
+	PROFILE_END(passEncode);
 }
 
 /*
  * Reads back blobMap from the GPU into the specified buffer, ready for analysation on the CPU
+ * Without USE_READ_PIXELS, the regions are those of the frame submitted readbackDepth-1 frames ago
  */
 void performBlobDetectionRegionsFetch()
 {
@@ -213,14 +281,21 @@ void performBlobDetectionRegionsFetch()
 
 	blobRegions.clear();
 
+	PROFILE_BEGIN(passReadback);
 #ifdef USE_READ_PIXELS
 	// Read back encoded regions map from GPU memory
 	glReadPixels(0, 0, mapW/2, mapH, GL_RGBA, GL_UNSIGNED_BYTE, blobMapRegions);
 #else
-	// Wait for current GL operations to finish
-	glFinish();
-	// Lock the blobMap shared memory so CPU can access it
+	// Lock the oldest slot of the blobMap ring so CPU can access it, only waits if the GPU is still behind
 	blobMapRegions = (BlobMapRegion*)blobMap->lock();
+	if (!blobMapRegions)
+	{ // Ring not filled yet
+		blobCaptureUS = 0;
+		PROFILE_END(passReadback);
+		return;
+	}
+	// Oldest slot of the ring, so the oldest capture time
+	blobCaptureUS = blobMapCaptureUS.front();
 	bufW = blobMap->bufferWidth*2;
 	bufH = blobMap->bufferHeight;
 #endif
@@ -253,6 +328,16 @@ void performBlobDetectionRegionsFetch()
 #ifndef USE_READ_PIXELS
 	blobMap->unlock();
 #endif
+	PROFILE_END(passReadback);
+}
+
+/*
+ * Returns the capture time of the frame the regions were last read back from, lagging readbackDepth-1 frames behind the current one
+ * 0 while the readback ring is still filling or if the camera provides no capture time
+ */
+uint64_t getBlobDetectionCaptureUS()
+{
+	return blobCaptureUS;
 }
 
 /*
@@ -260,6 +345,7 @@ void performBlobDetectionRegionsFetch()
  */
 void performBlobDetectionCPU(std::vector<Cluster> &blobs)
 {
+	PROFILE_BEGIN(passLabeling);
 	blobCompMerge[0] = 0;
 
 	uint8_t compNum = 0; // Number of final components
@@ -411,6 +497,44 @@ void performBlobDetectionCPU(std::vector<Cluster> &blobs)
 		std::cout << "Cluster " << i << " had size " << cluster->centroid.S << " around " << cluster->centroid.X << " / " << cluster->centroid.Y << " with " << cluster->dots.size() << " dots!\n";
 #endif
 	}
+	PROFILE_END(passLabeling);
+}
+
+/*
+ * Registers the blob detection passes with the profiler, which will time them from now on
+ */
+void setBlobDetectionProfiler(Profiler *blobProfiler)
+{
+	profiler = blobProfiler;
+	if (!profiler) return;
+	passDetect = profiler->addPass("detect", true);
+	passEncode = profiler->addPass("encode", true);
+	passReadback = profiler->addPass("readback", false);
+	passLabeling = profiler->addPass("labeling", false);
+}
+
+/*
+ * Restricts the GPU passes to the given regions in camera pixels (max exclusive), empty for the full frame
+ * Outside of the regions, no blobs will be detected
+ */
+void setBlobDetectionROI(const std::vector<Bounds> &rois)
+{
+	blobROIs.clear();
+	maskROIs.clear();
+	mapROIs.clear();
+	for (int i = 0; i < rois.size(); i++)
+	{
+		// Align outwards to the 8x4 pixels encoded in one blobMap pixel
+		Bounds b;
+		b.minX = std::max(0, rois[i].minX / 8 * 8);
+		b.minY = std::max(0, rois[i].minY / 4 * 4);
+		b.maxX = std::min(maskW, (rois[i].maxX + 7) / 8 * 8);
+		b.maxY = std::min(maskH, (rois[i].maxY + 3) / 4 * 4);
+		if (b.maxX <= b.minX || b.maxY <= b.minY) continue;
+		blobROIs.push_back(b);
+		maskROIs.push_back({ b.minX, b.minY, b.maxX-b.minX, b.maxY-b.minY });
+		mapROIs.push_back({ b.minX/8, b.minY/4, (b.maxX-b.minX)/8, (b.maxY-b.minY)/4 });
+	}
 }
 
 /*
@@ -425,7 +549,24 @@ void visualizeBlobDetection(const std::vector<Cluster> &blobs, Bounds viewBounds
 	glUniform1i(glGetUniformLocation(shaderESBlobViz->ID, "minY"), viewBounds.minY);
 	glUniform1i(glGetUniformLocation(shaderESBlobViz->ID, "maxX"), viewBounds.maxX);
 	glUniform1i(glGetUniformLocation(shaderESBlobViz->ID, "maxY"), viewBounds.maxY);
-	SSQuad->draw();
+	if (blobROIs.empty())
+		SSQuad->draw();
+	else
+	{ // Map regions from camera pixels through the view bounds into the current viewport
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		float scaleX = (float)viewport[2] / (viewBounds.maxX-viewBounds.minX);
+		float scaleY = (float)viewport[3] / (viewBounds.maxY-viewBounds.minY);
+		std::vector<ROI> vizROIs(blobROIs.size());
+		for (int i = 0; i < blobROIs.size(); i++)
+		{
+			vizROIs[i].x = viewport[0] + (int)std::floor((blobROIs[i].minX - viewBounds.minX) * scaleX);
+			vizROIs[i].y = viewport[1] + (int)std::floor((blobROIs[i].minY - viewBounds.minY) * scaleY);
+			vizROIs[i].width = (int)std::ceil((blobROIs[i].maxX - blobROIs[i].minX) * scaleX);
+			vizROIs[i].height = (int)std::ceil((blobROIs[i].maxY - blobROIs[i].minY) * scaleY);
+		}
+		drawRegions(SSQuad, vizROIs);
+	}
 
 	// Visualize detected blobs
 	std::vector<Point> vizPoints;
@@ -483,6 +624,7 @@ void cleanBlobDetection()
 	// Shaders
 	delete shaderESBlobDetectRGB;
 	delete shaderESBlobDetectY;
+	delete shaderESBlobDetectYTex;
 	delete shaderESBlobDetectYUV;
 	delete shaderESBlobEncode;
 	delete shaderESBlobViz;
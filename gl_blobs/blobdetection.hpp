@@ -3,6 +3,7 @@
 
 #include "camGL.h"
 #include "eglUtil.h"
+#include "profiler.hpp"
 
 #include <vector>
 
@@ -56,11 +57,17 @@ typedef struct Color
 
 /* Functions */
 
-void initBlobDetection (int width, int height, EGL_Setup eglSetup);
+// readbackDepth: Number of blob map buffers read back in rotation, results lag readbackDepth-1 frames behind
+// visualize: Whether visualizeBlobDetection is used, else the mask is stored in the most compact format
+void initBlobDetection (int width, int height, EGL_Setup eglSetup, int readbackDepth = 2, bool visualize = true);
 void performBlobDetection(CamGL_Frame *frame, std::vector<Cluster> &blobs);
 void performBlobDetectionGPU(CamGL_Frame *frame);
+void performBlobDetectionTexture(GLuint textureY, uint64_t captureUS, std::vector<Cluster> &blobs);
 void performBlobDetectionRegionsFetch();
 void performBlobDetectionCPU(std::vector<Cluster> &blobs);
+uint64_t getBlobDetectionCaptureUS();
+void setBlobDetectionROI(const std::vector<Bounds> &rois);
+void setBlobDetectionProfiler(Profiler *profiler);
 void visualizeBlobDetection(const std::vector<Cluster> &blobs, Bounds viewBounds, float pixelDensity);
 void blobColorLookup (const std::vector<Point> &points, std::vector<Color> &colors);
 void cleanBlobDetection();
@@ -51,5 +51,5 @@ void main()
     float isPoint = testLE(maxOuter, value*2.0) * testLE(maxInner, value*1.5) * testLE(0.2, value);
     //float isPoint = testLE(maxOuter, value*1.00001) * testLE(maxInner, value*1.000001) * testLE(0.25, value);
     
-    gl_FragColor = vec4(color.rgb, isPoint);
+    gl_FragColor = PACK_MASK(color.rgb, isPoint);
 }
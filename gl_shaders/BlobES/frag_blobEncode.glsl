@@ -10,7 +10,7 @@ uniform int height;
 
 varying vec2 uv;
 
-// Expects: Blobiness in image alpha (1 or 0)
+// Expects: Blobiness in image mask channel (1 or 0), see layout.glsl
 // Encodes binary mask in 8 bits per component for a 8x4 region (kernel)
 void main()
 {
@@ -26,7 +26,7 @@ void main()
         {
             for (int y = 0; y < 4; y++) 
             {
-                component = component * 2 + int(texture2D(image, uvS + float(c*2+x)*dX + float(y)*dY).a);
+                component = component * 2 + int(UNPACK_MASK(texture2D(image, uvS + float(c*2+x)*dX + float(y)*dY)) + 0.5);
             }
         }
         // Encode float[0-1] <=> 8bit integer[0-255]
@@ -15,7 +15,7 @@ varying vec2 uv;
 
 float grayscale(vec2 uvCoord)
 {
-    vec3 color = vec3(texture2D(image, uvCoord));
+    vec3 color = UNPACK_COLOR(texture2D(image, uvCoord));
     return (color.r + color.g + color.b) / 3.0;
 }
 float maxVal(vec2 uv1, vec2 uv2, vec2 uv3, vec2 uv4) 
@@ -35,9 +35,9 @@ void main()
         (uv.y*float(maxY-minY) + float(minY)) / float(height));
 
     vec4 tex = texture2D(image, t);
-    vec3 color = tex.rgb;
+    vec3 color = UNPACK_COLOR(tex);
     float grsc = (color.r+color.g+color.b)/3.0;
-    float value = tex.a;
+    float value = UNPACK_MASK(tex);
     
     float maxPlus = maxVal(t + 1.0*dX, t - 1.0*dX, t + 1.0*dY, t - 1.0*dY);
     float maxCross = maxVal(t + 1.0*dX + 1.0*dY, t - 1.0*dX + 1.0*dY, t - 1.0*dX - 1.0*dY, t + 1.0*dX - 1.0*dY);
@@ -0,0 +1,14 @@
+// Packing of the blob mask target, selected by the LAYOUT_* define of its negotiated format (see gl/texture.hpp)
+#if defined(LAYOUT_RED_MASK)
+#define PACK_MASK(color, mask) vec4(mask, vec2(dot(color, vec3(1.0/3.0))), 1.0)
+#define UNPACK_MASK(texel) (texel).r
+#define UNPACK_COLOR(texel) (texel).ggg
+#elif defined(LAYOUT_GRAY_ALPHA)
+#define PACK_MASK(color, mask) vec4(vec3(dot(color, vec3(1.0/3.0))), mask)
+#define UNPACK_MASK(texel) (texel).a
+#define UNPACK_COLOR(texel) (texel).rgb
+#else
+#define PACK_MASK(color, mask) vec4(color, mask)
+#define UNPACK_MASK(texel) (texel).a
+#define UNPACK_COLOR(texel) (texel).rgb
+#endif
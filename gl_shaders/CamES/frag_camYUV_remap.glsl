@@ -0,0 +1,34 @@
+#version 100
+#extension GL_OES_EGL_image_external : require
+
+precision mediump float;
+
+uniform samplerExternalOES imageY;
+uniform samplerExternalOES imageU;
+uniform samplerExternalOES imageV;
+
+// Lens remap texture, RG hold the displacement to the frame UV, A whether it maps into the frame
+uniform sampler2D remap;
+uniform float remapRange;
+uniform vec2 remapCoord;
+
+varying vec2 uv;
+
+void main()
+{
+	vec4 remapped = texture2D(remap, uv * remapCoord.x + remapCoord.y);
+	vec2 src = uv + (remapped.rg * 2.0 - 1.0) * remapRange;
+	if (remapped.a < 0.5 || src.x < 0.0 || src.y < 0.0 || src.x > 1.0 || src.y > 1.0)
+	{
+		gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);
+		return;
+	}
+
+	float value = texture2D(imageY, src).r;
+	float y = 1.1643 * (value - 0.0625);
+	float u = texture2D(imageU, src).r - 0.5;
+	float v = texture2D(imageV, src).r - 0.5;
+	vec3 color = vec3(y + 1.5958*v, y - 0.39173*u - 0.81290*v, y + 2.017*u);
+
+	gl_FragColor = vec4(color.rgb, 1.0);
+}
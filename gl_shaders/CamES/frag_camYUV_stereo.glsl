@@ -0,0 +1,38 @@
+#version 100
+#extension GL_OES_EGL_image_external : require
+
+precision mediump float;
+
+// Left eye camera
+uniform samplerExternalOES imageY0;
+uniform samplerExternalOES imageU0;
+uniform samplerExternalOES imageV0;
+// Right eye camera
+uniform samplerExternalOES imageY1;
+uniform samplerExternalOES imageU1;
+uniform samplerExternalOES imageV1;
+
+varying vec2 uv;
+varying float eye;
+
+void main()
+{
+	// Branch is coherent except along the seam between both eyes
+	float value, u, v;
+	if (eye < 0.5)
+	{
+		value = texture2D(imageY0, uv).r;
+		u = texture2D(imageU0, uv).r - 0.5;
+		v = texture2D(imageV0, uv).r - 0.5;
+	}
+	else
+	{
+		value = texture2D(imageY1, uv).r;
+		u = texture2D(imageU1, uv).r - 0.5;
+		v = texture2D(imageV1, uv).r - 0.5;
+	}
+	float y = 1.1643 * (value - 0.0625);
+	vec3 color = vec3(y + 1.5958*v, y - 0.39173*u - 0.81290*v, y + 2.017*u);
+
+	gl_FragColor = vec4(color.rgb, 1.0);
+}
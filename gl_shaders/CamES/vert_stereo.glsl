@@ -0,0 +1,14 @@
+#version 100
+
+attribute vec3 vPos;
+attribute vec2 vTex;
+
+varying vec2 uv;
+varying float eye;
+
+void main()
+{
+    gl_Position = vec4(vPos.xy, 0.0, 1.0);
+    eye = vPos.z;
+    uv = vTex;
+}
@@ -0,0 +1,13 @@
+#version 100
+
+precision mediump float;
+
+uniform sampler2D atlas;
+
+varying vec3 col;
+varying vec2 uv;
+
+void main()
+{
+    gl_FragColor = vec4(col, texture2D(atlas, uv).a);
+}
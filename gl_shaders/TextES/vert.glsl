@@ -0,0 +1,15 @@
+#version 100
+
+attribute vec3 vPos;
+attribute vec3 vCol;
+attribute vec2 vTex;
+
+varying vec3 col;
+varying vec2 uv;
+
+void main()
+{
+    gl_Position = vec4(vPos.xy, 0.0, 1.0);
+	col = vCol;
+	uv = vTex;
+}
@@ -18,6 +18,11 @@
 #include "mesh.hpp"
 #include "shader.hpp"
 #include "texture.hpp"
+#include "profiler.hpp"
+#include "lens.hpp"
+#include "overlay.hpp"
+#include "present.hpp"
+#include "latency.h"
 
 #include <math.h>
 
@@ -30,6 +35,18 @@ CamGL *camGL1;
 int dispWidth, dispHeight;
 int camWidth = 1280, camHeight = 720, camFPS = 30;
 float renderRatioCorrection;
+int profileInterval = 0;
+const char *profileCSV = NULL;
+const char *lensFile = NULL;
+const char *lensCacheDir = ".";
+float lensTolerance = 0.5f;
+bool lensRemap = false;
+bool perEyeDraws = false;
+int syncToleranceUS = 0; // Max capture time difference of a stereo pair, 0 for half a frame interval
+int maxStalledSeconds = 10; // Consecutive seconds without a stereo pair before giving up on the cameras
+PresentPolicy present;
+// Viewport of each eye, side by side on the display
+int eyeWidth, eyeHeight;
 
 std::string heart_rate;
 std::string body_temp;
@@ -37,8 +54,13 @@ std::string helmet_temp;
 
 EGL_Setup eglSetup;
 Mesh *SSQuad;
-ShaderProgram *shaderCamBlitRGB, *shaderCamBlitY, *shaderCamBlitYUV;
+Mesh *lensMesh[2], *stereoMesh;
+LensRemapTexture *lensTex[2];
+TextOverlay *overlay;
+int telemetryLine;
+ShaderProgram *shaderCamBlitRGB, *shaderCamBlitY, *shaderCamBlitYUV, *shaderCamRemapYUV, *shaderCamStereoYUV;
 int texRGBAdr, texYAdrY, texYUVAdrY, texYUVAdrU, texYUVAdrV;
+int texStereoAdrY[2], texStereoAdrU[2], texStereoAdrV[2];
 
 struct termios terminalSettings;
 
@@ -74,7 +96,7 @@ int main(int argc, char **argv)
 	};
 	
 	int arg;
-	while ((arg = getopt(argc, argv, "c:w:h:f:s:i:n:")) != -1)
+	while ((arg = getopt(argc, argv, "c:w:h:f:s:i:n:p:o:l:e:d:mEv:y:")) != -1)
 	{
 		switch (arg)
 		{
@@ -101,13 +123,41 @@ int main(int argc, char **argv)
 			case 'n':
 				params.camera_num = std::stoi(optarg);
 				break;
+			case 'p':
+				profileInterval = std::stoi(optarg);
+				break;
+			case 'o':
+				profileCSV = optarg;
+				break;
+			case 'l':
+				lensFile = optarg;
+				break;
+			case 'e':
+				lensTolerance = std::stof(optarg);
+				break;
+			case 'd':
+				lensCacheDir = optarg;
+				break;
+			case 'm':
+				lensRemap = true;
+				break;
+			case 'E':
+				perEyeDraws = true;
+				break;
+			case 'v':
+				if (!present.parse(optarg))
+					printf("Unknown present policy %s (all, N, Rhz, key)!\n", optarg);
+				break;
+			case 'y':
+				syncToleranceUS = std::stoi(optarg);
+				break;
 			default:
-				printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-n camera-num] \n", argv[0]);
+				printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-n camera-num] [-p profile-interval] [-o profile-csv] [-l lens-file] [-e lens-tolerance-px] [-d lens-cache-dir] [-m lens-remap-texture] [-E per-eye-draws] [-v present (all, N, Rhz, key)] [-y stereo-sync-tolerance-us]\n", argv[0]);
 				break;
 		}
 	}
 	if (optind < argc - 1)
-		printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-n camera-num] \n", argv[0]);
+		printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-n camera-num] [-p profile-interval] [-o profile-csv] [-l lens-file] [-e lens-tolerance-px] [-d lens-cache-dir] [-m lens-remap-texture] [-E per-eye-draws] [-v present (all, N, Rhz, key)] [-y stereo-sync-tolerance-us]\n", argv[0]);
 
 	// ---- Init ----
 
@@ -120,79 +170,101 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	dispWidth = window.width;
 	dispHeight = window.height;
+	eyeWidth = dispWidth / 2;
+	eyeHeight = dispHeight;
 	renderRatioCorrection = (((float)dispHeight / camHeight) * camWidth) / dispWidth;  
 
 	// Setup EGL context
 	setupEGL(&eglSetup, (EGLNativeWindowType*)&window);
+	// Presenting only some frames should never block processing on the display
+	if (present.mode != PRESENT_ALWAYS)
+		eglSwapInterval(eglSetup.display, 0);
 	glClearColor(0.8f, 0.2f, 0.1f, 1.0f);
 	
 	std::cout << "Camera Number " << params.camera_num << "\n";
 
 	// ---- Setup GL Resources ----
-	std::vector<float> vertices; 
-	std::vector<unsigned short> indices;
-    
-	float N = 100;
-        float z = 0;
-    
-        for (float x = -1, a = 0; x <= 1, a <= 1; x+= 2/N, a += 1/N)
-        {
-        	for (float y = -1, b = 0; y <= 1, b <= 1; y+= 2/N, b+= 1/N)
-        	{
-			float theta = atan2(y, x);
-			float r = sqrt(x*x + y*y);
-			r = r -0.15*pow(r, 3.0) + 0.01*pow(r, 5.0);
-			vertices.push_back(r*cos(theta));
-			vertices.push_back(r*sin(theta));
-			//vertices.push_back(x);
-			//vertices.push_back(y);
-			vertices.push_back(z);
-			vertices.push_back(a);
-			vertices.push_back(b);
-        	}
-        }
-	 
-	for (int x = 0; x < N; x++)
-        {
-        	for (int z = 0; z < N; z++)
-        	{
-			int offset = x * (N+1) + z;
-            		indices.push_back((short)(offset+0));
-            		indices.push_back((short)(offset+1));
-            		indices.push_back((short)(offset+ (N+1) + 1));
-            		indices.push_back((short)(offset+0));
-            		indices.push_back((short)(offset+ (N+1)));
-            		indices.push_back((short)(offset+ (N+1) + 1));
-        	}
-    	}
-    
-    	//Debugging info, will print out the indices, vertices, and how many of each there are
-   
-    	//unsigned int indicesCount = indices.size();
-    	//unsigned int verticesCount = vertices.size();
-        
-    	//for (auto i: indices)
-		//std::cout << i << ' ';
-    
-    	//for (auto i: vertices)
-		//std::cout << i << ' ';
-		
-	//std::cout << '\n' << verticesCount << '\n';
-	//std::cout << '\n' << indicesCount << '\n';
-	
-	SSQuad = new Mesh ({ POS, TEX }, vertices, indices);
+
+	// Lens calibration, one set per eye
+	std::vector<LensParams> lenses = { defaultLens };
+	if (lensFile && !loadLensParams(lensFile, lenses))
+		printf("Falling back to default lens parameters!\n");
+	if (lenses.size() < 2)
+		lenses.push_back(lenses[0]);
+
+	// Undistortion either as distorted mesh or as remap texture on a plain quad
+	// Meshes of both eyes are merged to draw them in a single pass, the remap texture falls back to per-eye draws
+	if (lensRemap) perEyeDraws = true;
+	SSQuad = new Mesh ({ POS, TEX }, {
+		-1,  1, 0, 0, 1,
+		 1,  1, 0, 1, 1,
+		-1, -1, 0, 0, 0,
+		 1,  1, 0, 1, 1,
+		 1, -1, 0, 1, 0,
+		-1, -1, 0, 0, 0,
+	}, {});
+	stereoMesh = NULL;
+	for (int e = 0; e < 2; e++)
+	{
+		lensMesh[e] = NULL;
+		lensTex[e] = NULL;
+	}
+	if (!perEyeDraws)
+		stereoMesh = createStereoLensMesh(lenses.data(), eyeWidth, eyeHeight, lensTolerance, lensCacheDir);
+	for (int e = 0; e < 2 && perEyeDraws; e++)
+	{
+		if (lensRemap)
+			lensTex[e] = new LensRemapTexture(lenses[e], eyeWidth, eyeHeight, lensTolerance, lensCacheDir);
+		else
+			lensMesh[e] = createLensMesh(lenses[e], eyeWidth, eyeHeight, lensTolerance, lensCacheDir);
+	}
+	CHECK_GL();
+
+	// Telemetry text drawn on top of the left eye
+	overlay = new TextOverlay(dispWidth, dispHeight);
+	telemetryLine = overlay->addLine(eyeWidth/2, eyeHeight/4, 2, TEXT_CENTER);
+	overlay->setBackground(telemetryLine, true, 0.1f, 0.1f, 0.1f);
+	CHECK_GL();
 
 	// Load shaders
 	shaderCamBlitRGB = new ShaderProgram("../gl_shaders/CamES/vert.glsl", "../gl_shaders/CamES/frag_camRGB.glsl");
 	shaderCamBlitY = new ShaderProgram("../gl_shaders/CamES/vert.glsl", "../gl_shaders/CamES/frag_camY.glsl");
 	shaderCamBlitYUV = new ShaderProgram("../gl_shaders/CamES/vert.glsl", "../gl_shaders/CamES/frag_camYUV.glsl");
+	shaderCamRemapYUV = new ShaderProgram("../gl_shaders/CamES/vert.glsl", "../gl_shaders/CamES/frag_camYUV_remap.glsl");
+	shaderCamStereoYUV = new ShaderProgram("../gl_shaders/CamES/vert_stereo.glsl", "../gl_shaders/CamES/frag_camYUV_stereo.glsl");
 	
 	// Load shader uniform adresses
 	texRGBAdr = glGetUniformLocation(shaderCamBlitRGB->ID, "image");
 	texYAdrY = glGetUniformLocation(shaderCamBlitY->ID, "imageY");
-	texYUVAdrY = glGetUniformLocation(shaderCamBlitYUV->ID, "imageY");
-	texYUVAdrU = glGetUniformLocation(shaderCamBlitYUV->ID, "imageU");
-	texYUVAdrV = glGetUniformLocation(shaderCamBlitYUV->ID, "imageV");
+	ShaderProgram *shaderYUV = lensRemap? shaderCamRemapYUV : shaderCamBlitYUV;
+	texYUVAdrY = glGetUniformLocation(shaderYUV->ID, "imageY");
+	texYUVAdrU = glGetUniformLocation(shaderYUV->ID, "imageU");
+	texYUVAdrV = glGetUniformLocation(shaderYUV->ID, "imageV");
+	for (int e = 0; e < 2; e++)
+	{
+		texStereoAdrY[e] = glGetUniformLocation(shaderCamStereoYUV->ID, e == 0? "imageY0" : "imageY1");
+		texStereoAdrU[e] = glGetUniformLocation(shaderCamStereoYUV->ID, e == 0? "imageU0" : "imageU1");
+		texStereoAdrV[e] = glGetUniformLocation(shaderCamStereoYUV->ID, e == 0? "imageV0" : "imageV1");
+	}
+
+	// Per-pass timings, sampled every profileInterval frames
+	Profiler *profiler = NULL;
+	int passCamera, passDraw, passOverlay, passSwap;
+	if (profileInterval > 0 || profileCSV)
+	{
+		profiler = new Profiler(profileInterval > 0? profileInterval : 10);
+		passCamera = profiler->addPass("camera", false);
+		passDraw = profiler->addPass("draw", true);
+		passOverlay = profiler->addPass("overlay", true);
+		passSwap = profiler->addPass("swap", true);
+	}
+
+	// Sensor-to-display latency of both eyes
+	LatencyTracker *latency = latency_create();
+	int stageLeft = latency_addStage(latency, "left-presented");
+	int stageRight = latency_addStage(latency, "right-presented");
+	int droppedFrames = 0;
+	StereoCapture *stereo = NULL;
 
 	// ---- Setup Camera ----
 
@@ -236,10 +308,40 @@ int main(int argc, char **argv)
 			// Get handle to frame struct, stays the same when frames are updated
 			CamGL_Frame *frame = camGL_getFrame(camGL);
 			CamGL_Frame *frame1 = camGL_getFrame(camGL1);
+
+			// Pair frames of both cameras captured at the same time, so a stall of one does not desync the eyes
+			if (syncToleranceUS <= 0)
+				syncToleranceUS = 500000 / camFPS;
+			stereo = stereo_create(camGL_getGCS(camGL), camGL_getGCS(camGL1), syncToleranceUS);
+			int stalledSeconds = 0;
 			
-			while ((status = camGL_nextFrame(camGL)) == CAMGL_SUCCESS)
-			{// Frames was available and has been processed
-				
+			while (true)
+			{
+				if (profiler) profiler->nextFrame();
+				if (profiler) profiler->begin(passCamera);
+				status = camGL_nextFramePair(camGL, camGL1, stereo, 1000);
+				if (profiler) profiler->end(passCamera);
+				if (status == CAMGL_NO_FRAMES)
+				{ // No pair within a second, one camera stalled or they are out of sync
+					printf("No matching stereo frames! \n");
+					char cin;
+					if (read(STDIN_FILENO, &cin, 1) == 1 && cin == 'q')
+					{ // Still allow to quit while waiting
+						status = CAMGL_SUCCESS;
+						break;
+					}
+					if (++stalledSeconds >= maxStalledSeconds)
+					{
+						printf("No stereo frames for %d seconds, stopping! \n", stalledSeconds);
+						break;
+					}
+					continue;
+				}
+				if (status != CAMGL_SUCCESS)
+					break;
+				stalledSeconds = 0;
+				// Frames were available and have been processed
+
 				////Read the Serial port
 				fcntl(fd, F_SETFL, FNDELAY);
 				char buff[64];
@@ -265,75 +367,107 @@ int main(int argc, char **argv)
 					}
 				}
 				
-				status1 = camGL_nextFrame(camGL1);
-				if (status1 != CAMGL_SUCCESS)
-				{
-					break;
-				}
+				droppedFrames += frame->droppedFrames;
 
-				std::string left = "Heart Rate: " + heart_rate + ", Body Temp: " + body_temp + ", Helmet Temp: " + helmet_temp + "";
-				const char* left_eye = left.c_str();
+				// Only rebuilds the text geometry if the values changed
+				overlay->setText(telemetryLine, "Heart Rate: " + heart_rate + "\nBody Temp: " + body_temp + "\nHelmet Temp: " + helmet_temp);
+				if (present.shouldPresent())
+				{ // Frames not presented are still acquired at full rate
+					ShaderProgram *shader;
 				
-				std::string right = " ";
-				const char* right_eye = right.c_str();
-				
-				camGL_update_annotation(camGL, left_eye);
-				camGL_update_annotation(camGL1, right_eye);
-				ShaderProgram *shader;
-				
-				//Camera 1
-				//if (frame->format == CAMGL_RGB)
-				//{
-					//shader = shaderCamBlitRGB;
-					//shader->use();
-					//bindExternalTexture(texRGBAdr, frame->textureRGB, 0);
-				//}
-				//else if (frame->format == CAMGL_Y)
-				//{
-					//shader = shaderCamBlitY;
-					//shader->use();
-					//bindExternalTexture(texYAdrY, frame->textureY, 0);
-				//}
-				//else if (frame->format == CAMGL_YUV)
-				//{
-				shader = shaderCamBlitYUV;
-				shader->use();
-				bindExternalTexture(texYUVAdrY, frame->textureY, 0);
-				bindExternalTexture(texYUVAdrU, frame->textureU, 1);
-				bindExternalTexture(texYUVAdrV, frame->textureV, 2);
-				//}
+					if (profiler) profiler->begin(passDraw);
+					if (!perEyeDraws)
+					{ // Both eyes in a single pass, one shader samples both cameras
+						shader = shaderCamStereoYUV;
+						shader->use();
+						bindExternalTexture(texStereoAdrY[0], frame->textureY, 0);
+						bindExternalTexture(texStereoAdrU[0], frame->textureU, 1);
+						bindExternalTexture(texStereoAdrV[0], frame->textureV, 2);
+						bindExternalTexture(texStereoAdrY[1], frame1->textureY, 3);
+						bindExternalTexture(texStereoAdrU[1], frame1->textureU, 4);
+						bindExternalTexture(texStereoAdrV[1], frame1->textureV, 5);
+						glViewport(0, 0, dispWidth, dispHeight);
+						glBindFramebuffer(GL_FRAMEBUFFER, 0);
+						stereoMesh->draw();
+					}
+					else
+					{
+						//Camera 1
+						//if (frame->format == CAMGL_RGB)
+						//{
+							//shader = shaderCamBlitRGB;
+							//shader->use();
+							//bindExternalTexture(texRGBAdr, frame->textureRGB, 0);
+						//}
+						//else if (frame->format == CAMGL_Y)
+						//{
+							//shader = shaderCamBlitY;
+							//shader->use();
+							//bindExternalTexture(texYAdrY, frame->textureY, 0);
+						//}
+						//else if (frame->format == CAMGL_YUV)
+						//{
+						shader = lensRemap? shaderCamRemapYUV : shaderCamBlitYUV;
+						shader->use();
+						bindExternalTexture(texYUVAdrY, frame->textureY, 0);
+						bindExternalTexture(texYUVAdrU, frame->textureU, 1);
+						bindExternalTexture(texYUVAdrV, frame->textureV, 2);
+						//}
 				
-				//glViewport((int)((1-renderRatioCorrection) * dispWidth / 2), 0, (int)(renderRatioCorrection * dispWidth), dispHeight);
-				glViewport(0, 0, 960, 1080);
-				SSQuad->draw();
+						//glViewport((int)((1-renderRatioCorrection) * dispWidth / 2), 0, (int)(renderRatioCorrection * dispWidth), dispHeight);
+						glViewport(0, 0, eyeWidth, eyeHeight);
+						if (lensRemap)
+						{
+							lensTex[0]->setSource(shader, 3);
+							SSQuad->draw();
+						}
+						else
+							lensMesh[0]->draw();
 				
-				//Camera 2
-				//if (frame1->format == CAMGL_RGB)
-				//{
-					//shader = shaderCamBlitRGB;
-					//shader->use();
-					//bindExternalTexture(texRGBAdr, frame1->textureRGB, 0);
-				//}
-				//else if (frame1->format == CAMGL_Y)
-				//{
-					//shader = shaderCamBlitY;
-					//shader->use();
-					//bindExternalTexture(texYAdrY, frame1->textureY, 0);
-				//}
-				//else if (frame1->format == CAMGL_YUV)
-				//{
-				//shader = shaderCamBlitYUV;
-				//shader->use();
-				bindExternalTexture(texYUVAdrY, frame1->textureY, 0);
-				bindExternalTexture(texYUVAdrU, frame1->textureU, 1);
-				bindExternalTexture(texYUVAdrV, frame1->textureV, 2);
-				//}				
+						//Camera 2
+						//if (frame1->format == CAMGL_RGB)
+						//{
+							//shader = shaderCamBlitRGB;
+							//shader->use();
+							//bindExternalTexture(texRGBAdr, frame1->textureRGB, 0);
+						//}
+						//else if (frame1->format == CAMGL_Y)
+						//{
+							//shader = shaderCamBlitY;
+							//shader->use();
+							//bindExternalTexture(texYAdrY, frame1->textureY, 0);
+						//}
+						//else if (frame1->format == CAMGL_YUV)
+						//{
+						//shader = shaderCamBlitYUV;
+						//shader->use();
+						bindExternalTexture(texYUVAdrY, frame1->textureY, 0);
+						bindExternalTexture(texYUVAdrU, frame1->textureU, 1);
+						bindExternalTexture(texYUVAdrV, frame1->textureV, 2);
+						//}				
 					
-				glViewport(960, 0, 960, 1080);
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-				SSQuad->draw();
+						glViewport(eyeWidth, 0, eyeWidth, eyeHeight);
+						glBindFramebuffer(GL_FRAMEBUFFER, 0);
+						if (lensRemap)
+						{
+							lensTex[1]->setSource(shader, 3);
+							SSQuad->draw();
+						}
+						else
+							lensMesh[1]->draw();
+					}
+					if (profiler) profiler->end(passDraw);
+
+					if (profiler) profiler->begin(passOverlay);
+					overlay->draw();
+					if (profiler) profiler->end(passOverlay);
 					
-				eglSwapBuffers(eglSetup.display, eglSetup.surface); 
+					if (profiler) profiler->begin(passSwap);
+					eglSwapBuffers(eglSetup.display, eglSetup.surface); 
+					if (profiler) profiler->end(passSwap);
+					latency_stamp(latency, stageLeft, frame->captureUS);
+					latency_stamp(latency, stageRight, frame1->captureUS);
+				}
 
 
 				// ---- Debugging and Statistics ----
@@ -348,8 +482,11 @@ int main(int argc, char **argv)
 					int frames = (numFrames - lastFrames);
 					lastFrames = numFrames;
 					float fps = frames / elapsedS;
-					int droppedFrames = 0;
-					printf("%d frames over %.2fs (%.1ffps)! \n", frames, elapsedS, fps);
+					StereoStats stereoStats;
+					stereo_getStats(stereo, &stereoStats);
+					printf("%d frames over %.2fs (%.1ffps), %d dropped! Stereo skew mean %dus, max %dus, skipped %d/%d \n", frames, elapsedS, fps, droppedFrames,
+						stereoStats.pairs? (int)(stereoStats.sumSkewUS / stereoStats.pairs) : 0, stereoStats.maxSkewUS, stereoStats.skipped[0], stereoStats.skipped[1]);
+					droppedFrames = 0;
 				}
 				if (numFrames % 10 == 0)
 				{ // Check for keys
@@ -358,6 +495,9 @@ int main(int argc, char **argv)
 					{
 						if (iscntrl(cin)) printf("%d", cin);
 						else if (cin == 'q') break;
+						else if (cin == 'p' && profiler) profiler->log(std::cout);
+						else if (cin == 't') latency_log(latency, stdout);
+						else if (cin == 'v') present.toggleFlag();
 						else printf("%c", cin);
 					}
 
@@ -370,9 +510,18 @@ int main(int argc, char **argv)
 			else
 				camGL_stopCamera(camGL);
 				camGL_stopCamera(camGL1);
+			latency_log(latency, stdout);
+			if (profiler)
+			{
+				profiler->log(std::cout);
+				if (profileCSV && !profiler->writeCSV(profileCSV))
+					printf("Failed to write profile to %s!\n", profileCSV);
+			}
 		}
+		stereo_destroy(stereo);
 		camGL_destroy(camGL);
 		camGL_destroy(camGL1);
+		latency_destroy(latency);
 		terminateEGL(&eglSetup);
 
 		return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
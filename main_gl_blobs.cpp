@@ -11,6 +11,7 @@
 #include <vector>
 #include <chrono>
 #include <termios.h>
+#include <iostream>
 
 #include "applog.h"
 
@@ -23,6 +24,10 @@
 #include "mesh.hpp"
 #include "shader.hpp"
 #include "texture.hpp"
+#include "profiler.hpp"
+#include "present.hpp"
+#include "latency.h"
+#include "synth.h"
 
 #include "blobdetection.hpp"
 
@@ -30,6 +35,13 @@ CamGL *camGL;
 int dispWidth, dispHeight;
 int camWidth = 1280, camHeight = 720, camFPS = 30;
 float renderRatioCorrection;
+int readbackDepth = 2;
+bool trackROI = false;
+bool headless = false;
+int profileInterval = 0;
+const char *profileCSV = NULL;
+int synthFrames = 0; // Benchmark on this many synthetic frames against their ground truth instead of the camera
+PresentPolicy present;
 
 EGL_Setup eglSetup;
 
@@ -37,6 +49,7 @@ struct termios terminalSettings;
 
 static void setConsoleRawMode();
 static void processCameraFrame(CamGL_Frame *frame);
+static int runSynthBenchmark(Profiler *profiler);
 
 int main(int argc, char **argv)
 {
@@ -52,7 +65,7 @@ int main(int argc, char **argv)
 	};
 
 	int arg;
-	while ((arg = getopt(argc, argv, "c:w:h:f:s:i:")) != -1)
+	while ((arg = getopt(argc, argv, "c:w:h:f:s:i:r:txp:o:v:b:q:g:")) != -1)
 	{
 		switch (arg)
 		{
@@ -76,41 +89,115 @@ int main(int argc, char **argv)
 			case 'f':
 				params.fps = camFPS = std::stoi(optarg);
 				break;
+			case 'r':
+				readbackDepth = std::stoi(optarg);
+				break;
+			case 't':
+				trackROI = true;
+				break;
+			case 'x':
+				headless = true;
+				break;
+			case 'p':
+				profileInterval = std::stoi(optarg);
+				break;
+			case 'o':
+				profileCSV = optarg;
+				break;
+			case 'v':
+				if (!present.parse(optarg))
+					printf("Unknown present policy %s (all, N, Rhz, key)!\n", optarg);
+				break;
+			case 'b':
+				params.bufferCount = std::stoi(optarg);
+				break;
+			case 'q':
+				params.framePolicy = GCS_FRAME_FIFO;
+				params.queueDepth = std::stoi(optarg);
+				break;
+			case 'g':
+				synthFrames = std::stoi(optarg);
+				break;
 			default:
-				printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso]\n", argv[0]);
+				printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-r readback-depth] [-t track-roi] [-x headless] [-p profile-interval] [-o profile-csv] [-v present (all, N, Rhz, key)] [-b camera-buffers] [-q fifo-depth] [-g synthetic-benchmark-frames]\n", argv[0]);
 				break;
 		}
 	}
 	if (optind < argc - 1)
-		printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso]\n", argv[0]);
+		printf("Usage: %s [-c (RGB, Y, YUV)] [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-r readback-depth] [-t track-roi] [-x headless] [-p profile-interval] [-o profile-csv] [-v present (all, N, Rhz, key)] [-b camera-buffers] [-q fifo-depth] [-g synthetic-benchmark-frames]\n", argv[0]);
 	if (params.shutterSpeed > 5000)
 	{ 
 		printf("Blob detection requires low shutter speed (~8-1000ns) to detect LEDs only. Too many light sources will blow up the CPU-side algorithm for connected component labeling.\n"); // Increase MAX_COMPONENTS in blobdetection.cpp if you really want to try
 		params.shutterSpeed = 5000;
 	}
 
+	if (synthFrames > 0)
+	{ // Score the blobs of the same frame, not of one read back earlier
+		readbackDepth = 1;
+		trackROI = false;
+	}
+
 	// ---- Init ----
 
 	// Init BCM Host
 	bcm_host_init();
 
-	// Create native window (not real GUI window)
-	EGL_DISPMANX_WINDOW_T window;
-	if (createNativeWindow(&window) != 0)
-		return EXIT_FAILURE;
-	dispWidth = window.width;
-	dispHeight = window.height;
+	if (headless)
+	{ // Processing only, no display, compositor or swap involved
+		if (setupEGLHeadless(&eglSetup, 16, 16) != 0)
+			return EXIT_FAILURE;
+		dispWidth = 16;
+		dispHeight = 16;
+	}
+	else
+	{
+		// Create native window (not real GUI window)
+		EGL_DISPMANX_WINDOW_T window;
+		if (createNativeWindow(&window) != 0)
+			return EXIT_FAILURE;
+		dispWidth = window.width;
+		dispHeight = window.height;
+
+		// Setup EGL context
+		setupEGL(&eglSetup, (EGLNativeWindowType*)&window);
+		// Presenting only some frames should never block processing on the display
+		if (present.mode != PRESENT_ALWAYS)
+			eglSwapInterval(eglSetup.display, 0);
+	}
 	renderRatioCorrection = (((float)dispHeight / camHeight) * camWidth) / dispWidth;
-
-	// Setup EGL context
-	setupEGL(&eglSetup, (EGLNativeWindowType*)&window);
 	glClearColor(0.8f, 0.2f, 0.1f, 1.0f);
 
 	// ---- Setup GL Resources ----
 
-	initBlobDetection(camWidth, camHeight, eglSetup);
+	initBlobDetection(camWidth, camHeight, eglSetup, readbackDepth, !headless);
 	CHECK_GL();
 
+	// Per-pass timings, sampled every profileInterval frames
+	Profiler *profiler = NULL;
+	int passVisualize, passSwap;
+	if (profileInterval > 0 || profileCSV)
+	{
+		profiler = new Profiler(profileInterval > 0? profileInterval : 10);
+		setBlobDetectionProfiler(profiler);
+		passVisualize = profiler->addPass("visualize", true);
+		passSwap = profiler->addPass("swap", true);
+	}
+
+	// Sensor-to-result and sensor-to-display latency
+	LatencyTracker *latency = latency_create();
+	int stageDetect = latency_addStage(latency, "detected");
+	int stagePresent = latency_addStage(latency, "presented");
+
+	if (synthFrames > 0)
+	{ // Benchmark detection speed, recall and precision without a camera
+		int code = runSynthBenchmark(profiler);
+		if (profiler) profiler->log(std::cout);
+		cleanBlobDetection();
+		latency_destroy(latency);
+		terminateEGL(&eglSetup);
+		return code;
+	}
+
 	// ---- Setup Camera ----
 
 	// Init camera GL
@@ -141,54 +228,84 @@ int main(int argc, char **argv)
 
 			auto startTime = std::chrono::high_resolution_clock::now();
 			auto lastTime = startTime;
-			int numFrames = 0, lastFrames = 0;
+			int numFrames = 0, lastFrames = 0, droppedFrames = 0;
+			int zoom = 1; // Sensor crop zoom level
 
 			// Get handle to frame struct, stays the same when frames are updated
 			CamGL_Frame *frame = camGL_getFrame(camGL);
 			while ((status = camGL_nextFrame(camGL)) == CAMGL_SUCCESS)
 			{ // Frames was available and has been processed
 
+				if (profiler) profiler->nextFrame();
+				droppedFrames += frame->droppedFrames;
+
 				// ---- Perform blob detection ----
 
 				// Perform blob detection on frame and output results into both lists
 				std::vector<Cluster> blobs;
 				performBlobDetection(frame, blobs);
+				// Blobs are of the frame read back, readbackDepth-1 frames before this one
+				latency_stamp(latency, stageDetect, getBlobDetectionCaptureUS());
+
+				if (trackROI)
+				{ // Only process regions around the last blobs, with a periodic full frame search for new ones
+					// Blobs lag readbackDepth-1 frames and the regions apply to the next frame, so allow for that much motion
+					std::vector<Bounds> rois;
+					int margin = 32 * std::max(1, readbackDepth);
+					if (numFrames % 30 != 29)
+					{
+						for (int i = 0; i < blobs.size(); i++)
+						{
+							Bounds b = blobs[i].bounds;
+							rois.push_back({ b.minX - margin, b.minY - margin, b.maxX + margin, b.maxY + margin });
+						}
+					}
+					setBlobDetectionROI(rois);
+				}
 
 				// ---- Visualize blob detection ----
 
-				// Visualization view bounds
-			#ifdef BLOB_VIZ_FOCUS
-				Bounds viewBounds { camWidth, camHeight, 0, 0 };
-				for (int i = 0; i < blobs.size(); i++)
-				{
-					Bounds b = blobs[i].bounds;
-					viewBounds.minX = std::min(viewBounds.minX, b.minX - 50);
-					viewBounds.maxX = std::max(viewBounds.maxX, b.maxX + 50);
-					viewBounds.minY = std::min(viewBounds.minY, b.minY - 50);
-					viewBounds.maxY = std::max(viewBounds.maxY, b.maxY + 50);
-				}
-				float viewRatio = (float)(viewBounds.maxX-viewBounds.minX)/(viewBounds.maxY-viewBounds.minY);
-				float relRatio = viewRatio / ((float)dispWidth/dispHeight);
-				if (relRatio > 1)
-				{
-					viewBounds.minX -= (relRatio-1) * (viewBounds.maxX-viewBounds.minX) / 2;
-					viewBounds.maxX += (relRatio-1) * (viewBounds.maxX-viewBounds.minX) / 2;
-				}
-				if (relRatio < 1)
+				if (!headless && present.shouldPresent())
 				{
-					relRatio = 1/relRatio;
-					viewBounds.minY -= (relRatio-1) * (viewBounds.maxY-viewBounds.minY) / 2;
-					viewBounds.maxY += (relRatio-1) * (viewBounds.maxY-viewBounds.minY) / 2;
+					// Visualization view bounds
+				#ifdef BLOB_VIZ_FOCUS
+					Bounds viewBounds { camWidth, camHeight, 0, 0 };
+					for (int i = 0; i < blobs.size(); i++)
+					{
+						Bounds b = blobs[i].bounds;
+						viewBounds.minX = std::min(viewBounds.minX, b.minX - 50);
+						viewBounds.maxX = std::max(viewBounds.maxX, b.maxX + 50);
+						viewBounds.minY = std::min(viewBounds.minY, b.minY - 50);
+						viewBounds.maxY = std::max(viewBounds.maxY, b.maxY + 50);
+					}
+					float viewRatio = (float)(viewBounds.maxX-viewBounds.minX)/(viewBounds.maxY-viewBounds.minY);
+					float relRatio = viewRatio / ((float)dispWidth/dispHeight);
+					if (relRatio > 1)
+					{
+						viewBounds.minX -= (relRatio-1) * (viewBounds.maxX-viewBounds.minX) / 2;
+						viewBounds.maxX += (relRatio-1) * (viewBounds.maxX-viewBounds.minX) / 2;
+					}
+					if (relRatio < 1)
+					{
+						relRatio = 1/relRatio;
+						viewBounds.minY -= (relRatio-1) * (viewBounds.maxY-viewBounds.minY) / 2;
+						viewBounds.maxY += (relRatio-1) * (viewBounds.maxY-viewBounds.minY) / 2;
+					}
+				#else
+					Bounds viewBounds { 0, 0, camWidth, camHeight };
+				#endif
+
+					// Visualize found points
+					if (profiler) profiler->begin(passVisualize);
+					glViewport((int)((1-renderRatioCorrection) * dispWidth / 2), 0, (int)(renderRatioCorrection * dispWidth), dispHeight);
+					glBindFramebuffer(GL_FRAMEBUFFER, 0);
+					visualizeBlobDetection(blobs, viewBounds, (float)(viewBounds.maxX-viewBounds.minX)/dispWidth);
+					if (profiler) profiler->end(passVisualize);
+					if (profiler) profiler->begin(passSwap);
+					eglSwapBuffers(eglSetup.display, eglSetup.surface);
+					if (profiler) profiler->end(passSwap);
+					latency_stamp(latency, stagePresent, frame->captureUS);
 				}
-			#else
-				Bounds viewBounds { 0, 0, camWidth, camHeight };
-			#endif
-
-				// Visualize found points
-				glViewport((int)((1-renderRatioCorrection) * dispWidth / 2), 0, (int)(renderRatioCorrection * dispWidth), dispHeight);
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-				visualizeBlobDetection(blobs, viewBounds, (float)(viewBounds.maxX-viewBounds.minX)/dispWidth);
-				eglSwapBuffers(eglSetup.display, eglSetup.surface);
 
 				// ---- Debugging and Statistics ----
 
@@ -202,8 +319,11 @@ int main(int argc, char **argv)
 					int frames = (numFrames - lastFrames);
 					lastFrames = numFrames;
 					float fps = frames / elapsedS;
-					int droppedFrames = 0;
-					printf("%d frames over %.2fs (%.1ffps)! \n", frames, elapsedS, fps);
+					printf("%d frames over %.2fs (%.1ffps), %d dropped! \n", frames, elapsedS, fps, droppedFrames);
+					droppedFrames = 0;
+					GCS_Stats stats;
+					camGL_getStats(camGL, &stats);
+					printf("Camera: %u received, %u delivered, %u dropped unconsumed\n", stats.received, stats.delivered, stats.dropped);
 				}
 				if (numFrames % 10 == 0)
 				{ // Check for keys
@@ -212,6 +332,33 @@ int main(int argc, char **argv)
 					{
 						if (iscntrl(cin)) printf("%d", cin);
 						else if (cin == 'q') break;
+						else if (cin == 'p' && profiler) profiler->log(std::cout);
+						else if (cin == 't') latency_log(latency, stdout);
+						else if (cin == 'v') present.toggleFlag();
+						else if (cin == '+' || cin == '-')
+						{ // Tune exposure for the blobs while running
+							GCS_Controls controls;
+							camGL_getControls(camGL, &controls);
+							uint32_t shutter = controls.shutterSpeed == 0? 5000 : controls.shutterSpeed;
+							controls.shutterSpeed = std::max(10u, cin == '+'? shutter * 5 / 4 : shutter * 4 / 5);
+							controls.set = GCS_CONTROL_SHUTTER;
+							if (camGL_setControls(camGL, &controls) == CAMGL_SUCCESS)
+								printf("Shutter speed %uus\n", controls.shutterSpeed);
+						}
+						else if (cin == 'z')
+						{ // Zoom the sensor crop in on the first blob (or the center), cycling 1x, 2x and 4x
+							zoom = zoom >= 4? 1 : zoom*2;
+							float centerX = 0.5f, centerY = 0.5f, size = 1.0f / zoom;
+							if (!blobs.empty())
+							{
+								centerX = frame->crop.x + (blobs[0].bounds.minX + blobs[0].bounds.maxX) / 2.0f / camWidth * frame->crop.width;
+								centerY = frame->crop.y + (blobs[0].bounds.minY + blobs[0].bounds.maxY) / 2.0f / camHeight * frame->crop.height;
+							}
+							float cropX = std::min(std::max(centerX - size/2, 0.0f), 1 - size);
+							float cropY = std::min(std::max(centerY - size/2, 0.0f), 1 - size);
+							if (camGL_setCrop(camGL, cropX, cropY, size, size) == 0)
+								printf("Zoom %dx at %.2f, %.2f\n", zoom, cropX, cropY);
+						}
 						else printf("%c", cin);
 					}
 				}
@@ -220,14 +367,91 @@ int main(int argc, char **argv)
 				printf("Camera GL was interrupted with code %d!\n", status);
 			else
 				camGL_stopCamera(camGL);
+			latency_log(latency, stdout);
+			if (profiler)
+			{
+				profiler->log(std::cout);
+				if (profileCSV && !profiler->writeCSV(profileCSV))
+					printf("Failed to write profile to %s!\n", profileCSV);
+			}
 		}
 		camGL_destroy(camGL);
+		latency_destroy(latency);
 		terminateEGL(&eglSetup);
 
 		return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 }
 
+/* Runs blob detection on synthetic frames of moving LED blobs and scores the detections against their true positions */
+static int runSynthBenchmark(Profiler *profiler)
+{
+	SynthParams synthParams = {};
+	synthParams.width = camWidth;
+	synthParams.height = camHeight;
+	synthParams.lumaOnly = 1;
+	synthParams.blobCount = 16;
+	synthParams.gradient = 40;
+	synthParams.noise = 12;
+	synthParams.flickerDepth = 0.3f;
+	SynthScene *synth = synth_create(&synthParams);
+	if (!synth) return EXIT_FAILURE;
+	std::vector<uint8_t> frameData(synth_getFrameSize(synth));
+
+	// Frames are uploaded into a regular luminance texture
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, camWidth, camHeight, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+	CHECK_GL();
+
+	printf("Benchmarking blob detection on %d synthetic frames of %d blobs!\n", synthFrames, synthParams.blobCount);
+	SynthScore score = {};
+	std::vector<Cluster> blobs;
+	std::vector<float> blobX, blobY;
+	std::chrono::microseconds detectTime(0);
+	for (int i = 0; i < synthFrames; i++)
+	{
+		if (profiler) profiler->nextFrame();
+		synth_render(synth, frameData.data());
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, camWidth, camHeight, GL_LUMINANCE, GL_UNSIGNED_BYTE, frameData.data());
+
+		// Upload is not part of the detection time
+		auto startTime = std::chrono::high_resolution_clock::now();
+		blobs.clear();
+		performBlobDetectionTexture(texture, 0, blobs);
+		detectTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - startTime);
+
+		// Blobs flickered below the detection threshold are not expected
+		blobX.clear();
+		blobY.clear();
+		for (int b = 0; b < blobs.size(); b++)
+		{
+			blobX.push_back(blobs[b].centroid.X);
+			blobY.push_back(blobs[b].centroid.Y);
+		}
+		synth_score(synth, blobX.data(), blobY.data(), blobs.size(), 3.0f, 100, &score);
+	}
+	CHECK_GL();
+	glDeleteTextures(1, &texture);
+	synth_destroy(synth);
+
+	float detectMS = (float)detectTime.count() / 1000 / synthFrames;
+	uint32_t detections = score.truePositives + score.falsePositives;
+	uint32_t expected = score.truePositives + score.falseNegatives;
+	printf("Detection took %.2fms per frame (%.1ffps)! Precision %.1f%%, recall %.1f%% (%d true, %d false positives, %d missed)\n",
+		detectMS, 1000.0f / detectMS,
+		detections? 100.0f * score.truePositives / detections : 100.0f, expected? 100.0f * score.truePositives / expected : 100.0f,
+		score.truePositives, score.falsePositives, score.falseNegatives);
+	return EXIT_SUCCESS;
+}
+
 /* Sets console to raw mode which among others allows for non-blocking input, even over SSH */
 static void setConsoleRawMode()
 {
@@ -8,6 +8,10 @@
 #include "qpu_program.h"
 #include "qpu_info.h"
 #include "gcs.h"
+#include "present.hpp"
+#include "latency.h"
+#include "recorder.h"
+#include "synth.h"
 
 #include "interface/mmal/mmal_encodings.h"
 #include "bcm_host.h"
@@ -61,9 +65,11 @@ int main(int argc, char **argv)
 	bool enableQPU[12] = { 1,1,1,1, 1,1,1,1, 1,1,1,1 };
 	int padding = 0; // padding on both sides of the image - set up for 5x5 kernel (2 on each side)
 	int blockLength = 16;
+	PresentPolicy present(PRESENT_EVERY_N, 10); // Framebuffer debug view of masks
+	const char *recordFile = NULL;
 
 	int arg;
-	while ((arg = getopt(argc, argv, "c:w:h:f:s:i:m:b:o:t:da:e:q:p:l:")) != -1)
+	while ((arg = getopt(argc, argv, "c:w:h:f:s:i:m:b:o:t:da:e:q:p:l:v:r:RW:")) != -1)
 	{
 		switch (arg)
 		{
@@ -119,13 +125,27 @@ int main(int argc, char **argv)
 			case 'l':
 				blockLength = std::stoi(optarg);
 				break;
+			case 'v':
+				if (!present.parse(optarg))
+					printf("Unknown present policy %s (all, N, Rhz, key)!\n", optarg);
+				break;
+			case 'r':
+				params.replayFile = optarg;
+				params.replayLoop = true;
+				break;
+			case 'R':
+				params.replayMode = GCS_REPLAY_FREERUN;
+				break;
+			case 'W':
+				recordFile = optarg;
+				break;
 			default:
-				printf("Usage: %s -c codefile [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-m mode (full, tiled, bitmsk)] [-d display-to-fb] [-t max-num-frames]\n", argv[0]);
+				printf("Usage: %s -c codefile [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-m mode (full, tiled, bitmsk)] [-d display-to-fb] [-t max-num-frames] [-v present (all, N, Rhz, key)] [-r replay-file] [-R free-run replay] [-W record-file]\n", argv[0]);
 				break;
 		}
 	}
 	if (optind < argc - 1)
-		printf("Usage: %s -c codefile [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-m mode (full, tiled, bitmsk)] [-d display-to-fb] [-t max-num-frames]\n", argv[0]);
+		printf("Usage: %s -c codefile [-w width] [-h height] [-f fps] [-s shutter-speed-ns] [-i iso] [-m mode (full, tiled, bitmsk)] [-d display-to-fb] [-t max-num-frames] [-v present (all, N, Rhz, key)] [-r replay-file] [-R free-run replay] [-W record-file]\n", argv[0]);
 
 	// ---- Init ----
 
@@ -140,13 +160,22 @@ int main(int argc, char **argv)
 	QPU_UserProgramInfo upInfo;
 	// MMAL Camera
 	GCS *gcs;
+	Recorder *recorder = NULL;
 	// Camera emulation buffers
 	const int emulBufCnt = 4;
 	QPU_BUFFER camEmulBuf[emulBufCnt];
+	SynthScene *synth = NULL; // Renders emulated frames of moving blobs
+	// Replayed frames are not in VCSM and are copied for the QPU
+	QPU_BUFFER replayBuf;
 	// Frame Counter
 	auto startTime = std::chrono::high_resolution_clock::now();
 	auto lastTime = startTime;
 	int lastFrames = 0, numFrames = 0;
+	// Sensor-to-result latency and dropped frames
+	LatencyTracker *latency = latency_create();
+	int stageQPU = latency_addStage(latency, "qpu-done");
+	uint32_t lastSequence = 0;
+	int droppedFrames = 0;
 	// QPU usage
 	int qpusUsed = 0;
 	for (int i = 0; i < 12; i++)
@@ -310,31 +339,41 @@ int main(int argc, char **argv)
 
 	// Create GPU camera stream (MMAL camera)
 #ifdef RUN_CAMERA
+	if (recordFile && params.bufferCount == 0)
+		params.bufferCount = 6; // Recorder retains up to 2 frames while writing
 	gcs = gcs_create(&params);
 	if (gcs == NULL)
 	{
 		printf("Failed to greate GCS! \n");
 		goto error_gcs;
 	}
+	if (params.replayFile)
+		qpu_allocBuffer(&replayBuf, &base, gcs_getFrameSize(&params), 4096);
+	if (recordFile)
+	{
+		recorder = recorder_create(gcs, recordFile, NULL);
+		if (!recorder) printf("Failed to start recording to %s! \n", recordFile);
+	}
 	gcs_start(gcs);
 	printf("-- Camera Stream started --\n");
 #endif
 #ifndef USE_CAMERA
+	{ // Synthetic scene of moving LED blobs with known positions
+		SynthParams synthParams = {};
+		synthParams.width = params.width;
+		synthParams.height = params.height;
+		synthParams.blobCount = 8;
+		synthParams.gradient = 40;
+		synthParams.noise = 12;
+		synthParams.flickerDepth = 0.3f;
+		synth = synth_create(&synthParams);
+	}
 	for (int i = 0; i < emulBufCnt; i++)
 	{
 		qpu_allocBuffer(&camEmulBuf[i], &base, params.width*params.height*3, 4096); // Emulating full YUV frame
 		qpu_lockBuffer(&camEmulBuf[i]);
 		uint8_t *YUVFrameData = (uint8_t*)camEmulBuf[i].ptr.arm.vptr;
-		for (int y = 0; y < params.height; y++)
-		{
-			for (int x = 0; x < params.width; x++)
-			{
-				// Write test data in Y component (UV are after this, but are not used)
-				YUVFrameData[y*params.width + x] = ((x+params.width/(i+1))*255/params.width)%256 + ((y+params.height/(i+1))*255/params.height)%256;
-//				YUVFrameData[y*params.width + x] = ((y+params.height/(i+1))*255/params.height)%256;
-//				YUVFrameData[y*params.width + x] = ((y)*255/params.height)%256;
-			}
-		}
+		if (synth) synth_render(synth, YUVFrameData);
 		qpu_unlockBuffer(&camEmulBuf[i]);
 	}
 #endif
@@ -362,9 +401,11 @@ int main(int argc, char **argv)
 #ifdef RUN_CAMERA
 			// Get buffer data from opaque buffer handle
 			void *cameraBuffer = gcs_getFrameBufferData(cameraBufferHeader);
+			// Queue frame for recording, written to disk by the recorder thread
+			if (recorder) recorder_submit(recorder, cameraBufferHeader);
 			// Source: https://www.raspberrypi.org/forums/viewtopic.php?f=43&t=167652
 			// Get VCSM Handle of frameBuffer (works only if zero-copy is enabled, so buffer is in VCSM)
-			uint32_t cameraBufferHandle = vcsm_vc_hdl_from_ptr(cameraBuffer);
+			uint32_t cameraBufferHandle = params.replayFile? 0 : vcsm_vc_hdl_from_ptr(cameraBuffer);
 	#ifndef USE_CAMERA
 			// Lock VCSM buffer to get VC-space address
 			mem_lock(base.mb, cameraBufferHandle);
@@ -389,9 +430,21 @@ int main(int argc, char **argv)
 #endif
 #ifdef USE_CAMERA
 			// Lock VCSM buffer to get VC-space address
-			uint32_t cameraBufferPtr = mem_lock(base.mb, cameraBufferHandle);
+			uint32_t cameraBufferPtr;
+			if (params.replayFile)
+			{ // Copy replayed frame into QPU accessible memory
+				qpu_lockBuffer(&replayBuf);
+				memcpy(replayBuf.ptr.arm.vptr, cameraBuffer, gcs_getFrameSize(&params));
+				cameraBufferPtr = replayBuf.ptr.vc;
+			}
+			else
+				cameraBufferPtr = mem_lock(base.mb, cameraBufferHandle);
 #else
 			qpu_lockBuffer(&camEmulBuf[numFrames%emulBufCnt]);
+	#ifndef CPY_CAMERA
+			// Move blobs on in the emulated frame
+			if (synth) synth_render(synth, (uint8_t*)camEmulBuf[numFrames%emulBufCnt].ptr.arm.vptr);
+	#endif
 			uint32_t cameraBufferPtr = camEmulBuf[numFrames%emulBufCnt].ptr.vc;
 #endif
 #ifdef RUN_CAMERA
@@ -445,9 +498,18 @@ int main(int argc, char **argv)
 #endif
 #ifdef RUN_CAMERA
 			// Unlock VCSM buffer (no need to keep locked, VC-space adress won't change)
-			mem_unlock(base.mb, cameraBufferHandle);
+			if (params.replayFile)
+				qpu_unlockBuffer(&replayBuf);
+			else
+				mem_unlock(base.mb, cameraBufferHandle);
+			// Record sensor-to-result latency and dropped frames before the frame info is reused
+			const GCS_FrameInfo *frameInfo = gcs_getFrameBufferInfo(cameraBufferHeader);
+			latency_stamp(latency, stageQPU, frameInfo->captureUS);
+			if (lastSequence != 0 && frameInfo->sequence > lastSequence+1)
+				droppedFrames += frameInfo->sequence - lastSequence - 1;
+			lastSequence = frameInfo->sequence;
 			// Return camera buffer to camera
-			gcs_returnFrameBuffer(gcs);
+			gcs_releaseFrameBuffer(gcs, cameraBufferHeader);
 #endif
 
 			// Unlock target buffers
@@ -474,7 +536,8 @@ int main(int argc, char **argv)
 				int frames = (numFrames - lastFrames);
 				lastFrames = numFrames;
 				float fps = frames / elapsedS;
-				printf("%d frames over %.2fs (%.1ffps)! \n", frames, elapsedS, fps);
+				printf("%d frames over %.2fs (%.1ffps), %d dropped! \n", frames, elapsedS, fps, droppedFrames);
+				droppedFrames = 0;
 			}
 			if (numFrames % 10 == 0)
 			{ // Detailed QPU performance gathering (every 10th frame to handle QPU performance register overflows)
@@ -496,7 +559,7 @@ int main(int argc, char **argv)
 			static int ilCnt = 0;
 			int ilMax = 1;//2;
 			ilCnt = (ilCnt+1)%ilMax;
-			if (drawToFrameBuffer && (buffer == BITMSK || buffer == BLKMSK || buffer == BILMSK) && (numFrames % 10) < ilMax)
+			if (drawToFrameBuffer && (buffer == BITMSK || buffer == BLKMSK || buffer == BILMSK) && present.shouldPresent())
 			{ // Manual access to framebuffer
 				void *fbp = lock_fb(fbfd, finfo.smem_len);
 				if ((int)fbp == -1)
@@ -560,19 +623,33 @@ int main(int argc, char **argv)
 			{
 				if (iscntrl(cin)) printf("%d", cin);
 				else if (cin == 'q') break;
+				else if (cin == 't') latency_log(latency, stdout);
+				else if (cin == 'v') present.toggleFlag();
 				else printf("%c", cin);
 			}
 		}
 	}
 
 #ifdef RUN_CAMERA
+	latency_log(latency, stdout);
+	if (recorder)
+	{ // Finish writing before the camera buffers are destroyed
+		recorder_stop(recorder);
+		RecorderStats recStats;
+		recorder_getStats(recorder, &recStats);
+		recorder_destroy(recorder);
+		printf("Recorded %u frames (%u dropped) to %s\n", recStats.written, recStats.dropped, recordFile);
+	}
 	gcs_stop(gcs);
 	gcs_destroy(gcs);
+	if (params.replayFile)
+		qpu_releaseBuffer(&replayBuf);
 	printf("-- Camera Stream stopped --\n");
 #endif
 #ifndef USE_CAMERA
 	for (int i = 0; i < emulBufCnt; i++)
 		qpu_releaseBuffer(&camEmulBuf[i]);
+	synth_destroy(synth);
 #endif
 
 
@@ -601,6 +678,8 @@ error_qpu:
 
 	qpu_destroyBase(&base);
 
+	latency_destroy(latency);
+
 	return EXIT_SUCCESS;
 }
 